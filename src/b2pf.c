@@ -41,174 +41,498 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "b2pf_internal.h"
 
-#define UTF8   1        /* Number of bytes per code unit */
-#define UTF16  2
-#define UTF32  4
-
 #define KNOWN_OPTIONS (B2PF_UTF_16|B2PF_UTF_32|B2PF_INPUT_BACKCHARS| \
-  B2PF_INPUT_BACKCODES|B2PF_OUTPUT_BACKCHARS|B2PF_OUTPUT_BACKCODES)
+  B2PF_INPUT_BACKCODES|B2PF_OUTPUT_BACKCHARS|B2PF_OUTPUT_BACKCODES| \
+  B2PF_OVERFLOW_LENGTH|B2PF_CHECK_UNCHANGED)
+
+/* When formatting in pieces, the buffer is enlarged if it has fewer free
+elements than this. */
+
+#define PIECE_MINROOM 8
+
+/* When a string is formatted by several threads, each part of it has at least
+this many code units. */
+
+#define PART_MINSIZE 16384
+
+/* Structure for formatting one part of a string in a thread */
+
+typedef struct format_part {
+  b2pf_context *context;
+  const uint8_t *input;      /* start of this part */
+  size_t input_size;         /* its length in code units */
+  uint8_t *output;           /* output buffer */
+  size_t output_size;        /* its size in code units */
+  size_t length;             /* output length in code units */
+  size_t error_offset;       /* offset after an error, within the part */
+  int mode;                  /* UTF8, UTF16, or UTF32 */
+  int rc;                    /* result */
+} format_part;
 
 
 /*************************************************
-*             Invert a 32-bit vector             *
+*       Find where the output ran out            *
 *************************************************/
 
-/* Re-ordering can be by characters (that is, a base + optional combiners), or
-by codes, which is by individual code units.
+/* Overflow is discovered only when formatted output is encoded, but the error
+offset must be that of the input character whose output did not fit, as if
+formatting had stopped when the buffer was full. The code points that fit in
+the space that was left are counted, and the input is formatted again with
+that as the size of the output buffer. Formatting does the same thing each
+time, so it fails at the right place.
 
 Arguments:
-  p        points to the vector
-  size     number of elements
-  bychars  if TRUE, re-order characters with combiners
-  context  the current context
-
-Returns:   nothing
+  context        the context
+  match_data     a match data block, or NULL
+  cache          a word cache, or NULL
+  input          the input code points
+  count          the number of input code points
+  outbuffer      the formatted output, which is overwritten
+  outused        the number of output code points
+  mode           UTF8, UTF16, or UTF32
+  room           the number of code units that were available
+
+Returns:         the offset of the character whose output did not fit
 */
 
-static void
-invert(uint32_t *p, size_t size, BOOL bychars, b2pf_context *context)
+static size_t
+overflow_offset(b2pf_context *context, b2pf_match_data *match_data,
+  b2pf_word_cache *cache, const uint32_t *input, size_t count,
+  uint32_t *outbuffer, size_t outused, int mode, size_t room)
 {
-size_t i = 0;
-size_t j = size - 1;
-
-/* Inverting by code points is straightforward and we do that first. */
+size_t fit, used;
+size_t offset = 0;
 
-while (j > i)
+for (fit = 0; fit < outused; fit++)
   {
-  size_t temp = p[i];
-  p[i++] = p[j];
-  p[j--] = temp;
+  size_t n = PRIV(encoded_length)(outbuffer + fit, 1, mode);
+  if (n > room) break;
+  room -= n;
   }
 
-if (!bychars) return;
+(void)PRIV(format_string)(input, count, outbuffer, fit, &used, context, cache,
+  (match_data == NULL)? NULL : match_data->coverage,
+  (match_data == NULL)? LIG_ALL_GROUPS : match_data->groups, &offset);
+return offset;
+}
+
+
+
+/*************************************************
+*          Format a string in pieces             *
+*************************************************/
 
-/* Inverting by character requires checking for combining characters and moving
-them to after the following non-combiner. */
+/* This is used when neither the input nor the output is backwards. The input
+is validated and decoded a piece at a time into a small buffer. Everything up
+to the start of the last word in the buffer is then formatted and encoded
+straight into the output buffer, and the rest is carried over to the next
+piece. Because an unknown character always ends a word, and combiners that
+follow one are copied unchanged, a word is never split between pieces, and the
+output is the same as if the whole string were decoded at once. The working
+memory therefore depends on the length of the longest word, not the length of
+the string. The buffers on the stack are used unless a match data block has
+bigger ones; a word that does not fit gets private memory. Characters that
+cannot start a word are copied straight from the input to the output, without
+being decoded, when they start a piece. UTF-32 input is formatted where it is,
+without being copied.
+
+If the output buffer turns out to be too small, formatting continues without
+writing any more output, so that the length that is needed can be returned, as
+can any formatting error later in the string. Otherwise, the error offset is
+that of the first character whose output did not fit.
 
-for (i = 0; i < size; i++)
+Arguments:
+  context        the context, already checked
+  match_data     a match data block, or NULL
+  cache          a word cache, or NULL
+  input          the input string
+  input_size     its length in code units
+  mode           UTF8, UTF16, or UTF32
+  validated      TRUE if the input has already been validated
+  output         the output buffer
+  output_size    its size in code units
+  lengthptr      where to return the output length in code units; after
+                   B2PF_ERROR_OVERFLOW this is the length that is needed
+  error_offset   where to return an offset after an error
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+static int
+format_pieces(b2pf_context *context, b2pf_match_data *match_data,
+  b2pf_word_cache *cache, const uint8_t *input, size_t input_size, int mode,
+  BOOL validated, uint8_t *output, size_t output_size, size_t *lengthptr,
+  size_t *error_offset)
+{
+int yield = B2PF_SUCCESS;
+size_t expansion = context->expansion;
+size_t capacity = STACK_BUFFSIZE/expansion;  /* Code points per piece */
+size_t carry = 0;      /* Code points carried over */
+size_t unitpos = 0;    /* Code units taken from the input */
+size_t charpos = 0;    /* Code points formatted */
+size_t length = 0;     /* Output code units */
+size_t overflow_at = 0;  /* Offset of the first character that did not fit */
+BOOL overflow = FALSE;
+uint32_t *inbuffer, *outbuffer;
+uint32_t stack_inbuffer[STACK_BUFFSIZE] B2PF_KEEP_UNINITIALIZED;
+uint32_t stack_outbuffer[STACK_BUFFSIZE] B2PF_KEEP_UNINITIALIZED;
+
+if (match_data != NULL && match_data->buffsize > STACK_BUFFSIZE)
+  {
+  inbuffer = match_data->inbuffer;
+  outbuffer = match_data->outbuffer;
+  capacity = match_data->buffsize/expansion;
+  }
+else
   {
-  tree_node *t = PRIV(tree_search)(context->chartreebase, p[i]);
+  inbuffer = stack_inbuffer;
+  outbuffer = stack_outbuffer;
+  }
+
+for (;;)
+  {
+  int rc;
+  size_t take, count, cut, offset, outused;
+  const uint32_t *inptr;
+  uint32_t *outptr;
 
-  if (t == NULL || t->type != CT_COMB) continue;
+  /* Make sure there is room for a few more characters. This fails only when
+  a word is longer than the buffer. */
 
-  for(j = i + 1; j < size; j++)
+  if (capacity - carry < PIECE_MINROOM)
     {
-    t = PRIV(tree_search)(context->chartreebase, p[j]);
-    if (t == NULL || t->type != CT_COMB) break;
+    uint32_t *newin, *newout;
+    size_t newcap = (capacity < PIECE_MINROOM)? 2*PIECE_MINROOM : 2*capacity;
+
+    if (newcap > SIZE_MAX/(expansion * sizeof(uint32_t)))
+      {
+      yield = B2PF_ERROR_MEMORY;
+      goto EXIT;
+      }
+
+    newin = context->malloc(newcap * sizeof(uint32_t), context->memory_data);
+    newout = context->malloc(newcap * expansion * sizeof(uint32_t),
+      context->memory_data);
+    if (newin == NULL || newout == NULL)
+      {
+      if (newin != NULL) context->free(newin, context->memory_data);
+      if (newout != NULL) context->free(newout, context->memory_data);
+      yield = B2PF_ERROR_MEMORY;
+      goto EXIT;
+      }
+
+    if (mode != UTF32) memcpy(newin, inbuffer, carry * sizeof(uint32_t));
+    if (inbuffer != stack_inbuffer &&
+        (match_data == NULL || inbuffer != match_data->inbuffer))
+      {
+      context->free(inbuffer, context->memory_data);
+      context->free(outbuffer, context->memory_data);
+      }
+    inbuffer = newin;
+    outbuffer = newout;
+    capacity = newcap;
     }
 
-  /* If j is at the end, there is no base character. Just ignore anomalous
-  case. Otherwise, pick up the base character, shift up all the combiners, and
-  put the base at the start. */
+  /* Take as many code units as there are free elements, because each code
+  unit yields at most one code point, but without splitting a character. */
 
-  if (j < size)
+  take = input_size - unitpos;
+  if (take > capacity - carry)
     {
-    size_t k;
-    uint32_t c = p[j];
-    for (k = j; k > i; k--) p[k] = p[k-1];
-    p[i] = c;
+    take = capacity - carry;
+    if (mode == UTF8)
+      {
+      int k;
+      for (k = 0; k < 5 && (input[unitpos + take] & 0xc0u) == 0x80u; k++)
+        take--;
+      }
+    else if (mode == UTF16)
+      {
+      if ((((const uint16_t *)input)[unitpos + take] & 0xfc00u) == 0xdc00u)
+        take--;
+      }
+    }
+
+  /* A piece is validated on its own, but an invalid sequence may straddle
+  its end, giving a different error. Everything before the piece is valid, so
+  when there is an error, validating the rest of the input finds the first
+  one, as for the whole string. */
+
+  if (!validated)
+    {
+    rc = PRIV(valid_utf)(input + unitpos * mode, take, mode, &offset);
+    if (rc != B2PF_SUCCESS)
+      {
+      if (take < input_size - unitpos)
+        {
+        size_t offset2;
+        int rc2 = PRIV(valid_utf)(input + unitpos * mode,
+          input_size - unitpos, mode, &offset2);
+        if (rc2 != B2PF_SUCCESS)
+          {
+          rc = rc2;
+          offset = offset2;
+          }
+        }
+      *error_offset = unitpos + offset;
+      yield = rc;
+      goto EXIT;
+      }
     }
 
-  i = j + 1;  /* Next character to consider. */
+  /* If nothing is carried over, copy any leading characters that cannot start
+  a word; their encoding is unchanged. */
+
+  if (carry == 0)
+    {
+    size_t chars;
+    size_t skip = PRIV(skip_nonword_units)(context, input + unitpos * mode,
+      take, mode, &chars);
+
+    if (skip > 0)
+      {
+      if (!overflow && output_size - length >= skip)
+        memcpy(output + length * mode, input + unitpos * mode, skip * mode);
+
+      /* Count the characters that fit; one that is split does not. */
+
+      else if (!overflow)
+        {
+        size_t n, room = output_size - length;
+        overflow_at = charpos;
+        for (n = 1; n <= room; n++)
+          {
+          if (mode == UTF8)
+            { if ((input[unitpos + n] & 0xc0u) != 0x80u) overflow_at++; }
+          else if (mode == UTF16)
+            {
+            if ((((const uint16_t *)input)[unitpos + n] & 0xfc00u) != 0xdc00u)
+              overflow_at++;
+            }
+          else overflow_at++;
+          }
+        overflow = TRUE;
+        }
+      length += skip;
+      unitpos += skip;
+      take -= skip;
+      charpos += chars;
+      }
+    }
+
+  /* UTF-32 input is formatted where it is, because formatting does not
+  change it; the carried code points are those that precede the new ones.
+  Otherwise, decode the new code units after the carried code points. */
+
+  if (mode == UTF32)
+    {
+    inptr = (const uint32_t *)input + unitpos - carry;
+    count = carry + take;
+    }
+  else
+    {
+    inptr = inbuffer;
+    count = carry + PRIV(decode)(input + unitpos * mode, take, mode,
+      inbuffer + carry);
+    }
+  unitpos += take;
+
+  /* At the end of the input, everything is formatted. Otherwise, cut after
+  the last unknown character and any combiners that follow it. */
+
+  if (unitpos >= input_size) cut = count; else
+    {
+    for (cut = count; cut > 0; cut--)
+      if (GET_PROPS(context, inptr[cut-1])->type == CT_NONE) break;
+    while (cut < count && GET_PROPS(context, inptr[cut])->type == CT_COMB)
+      cut++;
+    }
+
+  if (cut > 0)
+    {
+    size_t room = overflow? 0 : output_size - length;
+
+    /* UTF-32 output is formatted in place if there is room for the worst
+    case. The error offset from formatting is relative to this piece; an
+    offset is returned even on success (the start of the last word), so the
+    adjustment is undone if there are no words. */
+
+    outptr = (mode == UTF32 && room >= cut * expansion)?
+      (uint32_t *)output + length : outbuffer;
+
+    offset = *error_offset - charpos;
+    rc = PRIV(format_string)(inptr, cut, outptr, cut * expansion, &outused,
+      context, cache, (match_data == NULL)? NULL : match_data->coverage,
+      (match_data == NULL)? LIG_ALL_GROUPS : match_data->groups, &offset);
+    *error_offset = charpos + offset;
+    if (rc != B2PF_SUCCESS)
+      {
+      yield = rc;
+      goto EXIT;
+      }
+
+    if (outptr != outbuffer) length += outused;
+    else if (!overflow && PRIV(encode)(outbuffer, outused, mode,
+        output + length * mode, room, &outused) == B2PF_SUCCESS)
+      length += outused;
+    else
+      {
+      length += PRIV(encoded_length)(outbuffer, outused, mode);
+      if (!overflow)
+        overflow_at = charpos + overflow_offset(context, match_data, cache,
+          inptr, cut, outbuffer, outused, mode, room);
+      overflow = TRUE;
+      }
+
+    if (inptr == inbuffer)
+      memmove(inbuffer, inbuffer + cut, (count - cut) * sizeof(uint32_t));
+    charpos += cut;
+    }
+
+  carry = count - cut;
+  if (unitpos >= input_size) break;
   }
+
+EXIT:
+if (inbuffer != stack_inbuffer &&
+    (match_data == NULL || inbuffer != match_data->inbuffer))
+  {
+  context->free(inbuffer, context->memory_data);
+  context->free(outbuffer, context->memory_data);
+  }
+
+*lengthptr = length;
+if (yield != B2PF_SUCCESS) return yield;
+if (!overflow) return B2PF_SUCCESS;
+*error_offset = overflow_at;
+return B2PF_ERROR_OVERFLOW;
 }
 
 
 
 /*************************************************
-*        Main action: format a UTF string        *
+*      Format a whole string at once             *
 *************************************************/
 
-B2PF_EXP_DEFN int
-b2pf_format_string(b2pf_context *context, void *input_string, size_t input_size,
+/* This is used when the input or the output is backwards, because then the
+whole string must be reversed. Backwards input is decoded from its end, and
+backwards output is encoded from the end of the output buffer, so reversing
+costs no extra passes. Working memory for large strings is obtained
+from the match data block if one is given, where it is kept for re-use;
+otherwise it is obtained and freed for each call.
+
+If the output buffer is too small, the match data's grow callback is used to
+obtain a bigger one, if there is one and growing is allowed. Otherwise, if
+B2PF_OVERFLOW_LENGTH is set, the length that is needed is returned in
+output_used along with B2PF_ERROR_OVERFLOW.
+
+Arguments:
+  context        the context, already checked
+  match_data     a match data block, or NULL
+  cache          a word cache, or NULL
+  input_string   the input string
+  input_size     its length in code units
+  mode           UTF8, UTF16, or UTF32
+  output_string  the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  cangrow        TRUE if the output buffer may be grown
+  error_offset   where to return an offset after an error
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+static int
+format_whole(b2pf_context *context, b2pf_match_data *match_data,
+  b2pf_word_cache *cache, void *input_string, size_t input_size, int mode,
   void *output_string, size_t output_size, size_t *output_used,
-  uint32_t options, size_t *error_offset)
+  uint32_t options, BOOL cangrow, size_t *error_offset)
 {
-int yield = B2PF_SUCCESS;
-int mode;
-size_t insize, outsize, outused;
+int yield;
+size_t insize, outsize, outused, outneeded;
+BOOL copy_input = mode != UTF32 ||
+  (options & (B2PF_INPUT_BACKCHARS|B2PF_INPUT_BACKCODES)) != 0;
+const uint32_t *inptr;
 uint32_t *inbuffer = NULL;
 uint32_t *outbuffer = NULL;
 uint32_t stack_inbuffer[STACK_BUFFSIZE] B2PF_KEEP_UNINITIALIZED;
 uint32_t stack_outbuffer[STACK_BUFFSIZE]B2PF_KEEP_UNINITIALIZED;
 
-/* Plausibility checks */
-
-if (context == NULL || input_string == NULL || output_string == NULL ||
-    output_used == NULL || error_offset == NULL) return B2PF_ERROR_NULL;
-
-if ((options & ~KNOWN_OPTIONS) != 0 ||
-    (options & (B2PF_UTF_16|B2PF_UTF_32)) == (B2PF_UTF_16|B2PF_UTF_32) ||
-    (options & (B2PF_INPUT_BACKCODES|B2PF_INPUT_BACKCHARS)) ==
-               (B2PF_INPUT_BACKCODES|B2PF_INPUT_BACKCHARS) ||
-    (options & (B2PF_OUTPUT_BACKCODES|B2PF_OUTPUT_BACKCHARS)) ==
-               (B2PF_OUTPUT_BACKCODES|B2PF_OUTPUT_BACKCHARS))
-  return B2PF_ERROR_BADOPTIONS;
-
-/* Set up */
+/* Validate the UTF input. */
 
-*error_offset = 0;
-mode = ((options & B2PF_UTF_32) != 0)? UTF32 :
-       ((options & B2PF_UTF_16) != 0)? UTF16 : UTF8;
-
-/* For each code unit width, validate the UTF input/ */
-
-if (mode == UTF8)
-  yield = PRIV(valid_utf8)((uint8_t *)input_string, input_size,
-    error_offset);
-else if (mode == UTF16)
-  yield = PRIV(valid_utf16)((uint16_t *)input_string, input_size,
-    error_offset);
-else   /* UTF-32 */
-  yield = PRIV(valid_utf32)((uint32_t *)input_string, input_size,
-    error_offset);
+yield = PRIV(valid_utf)(input_string, input_size, mode, error_offset);
 if (yield != B2PF_SUCCESS) goto EXIT;
 
-/* Sort out the buffers. For UTF-8 and UTF-16, input must be converted to
-UTF-32 in a local buffer. We also copy UTF-32 input so that we can shuffle the
-characters if necessary when handling ligatures. If there are more input code
-units than available elements in the on-stack input buffer, get memory. This
+/* Sort out the buffers. For UTF-8 and UTF-16, and for backwards UTF-32, input
+must be converted to UTF-32 in reading order in a local buffer. Other UTF-32
+input is used where it is, because formatting does not change it. If there are
+more input code units than available elements in the on-stack input buffer,
+get memory (for the output, if not for the input). This
 means we are safe, even when every input code unit codes for one character.
 It's overkill for other cases, but does no harm (other than using more than
 minimal resources). In practice, STACK_BUFFSIZE should be large enough to cater
-for the majority of cases. */
+for the majority of cases. The output can have more code points than the input
+only if the context has rules whose replacements are longer than what they
+replace; the output buffer is made big enough for the worst case, so that an
+overflow is discovered only when the output is encoded, at which point the
+exact length is known. */
+
+outneeded = input_size * context->expansion;
 
-if (input_size > STACK_BUFFSIZE)
+if (outneeded <= STACK_BUFFSIZE)
   {
-  inbuffer = context->malloc(input_size * sizeof(uint32_t),
-    context->memory_data);
-  if (inbuffer == NULL)
+  inbuffer = stack_inbuffer;
+  }
+else if (match_data != NULL)
+  {
+  if (match_data->buffsize < outneeded &&
+      !PRIV(match_data_grow)(match_data, outneeded))
     {
     yield = B2PF_ERROR_MEMORY;
     goto EXIT;
     }
+  inbuffer = match_data->inbuffer;
+  }
+else if (!copy_input)
+  {
+  inbuffer = NULL;
   }
 else
   {
-  inbuffer = stack_inbuffer;
+  inbuffer = context->malloc(input_size * sizeof(uint32_t),
+    context->memory_data);
+  if (inbuffer == NULL)
+    {
+    yield = B2PF_ERROR_MEMORY;
+    goto EXIT;
+    }
   }
 
-/* A 32-bit local output buffer is also required, except for UTF-32, when the
-argument buffer can be used. For UTF-8 and UTF-16, if we got memory for an
-input buffer, also get an output buffer of the same size. There's no need for
-UTF-32; a small output buffer will be discovered during processing instead of
-afterwards, but that's OK. */
+/* A 32-bit local output buffer is also required, except for UTF-32 when the
+argument buffer is big enough for the worst case and the output is not
+backwards. If we are not using the stack for input, use an output buffer from
+the match data if there is one. */
 
-if (mode == UTF32)
+if (mode == UTF32 && output_string != NULL && output_size >= outneeded &&
+    (options & (B2PF_OUTPUT_BACKCHARS|B2PF_OUTPUT_BACKCODES)) == 0)
   {
   outbuffer = (uint32_t *)output_string;
   outsize = output_size;
   }
 else if (inbuffer != stack_inbuffer)
   {
-  outbuffer = context->malloc(input_size * sizeof(uint32_t),
-    context->memory_data);
-  if (outbuffer == NULL)
+  if (match_data != NULL) outbuffer = match_data->outbuffer; else
     {
-    yield = B2PF_ERROR_MEMORY;
-    goto EXIT;
+    outbuffer = context->malloc(outneeded * sizeof(uint32_t),
+      context->memory_data);
+    if (outbuffer == NULL)
+      {
+      yield = B2PF_ERROR_MEMORY;
+      goto EXIT;
+      }
     }
-  outsize = input_size;
+  outsize = outneeded;
   }
 else
   {
@@ -216,140 +540,807 @@ else
   outsize = STACK_BUFFSIZE;
   }
 
-/* Decode the input string into 32-bit code points. */
+/* Decode the input string into 32-bit code points, in reading order. UTF-32
+input that is not backwards is formatted where it is. */
 
-insize = 0;
+if (!copy_input)
+  {
+  inptr = (const uint32_t *)input_string;
+  insize = input_size;
+  }
+else
+  {
+  inptr = inbuffer;
+  if ((options & (B2PF_INPUT_BACKCHARS|B2PF_INPUT_BACKCODES)) != 0)
+    insize = PRIV(decode_back)(input_string, input_size, mode,
+      ((options & B2PF_INPUT_BACKCHARS) != 0)? context : NULL, inbuffer);
+  else
+    insize = PRIV(decode)(input_string, input_size, mode, inbuffer);
+  }
+
+yield = PRIV(format_string)(inptr, insize, outbuffer, outsize, &outused,
+  context, cache, (match_data == NULL)? NULL : match_data->coverage,
+  (match_data == NULL)? LIG_ALL_GROUPS : match_data->groups, error_offset);
+if (yield != B2PF_SUCCESS) goto EXIT;
 
-if (mode == UTF8)
+/* Copy the output back to UTF-32, UTF-16 or UTF-8. In the UTF-32 case, the
+copy is needed only if we used an internal buffer, which is always the case
+for backwards output. First check that it will fit, and if not, either get a
+bigger buffer or give up. */
+
+if (outbuffer != output_string)
   {
-  uint8_t *p8 = (uint8_t *)input_string;
-  uint8_t *p8end = p8 + input_size;
-  while (p8 < p8end)
+  size_t length = PRIV(encoded_length)(outbuffer, outused, mode);
+  if (length > output_size)
+    {
+    if (cangrow && match_data != NULL && match_data->grow != NULL)
+      {
+      output_string = match_data->grow(output_string, length,
+        match_data->grow_data);
+      if (output_string == NULL)
+        {
+        yield = B2PF_ERROR_MEMORY;
+        goto EXIT;
+        }
+      output_size = length;
+      }
+    else
+      {
+      if ((options & B2PF_OVERFLOW_LENGTH) != 0) *output_used = length;
+      *error_offset = overflow_offset(context, match_data, cache, inptr,
+        insize, outbuffer, outused, mode, output_size);
+      yield = B2PF_ERROR_OVERFLOW;
+      goto EXIT;
+      }
+    }
+
+  if ((options & (B2PF_OUTPUT_BACKCHARS|B2PF_OUTPUT_BACKCODES)) != 0)
     {
-    uint32_t c;
-    GETUTF8INC(c, p8);
-    inbuffer[insize++] = c;
+    PRIV(encode_back)(outbuffer, outused, mode,
+      ((options & B2PF_OUTPUT_BACKCHARS) != 0)? context : NULL, output_string,
+      length);
+    *output_used = length;
+    goto EXIT;
     }
   }
 
-else if (mode == UTF16)
+yield = PRIV(encode)(outbuffer, outused, mode, output_string, output_size,
+  output_used);
+
+EXIT:
+if (match_data == NULL)
+  {
+  if (inbuffer != NULL && inbuffer != stack_inbuffer)
+    context->free(inbuffer, context->memory_data);
+
+  if (outbuffer != NULL && outbuffer != stack_outbuffer &&
+      outbuffer != output_string)
+    context->free(outbuffer, context->memory_data);
+  }
+
+return yield;
+}
+
+
+
+/*************************************************
+*      Check for input that cannot change        *
+*************************************************/
+
+/* The input is validated, and if it contains no characters that can start a
+word, formatting would not change it.
+
+Arguments:
+  context        the context, already checked
+  input_string   the input string
+  input_size     its length in code units
+  mode           UTF8, UTF16, or UTF32
+  output_used    where to return the input size if it is unchanged
+  error_offset   where to return an offset after an error
+
+Returns:         B2PF_SUCCESS if the input must be formatted, B2PF_UNCHANGED,
+                   or a UTF error code
+*/
+
+static int
+check_unchanged(b2pf_context *context, void *input_string, size_t input_size,
+  int mode, size_t *output_used, size_t *error_offset)
+{
+size_t chars;
+int rc = PRIV(valid_utf)(input_string, input_size, mode, error_offset);
+if (rc != B2PF_SUCCESS) return rc;
+if (PRIV(skip_nonword_units)(context, input_string, input_size, mode,
+      &chars) == input_size)
+  {
+  *output_used = input_size;
+  return B2PF_UNCHANGED;
+  }
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*       Format one string in a checked context   *
+*************************************************/
+
+/* This is called for a single string, and for each string in a batch, after
+the arguments and options have been checked, and the context has been checked
+if necessary. Unless the input or output is backwards, the string is formatted
+in pieces, so that only a small amount of working memory is needed. Otherwise,
+working memory for large strings is taken from the match data block if one is
+given, where it is kept for re-use; the block's high-water mark is updated in
+either case.
+
+Arguments:
+  context        the context, already checked
+  match_data     a match data block, or NULL
+  cache          a word cache, or NULL
+  input_string   the input string
+  input_size     its length in code units
+  mode           UTF8, UTF16, or UTF32
+  output_string  the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  cangrow        TRUE if the output buffer may be grown
+  check_yield    the result of checking the context
+  error_offset   where to return an offset after an error
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+static int
+format_one(b2pf_context *context, b2pf_match_data *match_data,
+  b2pf_word_cache *cache, void *input_string, size_t input_size, int mode,
+  void *output_string, size_t output_size, size_t *output_used,
+  uint32_t options, BOOL cangrow, int check_yield, size_t *error_offset)
+{
+int yield;
+size_t length;
+BOOL validated = FALSE;
+
+*error_offset = 0;
+
+if (match_data != NULL && input_size > match_data->highwater)
+  match_data->highwater = input_size;
+
+/* Backwards input or output needs the whole string at once. */
+
+if ((options & (B2PF_INPUT_BACKCHARS|B2PF_INPUT_BACKCODES|
+     B2PF_OUTPUT_BACKCHARS|B2PF_OUTPUT_BACKCODES)) != 0)
   {
-  size_t i;
-  uint16_t *p16 = (uint16_t *)input_string;
+  yield = format_whole(context, match_data, cache, input_string, input_size,
+    mode, output_string, output_size, output_used, options, cangrow,
+    error_offset);
+  return (yield == B2PF_SUCCESS)? check_yield : yield;
+  }
+
+/* If requested, and there was no context check error, find out whether the
+input contains any characters that can start a word. If not, the output would
+be identical to the input, so none is written. */
+
+if ((options & B2PF_CHECK_UNCHANGED) != 0 && check_yield == B2PF_SUCCESS)
+  {
+  yield = check_unchanged(context, input_string, input_size, mode,
+    output_used, error_offset);
+  if (yield != B2PF_SUCCESS) return yield;
+  validated = TRUE;
+  }
 
-  for (i = 0; i < input_size; i++)
+/* Otherwise, format in pieces. If the output does not fit, the length that is
+needed is known only at the end, so a grown buffer is filled by formatting
+again. */
+
+yield = format_pieces(context, match_data, cache, input_string, input_size,
+  mode, validated, output_string, output_size, &length, error_offset);
+
+if (yield == B2PF_ERROR_OVERFLOW)
+  {
+  if (cangrow && match_data != NULL && match_data->grow != NULL)
     {
-    uint32_t c = *p16++;
-    if ((c & 0xfc00u) == 0xd800u)
-      {
-      c = (((c & 0x3ffu) << 10) | (*p16++ & 0x3ffu)) + 0x10000u;
-      i++;
-      }
-    inbuffer[insize++] = c;
+    output_string = match_data->grow(output_string, length,
+      match_data->grow_data);
+    if (output_string == NULL) return B2PF_ERROR_MEMORY;
+    yield = format_pieces(context, match_data, cache, input_string,
+      input_size, mode, TRUE, output_string, length, &length, error_offset);
     }
+  else if ((options & B2PF_OVERFLOW_LENGTH) != 0) *output_used = length;
+  }
+
+if (yield != B2PF_SUCCESS) return yield;
+
+/* All done. If there was a context check error, it is returned now. */
+
+*output_used = length;
+return check_yield;
+}
+
+
+
+/*************************************************
+*       Check the arguments for formatting       *
+*************************************************/
+
+/* The options are checked, and if the context has changed since it was last
+used, it is compiled and checked. A check error is remembered, but processing
+continues. The cache from the match data is chosen; it is used only with the
+context for which it was created, and not if there is a ligature callback, a
+coverage set, or a restricted set of ligature groups, any of which might give
+different answers. A coverage set must have been created for this context.
+
+Arguments:
+  context        the context
+  match_data     a match data block, or NULL
+  options        option bits
+  modeptr        where to return UTF8, UTF16, or UTF32
+  cacheptr       where to return the word cache, or NULL
+  check_yield    where to return the result of checking the context
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+static int
+format_setup(b2pf_context *context, b2pf_match_data *match_data,
+  uint32_t options, int *modeptr, b2pf_word_cache **cacheptr,
+  int *check_yield)
+{
+if ((options & ~KNOWN_OPTIONS) != 0 ||
+    (options & (B2PF_UTF_16|B2PF_UTF_32)) == (B2PF_UTF_16|B2PF_UTF_32) ||
+    (options & (B2PF_INPUT_BACKCODES|B2PF_INPUT_BACKCHARS)) ==
+               (B2PF_INPUT_BACKCODES|B2PF_INPUT_BACKCHARS) ||
+    (options & (B2PF_OUTPUT_BACKCODES|B2PF_OUTPUT_BACKCHARS)) ==
+               (B2PF_OUTPUT_BACKCODES|B2PF_OUTPUT_BACKCHARS))
+  return B2PF_ERROR_BADOPTIONS;
+
+*check_yield = B2PF_SUCCESS;
+if (!context->checked)
+  {
+  *check_yield = PRIV(check_context)(context);
+  if (*check_yield == B2PF_ERROR_MEMORY) return *check_yield;
   }
+else if (context->check_error != CHECK_ERROR0)
+  *check_yield = B2PF_ERROR_CONTEXTCHECK;
+
+*modeptr = ((options & B2PF_UTF_32) != 0)? UTF32 :
+           ((options & B2PF_UTF_16) != 0)? UTF16 : UTF8;
 
-else  /* UTF-32 */
+*cacheptr = NULL;
+if (match_data != NULL && match_data->coverage != NULL)
   {
-  memcpy(inbuffer, input_string, sizeof(uint32_t)*input_size);
-  insize = input_size;
+  if (match_data->coverage->context != context) return B2PF_ERROR_COVERAGE;
   }
+else if (match_data != NULL && match_data->cache != NULL &&
+    match_data->cache->context == context &&
+    match_data->groups == LIG_ALL_GROUPS &&
+    (context->options & B2PF_CALLBACK_LIGATURE) == 0)
+  *cacheptr = match_data->cache;
 
-/* If the input is backwards, invert it, then process it, and invert the output
-if necessary. */
+return B2PF_SUCCESS;
+}
 
-if ((options & (B2PF_INPUT_BACKCHARS|B2PF_INPUT_BACKCODES)) != 0)
-  invert(inbuffer, insize, (options & B2PF_INPUT_BACKCHARS) != 0, context);
 
-yield = PRIV(format_string)(inbuffer, insize, outbuffer, outsize, &outused,
-  context, error_offset);
-if (yield != B2PF_SUCCESS && yield != B2PF_ERROR_CONTEXTCHECK) goto EXIT;
 
-if ((options & (B2PF_OUTPUT_BACKCHARS|B2PF_OUTPUT_BACKCODES)) != 0)
-  invert(outbuffer, outused, (options & B2PF_OUTPUT_BACKCHARS) != 0, context);
+/*************************************************
+*        Main action: format a UTF string        *
+*************************************************/
 
-/* Copy the output back to UTF-32, UTF-16 or UTF-8. In the UTF-32 case, the
-copy is needed only if we used an internal buffer. */
+/* If the context has been frozen, it is not modified, so this function may be
+called from several threads at once with the same context, provided each uses
+its own match data block.
+
+If the output buffer is too small, the match data's grow callback is used to
+obtain a bigger one, if there is one. Otherwise, if B2PF_OVERFLOW_LENGTH is
+set, the length that is needed is returned in output_used along with
+B2PF_ERROR_OVERFLOW. The output buffer may be NULL if its size is zero.
 
-if (mode == UTF32)
+Arguments:
+  context        the context
+  match_data     a match data block, or NULL
+  input_string   the input string
+  input_size     its length in code units
+  output_string  the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  error_offset   where to return an offset after an error
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_format_string_md(b2pf_context *context, b2pf_match_data *match_data,
+  void *input_string, size_t input_size, void *output_string,
+  size_t output_size, size_t *output_used, uint32_t options,
+  size_t *error_offset)
+{
+int rc, mode, check_yield;
+b2pf_word_cache *cache;
+
+if (context == NULL || input_string == NULL ||
+    (output_string == NULL && output_size != 0) ||
+    output_used == NULL || error_offset == NULL) return B2PF_ERROR_NULL;
+
+rc = format_setup(context, match_data, options, &mode, &cache, &check_yield);
+if (rc != B2PF_SUCCESS) return rc;
+
+return format_one(context, match_data, cache, input_string, input_size, mode,
+  output_string, output_size, output_used, options, TRUE, check_yield,
+  error_offset);
+}
+
+
+
+/*************************************************
+*      Format a batch of independent strings     *
+*************************************************/
+
+/* The options are checked, and the context is checked if necessary, once for
+the whole batch. The outputs are packed one after another into a single output
+buffer. The output of string i occupies the code units from offsets[i] to
+offsets[i+1], and the result of formatting it, which is the same as a single
+call would return, is placed in results[i]. If a string's output does not fit
+in the remaining space, its result is B2PF_ERROR_OVERFLOW, and so are the
+results of all the strings after it, none of which is formatted; the output
+buffer is not grown. The output is empty for a string that is unchanged or has
+an error.
+
+Arguments:
+  context        the context
+  match_data     a match data block, or NULL
+  count          the number of strings
+  inputs         a vector of pointers to the input strings
+  input_sizes    a vector of their lengths in code units
+  output         the output buffer
+  output_size    its size in code units
+  offsets        a vector of count + 1 output offsets in code units
+  results        a vector of count results
+  error_offsets  a vector of count offsets after an error, or NULL
+  options        option bits, which apply to every string
+
+Returns:         B2PF_SUCCESS if every string was formatted, whatever its
+                   result, B2PF_ERROR_OVERFLOW if some were not, or another
+                   error code if none was formatted
+*/
+
+B2PF_EXP_DEFN int
+b2pf_format_batch(b2pf_context *context, b2pf_match_data *match_data,
+  size_t count, void **inputs, const size_t *input_sizes, void *output,
+  size_t output_size, size_t *offsets, int *results, size_t *error_offsets,
+  uint32_t options)
+{
+int rc, mode, check_yield;
+size_t i;
+size_t length = 0;
+b2pf_word_cache *cache;
+
+if (context == NULL || (count > 0 && (inputs == NULL ||
+    input_sizes == NULL || results == NULL)) || offsets == NULL ||
+    (output == NULL && output_size != 0)) return B2PF_ERROR_NULL;
+
+rc = format_setup(context, match_data, options, &mode, &cache, &check_yield);
+if (rc != B2PF_SUCCESS) return rc;
+
+/* Overflow lengths are not returned for individual strings. */
+
+options &= ~B2PF_OVERFLOW_LENGTH;
+offsets[0] = 0;
+
+for (i = 0; i < count; i++)
   {
-  if (outbuffer != output_string)
+  size_t used = 0;
+  size_t offset = 0;
+
+  if (inputs[i] == NULL) rc = B2PF_ERROR_NULL;
+  else rc = format_one(context, match_data, cache, inputs[i], input_sizes[i],
+    mode, (output == NULL)? NULL : (uint8_t *)output + length * mode,
+    output_size - length, &used, options, FALSE, check_yield, &offset);
+
+  results[i] = rc;
+  if (error_offsets != NULL) error_offsets[i] = offset;
+
+  if (rc == B2PF_ERROR_OVERFLOW)
     {
-    if (outused > output_size) goto OVERFLOW;
-    memcpy(output_string, outbuffer, sizeof(uint32_t)*outused);
+    size_t j;
+    for (j = i; j < count; j++)
+      {
+      results[j] = B2PF_ERROR_OVERFLOW;
+      offsets[j+1] = length;
+      if (j > i && error_offsets != NULL) error_offsets[j] = 0;
+      }
+    return B2PF_ERROR_OVERFLOW;
     }
-  *output_used = outused;
+
+  if (rc == B2PF_SUCCESS || rc == B2PF_ERROR_CONTEXTCHECK) length += used;
+  offsets[i+1] = length;
   }
 
-else if (mode == UTF16)
+return B2PF_SUCCESS;
+}
+
+
+
+#ifdef SUPPORT_PTHREADS
+/*************************************************
+*       Format one part of a string              *
+*************************************************/
+
+/* This is the function that each thread runs. Each part starts after an
+unknown character, so it starts outside any word, and is formatted exactly as
+it would be as part of the whole string.
+
+Argument:  pointer to a format_part structure
+Returns:   NULL
+*/
+
+static void *
+format_part_thread(void *arg)
+{
+format_part *fp = (format_part *)arg;
+fp->error_offset = 0;
+fp->rc = format_pieces(fp->context, NULL, NULL, fp->input, fp->input_size,
+  fp->mode, FALSE, fp->output, fp->output_size, &(fp->length),
+  &(fp->error_offset));
+return NULL;
+}
+
+
+
+/*************************************************
+*      Count the characters in a UTF string      *
+*************************************************/
+
+/* This is used to turn the start of a part, in code units, into a character
+offset. The string is known to be valid.
+
+Arguments:
+  input          the string
+  count          its length in code units
+  mode           UTF8, UTF16, or UTF32
+
+Returns:         the number of characters
+*/
+
+static size_t
+count_characters(const uint8_t *input, size_t count, int mode)
+{
+size_t n;
+size_t yield = 0;
+
+if (mode == UTF32) return count;
+for (n = 0; n < count; n++)
   {
-  size_t i;
-  size_t used = 0;
-  uint16_t *p16 = (uint16_t *)output_string;
-  for (i = 0; i < outused; i++)
+  if (mode == UTF8)
+    { if ((input[n] & 0xc0u) != 0x80u) yield++; }
+  else if ((((const uint16_t *)input)[n] & 0xfc00u) != 0xdc00u) yield++;
+  }
+return yield;
+}
+
+
+
+/*************************************************
+*      Format a string using several threads     *
+*************************************************/
+
+/* The input is divided into parts of roughly equal size. Each part after the
+first starts just after an ASCII code unit that is not defined in the context,
+such as a space. An ASCII code unit is always a whole character in any UTF,
+even invalid UTF, and an unknown character always ends a word, so the parts
+can be formatted independently. The first part is formatted by the calling
+thread straight into the output buffer; each of the others is formatted by a
+new thread into a buffer that is big enough for its worst case. When all have
+finished, the lengths are added up and the other parts are copied into place.
+
+The result is the same as formatting the whole string in one thread. The error
+that is returned is the one in the earliest part that has an error; all
+earlier parts are valid, so the offset can be made relative to the whole
+string. UTF errors have offsets in code units; other errors have offsets in
+characters.
+
+Arguments:
+  context        the context, already checked
+  input          the input string
+  input_size     its length in code units
+  mode           UTF8, UTF16, or UTF32
+  output         the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  threads        the largest number of threads to use
+  check_yield    the result of checking the context
+  error_offset   where to return an offset after an error
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+static int
+format_parallel(b2pf_context *context, const uint8_t *input,
+  size_t input_size, int mode, uint8_t *output, size_t output_size,
+  size_t *output_used, uint32_t options, uint32_t threads, int check_yield,
+  size_t *error_offset)
+{
+int yield = B2PF_SUCCESS;
+size_t i, nparts, start, length;
+format_part *parts;
+pthread_t *tids;
+BOOL *started;
+
+nparts = input_size/PART_MINSIZE;
+if (nparts > threads) nparts = threads;
+
+parts = context->malloc(nparts * (sizeof(format_part) + sizeof(pthread_t) +
+  sizeof(BOOL)), context->memory_data);
+if (parts == NULL) return B2PF_ERROR_MEMORY;
+tids = (pthread_t *)(parts + nparts);
+started = (BOOL *)(tids + nparts);
+
+/* Find where each part ends, and get its output buffer. The last part ends
+at the end of the input; if there is no suitable place to end a part, there
+are fewer parts. */
+
+for (i = 0, start = 0; i < nparts; i++)
+  {
+  format_part *fp = parts + i;
+  size_t end = input_size;
+
+  if (i < nparts - 1)
     {
-    uint32_t c = outbuffer[i];
-    if (c <= 0xffff)
+    end = (i + 1) * (input_size/nparts);
+    if (end < start) end = start;
+    for (; end < input_size; end++)
       {
-      if (used++ >= output_size) goto OVERFLOW;
-      *p16++ = (uint16_t)c;
+      uint32_t c = (mode == UTF8)? input[end] : (mode == UTF16)?
+        ((const uint16_t *)input)[end] : ((const uint32_t *)input)[end];
+      if (c < 0x80 && GET_PROPS(context, c)->type == CT_NONE)
+        {
+        end++;
+        break;
+        }
       }
-    else
+    }
+
+  fp->context = context;
+  fp->input = input + start * mode;
+  fp->input_size = end - start;
+  fp->mode = mode;
+  fp->rc = B2PF_SUCCESS;
+  started[i] = FALSE;
+
+  if (i == 0)
+    {
+    fp->output = output;
+    fp->output_size = output_size;
+    }
+  else
+    {
+    fp->output_size = PRIV(output_bound)(context, fp->input_size, mode);
+    fp->output = context->malloc(fp->output_size * mode, context->memory_data);
+    if (fp->output == NULL)
       {
-      if (used >= output_size - 1) goto OVERFLOW;
-      used += 2;
-      c -= 0x10000;
-      *p16++ = 0xd800 | (c >> 10);
-      *p16++ = 0xdc00 | (c & 0x3ff);
+      nparts = i;
+      yield = B2PF_ERROR_MEMORY;
+      goto EXIT;
       }
     }
-  *output_used = used;
+
+  start = end;
+  if (end >= input_size) nparts = i + 1;
   }
 
-else  /* UTF-8 */
+/* Start a thread for each part after the first, then format the first part
+in this thread. A part whose thread cannot be started is formatted here
+too. */
+
+for (i = 1; i < nparts; i++)
+  started[i] = pthread_create(tids + i, NULL, format_part_thread,
+    parts + i) == 0;
+
+for (i = 0; i < nparts; i++)
   {
-  size_t i;
-  size_t used = 0;
-  uint8_t *p8 = (uint8_t *)output_string;
+  if (i > 0 && started[i]) (void)pthread_join(tids[i], NULL);
+    else (void)format_part_thread(parts + i);
+  }
+
+/* Find the first error, if any, and adjust its offset. */
 
-  for (i = 0; i < outused; i++)
+start = 0;
+length = 0;
+for (i = 0; i < nparts; i++)
+  {
+  format_part *fp = parts + i;
+
+  if (fp->rc != B2PF_SUCCESS && fp->rc != B2PF_ERROR_OVERFLOW)
     {
-    int j, k;
-    uint8_t *pt;
-    uint32_t c = outbuffer[i];
-    for (j = 0; j < PRIV(utf8_table1_size); j++)
-      if ((int)c <= PRIV(utf8_table1)[j]) break;
-    if (used >= output_size - j) goto OVERFLOW;
-    used += j + 1;
-    pt = p8 += j;
-    for (k = j; k > 0; k--)
-     {
-     *pt-- = 0x80 | (c & 0x3f);
-     c >>= 6;
-     }
-    *pt = PRIV(utf8_table2)[j] | c;
-    p8++;
+    size_t offset = (fp->rc < 0)? start :
+      count_characters(input, start, mode);
+    *error_offset = offset + fp->error_offset;
+    yield = fp->rc;
+    goto EXIT;
     }
-  *output_used = used;
+
+  start += fp->input_size;
+  length += fp->length;
   }
 
-/* All done. */
+/* Check that the whole output fits, then copy the parts into place. If it
+does not, find the part in which the output runs out, and format that part
+again with only the room that is left, to get the offset of the first
+character that does not fit, as in one thread. */
+
+if (length > output_size)
+  {
+  size_t room = output_size;
+
+  if ((options & B2PF_OVERFLOW_LENGTH) != 0) *output_used = length;
+  for (i = 0, start = 0; parts[i].length <= room; i++)
+    {
+    room -= parts[i].length;
+    start += parts[i].input_size;
+    }
+
+  if (i > 0)
+    {
+    format_part *fp = parts + i;
+    (void)format_pieces(context, NULL, NULL, fp->input, fp->input_size, mode,
+      TRUE, fp->output, room, &(fp->length), &(fp->error_offset));
+    }
+
+  *error_offset = count_characters(input, start, mode) +
+    parts[i].error_offset;
+  yield = B2PF_ERROR_OVERFLOW;
+  goto EXIT;
+  }
+
+length = parts[0].length;
+for (i = 1; i < nparts; i++)
+  {
+  memcpy(output + length * mode, parts[i].output, parts[i].length * mode);
+  length += parts[i].length;
+  }
+
+*output_used = length;
+yield = check_yield;
 
 EXIT:
-if (inbuffer != NULL && inbuffer != stack_inbuffer)
-  context->free(inbuffer, context->memory_data);
+for (i = 1; i < nparts; i++)
+  context->free(parts[i].output, context->memory_data);
+context->free(parts, context->memory_data);
+return yield;
+}
+#endif  /* SUPPORT_PTHREADS */
 
-if (outbuffer != NULL && outbuffer != stack_outbuffer &&
-    outbuffer != output_string)
-  context->free(outbuffer, context->memory_data);
 
+
+/*************************************************
+*   Format a UTF string using several threads    *
+*************************************************/
+
+/* This is the same as b2pf_format_string(), except that a long string may be
+divided into parts that are formatted at the same time by up to the given
+number of threads. The output is the same as formatting the string in one
+thread. Backwards input or output needs the whole string at once, so it is
+formatted in one thread, as is any string when B2PF is built without thread
+support. The context must not be changed while this function is running, and
+a ligature callback must be safe to call from several threads at once.
+
+Arguments:
+  context        the context
+  input_string   the input string
+  input_size     its length in code units
+  output_string  the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  threads        the largest number of threads to use
+  error_offset   where to return an offset after an error
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_format_string_mt(b2pf_context *context, void *input_string,
+  size_t input_size, void *output_string, size_t output_size,
+  size_t *output_used, uint32_t options, uint32_t threads,
+  size_t *error_offset)
+{
+int rc, mode, check_yield;
+b2pf_word_cache *cache;
+
+if (context == NULL || input_string == NULL ||
+    (output_string == NULL && output_size != 0) ||
+    output_used == NULL || error_offset == NULL) return B2PF_ERROR_NULL;
+
+rc = format_setup(context, NULL, options, &mode, &cache, &check_yield);
+if (rc != B2PF_SUCCESS) return rc;
+
+#ifdef SUPPORT_PTHREADS
+if (threads > 1 && input_size >= 2 * PART_MINSIZE &&
+    (options & (B2PF_INPUT_BACKCHARS|B2PF_INPUT_BACKCODES|
+      B2PF_OUTPUT_BACKCHARS|B2PF_OUTPUT_BACKCODES)) == 0)
+  {
+  *error_offset = 0;
+  if ((options & B2PF_CHECK_UNCHANGED) != 0 && check_yield == B2PF_SUCCESS)
+    {
+    rc = check_unchanged(context, input_string, input_size, mode,
+      output_used, error_offset);
+    if (rc != B2PF_SUCCESS) return rc;
+    }
+  return format_parallel(context, input_string, input_size, mode,
+    output_string, output_size, output_used, options, threads, check_yield,
+    error_offset);
+  }
+#else
+(void)threads;
+#endif
+
+return format_one(context, NULL, NULL, input_string, input_size, mode,
+  output_string, output_size, output_used, options, FALSE, check_yield,
+  error_offset);
+}
+
+
+
+/*************************************************
+*       Find an upper bound for output size      *
+*************************************************/
+
+/* The bound depends on the largest code point that the context can substitute
+for an input character, and on whether any rules can make the output longer
+than the input. The context is checked if necessary.
+
+Arguments:
+  context        the context
+  input_size     the length of an input string in code units
+  options        option bits (only the UTF options are relevant)
+  bound          where to return the bound, in code units
+
+Returns:         B2PF_SUCCESS or an error code; a context check error is
+                   returned along with the bound
+*/
+
+B2PF_EXP_DEFN int
+b2pf_output_bound(b2pf_context *context, size_t input_size, uint32_t options,
+  size_t *bound)
+{
+int yield = B2PF_SUCCESS;
+
+if (context == NULL || bound == NULL) return B2PF_ERROR_NULL;
+if ((options & ~KNOWN_OPTIONS) != 0 ||
+    (options & (B2PF_UTF_16|B2PF_UTF_32)) == (B2PF_UTF_16|B2PF_UTF_32))
+  return B2PF_ERROR_BADOPTIONS;
+
+if (!context->checked)
+  {
+  yield = PRIV(check_context)(context);
+  if (yield == B2PF_ERROR_MEMORY) return yield;
+  }
+else if (context->check_error != CHECK_ERROR0)
+  yield = B2PF_ERROR_CONTEXTCHECK;
+
+*bound = PRIV(output_bound)(context, input_size,
+  ((options & B2PF_UTF_32) != 0)? UTF32 :
+  ((options & B2PF_UTF_16) != 0)? UTF16 : UTF8);
 return yield;
+}
+
+
+
+/*************************************************
+*     Format a UTF string without match data     *
+*************************************************/
 
-/* Common overflow code */
+/* This is the original interface, which obtains working memory for large
+strings on each call. The arguments are as for b2pf_format_string_md(), except
+that there is no match data. */
 
-OVERFLOW:
-yield = B2PF_ERROR_OVERFLOW;
-goto EXIT;
+B2PF_EXP_DEFN int
+b2pf_format_string(b2pf_context *context, void *input_string, size_t input_size,
+  void *output_string, size_t output_size, size_t *output_used,
+  uint32_t options, size_t *error_offset)
+{
+return b2pf_format_string_md(context, NULL, input_string, input_size,
+  output_string, output_size, output_used, options, error_offset);
 }
 
 /* End of b2pf.c */
@@ -0,0 +1,1206 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains functions that compile the information in a context into
+the tables that are used when formatting.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+
+/* This is the number of property pages for which memory is first obtained.
+It is doubled whenever more are needed. */
+
+#define INITIAL_PAGECOUNT  8
+
+/* Ligature character numbers are stored in 16 bits. */
+
+#define MAX_LIGCHARS  0xffffu
+
+/* Limits for the rule automaton. If any of them is exceeded, no automaton is
+built, and the rules are interpreted one by one when formatting. */
+
+#define DFA_MAX_STATES   4096
+#define DFA_MAX_ENTRIES  (1u << 18)   /* Elements in the working tables */
+#define DFA_MAX_CLASSES  0xfff0u
+
+/* Rule classes 0-15 are for characters that are not literals in any rule. The
+class is a bit map of the presentation forms that the character has. */
+
+#define MASK_CLASSES     16
+
+/* Test for a rule item that matches one letter */
+
+#define LETTER_ITEM(x)   (((x) & 0x80000000u) == 0 || (x) >= R_ANY)
+
+/* Kinds of rule class */
+
+enum { CLASS_CHAR, CLASS_LITERAL, CLASS_BOW, CLASS_EOW };
+
+/* Structure for one item in a rule, used while building the automaton. The
+position is the letter position in the window that is scanned. */
+
+typedef struct rule_item
+  {
+  uint32_t rule;             /* rule number */
+  uint32_t pos;              /* letter position */
+  uint32_t item;             /* rule item: a literal or R_xxx */
+  }
+rule_item;
+
+/* Structure for a rule class while building the automaton. */
+
+typedef struct class_info
+  {
+  uint32_t code;             /* the literal character */
+  uschar mask;               /* bit map of presentation forms */
+  uschar kind;               /* kind of class */
+  }
+class_info;
+
+
+
+/*************************************************
+*          Count and collect tree nodes          *
+*************************************************/
+
+/* The character tree is flattened into a vector of node pointers, in
+ascending order of code point.
+
+Arguments:
+  t          the root of a (sub)tree
+  vector     where to put the pointers, or NULL just to count
+  countptr   points to the number of nodes collected so far
+
+Returns:     nothing
+*/
+
+static void
+collect_nodes(tree_node *t, tree_node **vector, size_t *countptr)
+{
+if (t == NULL) return;
+collect_nodes(t->left, vector, countptr);
+if (vector != NULL) vector[*countptr] = t;
+(*countptr)++;
+collect_nodes(t->right, vector, countptr);
+}
+
+
+
+/*************************************************
+*     Get writable properties for a code point   *
+*************************************************/
+
+/* While the table is being built, each page that is referenced gets its own
+memory; sharing happens at the end. A page that is not yet referenced is
+created as a copy of the empty page zero, extending the memory if necessary.
+Note that this may move the pages, so the pointer that is returned must be
+used before the next call.
+
+Arguments:
+  context     the context
+  c           the code point
+  sizeptr     points to the number of pages for which there is memory
+
+Returns:      pointer to the properties, or NULL if memory could not be
+                obtained
+*/
+
+static char_props *
+writable_props(b2pf_context *context, uint32_t c, uint32_t *sizeptr)
+{
+uint32_t pi = c >> CHARPAGE_SHIFT;
+
+if (context->pageindex[pi] == 0)
+  {
+  if (context->charpagecount >= *sizeptr)
+    {
+    uint32_t newsize = *sizeptr * 2;
+    char_props *newpages;
+
+    if (newsize > CHARPAGE_COUNT + 1) newsize = CHARPAGE_COUNT + 1;
+    newpages = context->malloc(
+      ((size_t)newsize << CHARPAGE_SHIFT) * sizeof(char_props),
+      context->memory_data);
+    if (newpages == NULL) return NULL;
+    memcpy(newpages, context->charpages,
+      ((size_t)(context->charpagecount) << CHARPAGE_SHIFT) *
+        sizeof(char_props));
+    context->free(context->charpages, context->memory_data);
+    context->charpages = newpages;
+    *sizeptr = newsize;
+    }
+
+  memcpy(context->charpages +
+    ((size_t)(context->charpagecount) << CHARPAGE_SHIFT),
+    context->charpages, CHARPAGE_SIZE * sizeof(char_props));
+  context->pageindex[pi] = (uint16_t)(context->charpagecount++);
+  }
+
+return context->charpages +
+  ((size_t)(context->pageindex[pi]) << CHARPAGE_SHIFT) + (c & CHARPAGE_MASK);
+}
+
+
+
+/*************************************************
+*         Share identical character pages        *
+*************************************************/
+
+/* When all the pages have been filled in, any that are identical are merged,
+and the table is compacted. A hash of each page is computed so that most
+comparisons can be skipped. Page zero is never moved.
+
+Argument:  the context
+Returns:   TRUE on success, FALSE if memory could not be obtained
+*/
+
+static BOOL
+share_pages(b2pf_context *context)
+{
+uint32_t i, j, kept;
+uint32_t count = context->charpagecount;
+uint32_t *hashes;
+uint16_t *map;
+
+hashes = context->malloc(count * (sizeof(uint32_t) + sizeof(uint16_t)),
+  context->memory_data);
+if (hashes == NULL) return FALSE;
+map = (uint16_t *)(hashes + count);
+
+for (i = 0; i < count; i++)
+  {
+  uint32_t hash = 0;
+  const uschar *p = (const uschar *)(context->charpages +
+    ((size_t)i << CHARPAGE_SHIFT));
+  const uschar *pend = p + CHARPAGE_SIZE * sizeof(char_props);
+  while (p < pend) hash = hash * 31 + *p++;
+  hashes[i] = hash;
+  }
+
+kept = 0;
+for (i = 0; i < count; i++)
+  {
+  char_props *page = context->charpages + ((size_t)i << CHARPAGE_SHIFT);
+
+  for (j = 0; j < kept; j++)
+    {
+    if (hashes[j] == hashes[i] &&
+        memcmp(context->charpages + ((size_t)j << CHARPAGE_SHIFT), page,
+          CHARPAGE_SIZE * sizeof(char_props)) == 0)
+      break;
+    }
+
+  if (j >= kept)
+    {
+    if (kept != i)
+      memcpy(context->charpages + ((size_t)kept << CHARPAGE_SHIFT), page,
+        CHARPAGE_SIZE * sizeof(char_props));
+    hashes[kept] = hashes[i];
+    j = kept++;
+    }
+
+  map[i] = (uint16_t)j;
+  }
+
+for (i = 0; i < CHARPAGE_COUNT; i++)
+  context->pageindex[i] = map[context->pageindex[i]];
+context->charpagecount = kept;
+
+context->free(hashes, context->memory_data);
+return TRUE;
+}
+
+
+
+/*************************************************
+*        Number the characters in ligatures      *
+*************************************************/
+
+/* Each distinct first character and each distinct second character in a
+ligature tree is given a number, starting from 1, which is stored in its
+character table entry.
+
+Arguments:
+  context      the context
+  t            the root of a (sub)tree of ligatures
+  after        TRUE for the "after" tree
+  matrix       the matrix whose dimensions are being counted
+  sizeptr      points to the number of pages for which there is memory
+
+Returns:       TRUE on success, FALSE on failure (no memory or too many
+                 characters)
+*/
+
+static BOOL
+number_lig_chars(b2pf_context *context, tree_node *t, BOOL after,
+  lig_matrix *matrix, uint32_t *sizeptr)
+{
+char_props *cp;
+uint16_t *idp;
+
+if (t == NULL) return TRUE;
+if (!number_lig_chars(context, t->left, after, matrix, sizeptr)) return FALSE;
+
+cp = writable_props(context, (uint32_t)(t->first >> 32), sizeptr);
+if (cp == NULL) return FALSE;
+idp = after? &(cp->aftfirst) : &(cp->ligfirst);
+if (*idp == 0)
+  {
+  if (matrix->nfirst >= MAX_LIGCHARS) return FALSE;
+  *idp = (uint16_t)(++matrix->nfirst);
+  }
+
+cp = writable_props(context, (uint32_t)(t->first & 0xffffffffu), sizeptr);
+if (cp == NULL) return FALSE;
+idp = after? &(cp->aftsecond) : &(cp->ligsecond);
+if (*idp == 0)
+  {
+  if (matrix->nsecond >= MAX_LIGCHARS) return FALSE;
+  *idp = (uint16_t)(++matrix->nsecond);
+  }
+
+return number_lig_chars(context, t->right, after, matrix, sizeptr);
+}
+
+
+
+/*************************************************
+*         Fill in the ligature table             *
+*************************************************/
+
+/* Each ligature is given the next number in the ligature table, which is
+placed in the appropriate element of the matrix.
+
+Arguments:
+  context      the context
+  t            the root of a (sub)tree of ligatures
+  after        TRUE for the "after" tree
+  matrix       the matrix that is being filled in
+
+Returns:       nothing
+*/
+
+static void
+fill_ligatures(b2pf_context *context, tree_node *t, BOOL after,
+  lig_matrix *matrix)
+{
+ligature *lig;
+const char_props *p1, *p2;
+
+if (t == NULL) return;
+fill_ligatures(context, t->left, after, matrix);
+
+p1 = GET_PROPS(context, (uint32_t)(t->first >> 32));
+p2 = GET_PROPS(context, (uint32_t)(t->first & 0xffffffffu));
+
+lig = context->ligatures + (++context->ligcount);
+lig->code = t->pforms[0];
+lig->group = t->pforms[1];
+lig->props = *GET_PROPS(context, lig->code);
+if (lig->props.type == CT_NONE) lig->props.type = CT_MISC;
+
+if (after)
+  LIG_LOOKUP(*matrix, p1->aftfirst, p2->aftsecond) = context->ligcount;
+else
+  LIG_LOOKUP(*matrix, p1->ligfirst, p2->ligsecond) = context->ligcount;
+
+fill_ligatures(context, t->right, after, matrix);
+}
+
+
+
+/*************************************************
+*      Get the presentation forms bit map        *
+*************************************************/
+
+/* Argument:  pointer to character properties
+   Returns:   a bit map of the forms that exist, zero if none
+*/
+
+static uschar
+form_mask(const char_props *cp)
+{
+int i;
+uschar mask = 0;
+
+if (cp->type != CT_PRES) return 0;
+for (i = 0; i < 4; i++) if (cp->pforms[i] != 0) mask |= 1u << i;
+return mask;
+}
+
+
+
+/*************************************************
+*    Check a rule item against a rule class      *
+*************************************************/
+
+/* This mirrors the tests that format_word() makes when it interprets a rule.
+
+Arguments:
+  item     the rule item
+  ci       the rule class
+
+Returns:   TRUE if a letter of this class matches the item
+*/
+
+static BOOL
+item_accepts(uint32_t item, const class_info *ci)
+{
+uschar m = ci->mask;
+
+if (ci->kind == CLASS_BOW) return item == R_WSTART;
+if (ci->kind == CLASS_EOW) return item == R_WEND;
+
+switch (item)
+  {
+  case R_WSTART:
+  case R_WEND:
+  return FALSE;
+
+  case R_ANY:
+  return TRUE;
+
+  case R_FINAL:
+  return (m & (1u << F_FINAL)) != 0;
+
+  case R_INITIAL:
+  return (m & (1u << F_INITIAL)) != 0;
+
+  case R_MEDIAL:
+  return (m & (1u << F_MEDIAL)) != 0;
+
+  case R_ISOLATED:
+  return (m & (1u << F_ISOLATED)) != 0;
+
+  case R_JOINNEXT:
+  return (m & ((1u << F_INITIAL)|(1u << F_MEDIAL))) != 0;
+
+  case R_JOINPREV:
+  return (m & ((1u << F_MEDIAL)|(1u << F_FINAL))) != 0;
+
+  case R_NOTJOINNEXT:
+  return (m & ((1u << F_INITIAL)|(1u << F_MEDIAL))) == 0;
+
+  case R_NOTJOINPREV:
+  return (m & ((1u << F_MEDIAL)|(1u << F_FINAL))) == 0;
+
+  default:
+  return ci->kind == CLASS_LITERAL && ci->code == item;
+  }
+}
+
+
+
+/*************************************************
+*           Build the rule dispatch index        *
+*************************************************/
+
+/* This is used when the rule automaton would be too big. For each column and
+for each of "at the start of a word" and "not at the start", there is a list of
+the rules that might match, in their original order. A rule is omitted if its
+item for the current letter does not match the column, if it has a
+pre-assertion and the current letter is the first, or if it starts with ^ and
+the current letter is not the first. If the index itself is too big, it is not
+built.
+
+Arguments:
+  context     the context, with dfa.rules and dfa.ncolumns set
+  items       the rule items, in rule order
+  nitems      the number of rule items
+  nrules      the number of rules
+  sigs        the signatures of the rule classes
+  sigwords    the number of words in each signature
+  reps        the representative class for each column
+
+Returns:      TRUE on success, FALSE if memory could not be obtained
+*/
+
+static BOOL
+build_rule_index(b2pf_context *context, const rule_item *items,
+  uint32_t nitems, uint32_t nrules, const uint32_t *sigs, uint32_t sigwords,
+  const uint32_t *reps)
+{
+rule_dfa *dfa = &(context->dfa);
+uint32_t nlists = 2 * dfa->ncolumns;
+int pass;
+
+for (pass = 0; pass < 2; pass++)
+  {
+  uint32_t list;
+  size_t n = 0;
+
+  for (list = 0; list < nlists; list++)
+    {
+    BOOL atstart = list < dfa->ncolumns;
+    const uint32_t *sig = sigs + (size_t)reps[list % dfa->ncolumns] * sigwords;
+    uint32_t j = 0;
+    uint32_t r;
+
+    if (pass > 0) dfa->index[list] = (uint32_t)n;
+
+    for (r = 0; r < nrules; r++)
+      {
+      BOOL possible = !atstart || dfa->rules[r]->prelen == 0;
+
+      for (; j < nitems && items[j].rule == r; j++)
+        {
+        if (!atstart && items[j].item == R_WSTART) possible = FALSE;
+        if (items[j].pos == dfa->lookback &&
+            (sig[j/32] & (1u << (j%32))) == 0) possible = FALSE;
+        }
+
+      if (possible)
+        {
+        if (pass > 0) dfa->indexrules[n] = r;
+        n++;
+        }
+      }
+    }
+
+  /* At the end of the first pass, get the memory. */
+
+  if (pass == 0)
+    {
+    if (n > DFA_MAX_ENTRIES) return TRUE;
+    dfa->index = context->malloc((nlists + 1 + n) * sizeof(uint32_t),
+      context->memory_data);
+    if (dfa->index == NULL) return FALSE;
+    dfa->indexrules = dfa->index + nlists + 1;
+    }
+  else dfa->index[nlists] = (uint32_t)n;
+  }
+
+return TRUE;
+}
+
+
+
+/*************************************************
+*      Check a rule for the joining table        *
+*************************************************/
+
+/* A rule can be handled by the joining table if it has at most one item
+before the parentheses, exactly one presentation form inside them, at most one
+item after them, and a replacement that is the same form. The items before and
+after may be ^ and $ respectively. A missing item is returned as R_REND.
+
+Arguments:
+  r           the rule
+  items       where to return the items before, inside, and after
+
+Returns:      TRUE if the rule has the right shape
+*/
+
+static BOOL
+join_rule(const coded_rule *r, uint32_t *items)
+{
+const uint32_t *rp = r->code;
+
+items[0] = items[2] = R_REND;
+if (*rp == R_WSTART || LETTER_ITEM(*rp)) items[0] = *rp++;
+if (*rp++ != R_BRA) return FALSE;
+items[1] = *rp++;
+if (items[1] != R_ISOLATED && items[1] != R_INITIAL &&
+    items[1] != R_MEDIAL && items[1] != R_FINAL)
+  return FALSE;
+if (*rp++ != R_KET) return FALSE;
+if (*rp == R_WEND || LETTER_ITEM(*rp)) items[2] = *rp++;
+return rp[0] == R_BECOMES && rp[1] == items[1] && rp[2] == R_REND;
+}
+
+
+
+/*************************************************
+*           Build the joining table              *
+*************************************************/
+
+/* If every rule can be handled by the joining table, the table is filled in
+by trying the rules in order for each combination of previous, current, and
+next column. A rule's item is checked against each column's representative
+class, so the result is the same as interpreting the rules.
+
+Arguments:
+  context     the context, with dfa.rules and dfa.ncolumns set
+  classes     the rule classes
+  reps        the representative class for each column
+
+Returns:      TRUE on success, FALSE if memory could not be obtained; if the
+                rules are not suitable, no table is built, but TRUE is returned
+*/
+
+static BOOL
+build_join_table(b2pf_context *context, const class_info *classes,
+  const uint32_t *reps)
+{
+rule_dfa *dfa = &(context->dfa);
+uint32_t nc = dfa->ncolumns;
+uint32_t i, p, s, n;
+uint32_t *items;
+uschar *jt;
+
+if ((uint64_t)nc * nc * nc > DFA_MAX_ENTRIES) return TRUE;
+
+items = context->malloc(dfa->nrules * 3 * sizeof(uint32_t),
+  context->memory_data);
+if (items == NULL) return FALSE;
+
+for (i = 0; i < dfa->nrules; i++)
+  {
+  if (!join_rule(dfa->rules[i], items + 3 * i))
+    {
+    context->free(items, context->memory_data);
+    return TRUE;
+    }
+  }
+
+jt = context->malloc((size_t)nc * nc * nc, context->memory_data);
+if (jt == NULL)
+  {
+  context->free(items, context->memory_data);
+  return FALSE;
+  }
+
+for (p = 0; p < nc; p++)
+  {
+  for (s = 0; s < nc; s++)
+    {
+    for (n = 0; n < nc; n++)
+      {
+      uschar form = JOIN_COPY;
+
+      for (i = 0; i < dfa->nrules; i++)
+        {
+        const uint32_t *ri = items + 3 * i;
+        if ((ri[0] == R_REND || item_accepts(ri[0], classes + reps[p])) &&
+            item_accepts(ri[1], classes + reps[s]) &&
+            (ri[2] == R_REND || item_accepts(ri[2], classes + reps[n])))
+          {
+          form = (ri[1] == R_ISOLATED)? F_ISOLATED :
+                 (ri[1] == R_INITIAL)? F_INITIAL :
+                 (ri[1] == R_MEDIAL)? F_MEDIAL : F_FINAL;
+          break;
+          }
+        }
+
+      jt[((size_t)p * nc + s) * nc + n] = form;
+      }
+    }
+  }
+
+context->free(items, context->memory_data);
+dfa->jointable = jt;
+return TRUE;
+}
+
+
+
+/*************************************************
+*           Build the rule automaton             *
+*************************************************/
+
+/* Every rule is anchored at the current letter, so each of its items applies
+to a fixed letter position in a window that starts "lookback" letters before
+the current one. A state of the automaton is a window position together with
+the set of rules that have not yet failed. A transition is decided as soon as
+the first surviving rule has no more items to check, or when no rules survive.
+
+Characters are grouped into rule classes. Each literal in a rule has its own
+class; other characters are classified by the presentation forms that they
+have. Classes that behave identically for every rule item share a column in
+the table, and the column number is stored in the character table.
+
+Arguments:
+  context     the context
+  sizeptr     points to the number of pages for which there is memory
+
+Returns:      TRUE on success, FALSE if memory could not be obtained; if a
+                limit is exceeded, no automaton is built, but TRUE is returned
+                (and a dispatch index may be built instead)
+*/
+
+static BOOL
+build_rule_dfa(b2pf_context *context, uint32_t *sizeptr)
+{
+BOOL yield = FALSE;
+coded_rule *r;
+rule_dfa *dfa = &(context->dfa);
+size_t n, limit;
+uint32_t i, j, a, s, w;
+uint32_t nrules = 0;
+uint32_t nitems = 0;
+uint32_t nclasses, ncolumns, nstates, maxstates, hashsize;
+uint32_t lookback = 0;
+uint32_t maxlen = 0;
+uint32_t words, sigwords;
+rule_item *items = NULL;
+uint32_t *rulelen = NULL;
+class_info *classes = NULL;
+uint32_t *sigs = NULL;
+uint16_t *columns = NULL;
+uint32_t *reps = NULL;
+uint32_t *kills = NULL;
+uint32_t *statebits = NULL;
+uint32_t *statepos = NULL;
+uint32_t *hashtable = NULL;
+int32_t *table = NULL;
+
+/* Count the rules and their items, and find the longest pre-assertion. */
+
+for (r = context->rules; r != NULL; r = r->next)
+  {
+  uint32_t *rp;
+  nrules++;
+  if (r->prelen > lookback) lookback = r->prelen;
+  for (rp = r->code; *rp != R_REND && *rp != R_BECOMES; rp++) nitems++;
+  }
+
+if (nrules == 0) return TRUE;
+lookback++;    /* For checking the start of a word */
+
+/* Set up the vector of rules, which is used even if no automaton or index can
+be built. */
+
+dfa->rules = context->malloc(nrules * sizeof(coded_rule *),
+  context->memory_data);
+if (dfa->rules == NULL) goto EXIT;
+
+for (r = context->rules, i = 0; r != NULL; r = r->next) dfa->rules[i++] = r;
+dfa->nrules = nrules;
+
+items = context->malloc(nitems * sizeof(rule_item) +
+  nrules * sizeof(uint32_t), context->memory_data);
+if (items == NULL) goto EXIT;
+rulelen = (uint32_t *)(items + nitems);
+
+/* Place each rule item at its position in the window. The length of a rule is
+the position after its last item. */
+
+nitems = 0;
+for (r = context->rules, i = 0; r != NULL; r = r->next, i++)
+  {
+  uint32_t *rp;
+  uint32_t pos = lookback - r->prelen;
+  uint32_t len = 1;
+
+  for (rp = r->code; *rp != R_REND && *rp != R_BECOMES; rp++)
+    {
+    rule_item *ri = items + nitems;
+
+    if (*rp == R_BRA || *rp == R_KET) continue;
+    ri->rule = i;
+    ri->item = *rp;
+    if (*rp == R_WSTART) ri->pos = lookback - 1;
+      else if (*rp == R_WEND) ri->pos = pos;
+        else ri->pos = pos++;
+    if (ri->pos + 1 > len) len = ri->pos + 1;
+    nitems++;
+    }
+
+  rulelen[i] = len;
+  if (len > maxlen) maxlen = len;
+  }
+
+/* Set up the classes for characters that are not literals, then give each
+distinct literal its own class. */
+
+classes = context->malloc((MASK_CLASSES + nitems + 2) * sizeof(class_info),
+  context->memory_data);
+if (classes == NULL) goto EXIT;
+
+for (a = 0; a < MASK_CLASSES; a++)
+  {
+  classes[a].kind = CLASS_CHAR;
+  classes[a].mask = a;
+  classes[a].code = 0;
+  }
+nclasses = MASK_CLASSES;
+
+for (j = 0; j < nitems; j++)
+  {
+  char_props *cp;
+  uint32_t c = items[j].item;
+
+  if ((c & 0x80000000u) != 0) continue;
+  cp = writable_props(context, c, sizeptr);
+  if (cp == NULL) goto EXIT;
+  if (cp->rclass >= MASK_CLASSES) continue;  /* Already has a class */
+  if (nclasses >= DFA_MAX_CLASSES) goto GIVEUP;
+  classes[nclasses].kind = CLASS_LITERAL;
+  classes[nclasses].mask = form_mask(cp);
+  classes[nclasses].code = c;
+  cp->rclass = (uint16_t)(nclasses++);
+  }
+
+classes[nclasses].kind = CLASS_BOW;
+classes[nclasses++].mask = 0;
+classes[nclasses].kind = CLASS_EOW;
+classes[nclasses++].mask = 0;
+
+/* Compute a signature for each class, that is, a bit map of the rule items
+that it matches, and merge classes with identical signatures into columns. */
+
+sigwords = (nitems + 31)/32;
+if ((size_t)nclasses * (sigwords + 2) > DFA_MAX_ENTRIES) goto GIVEUP;
+
+sigs = context->malloc((size_t)nclasses * (sigwords * sizeof(uint32_t) +
+  sizeof(uint32_t) + sizeof(uint16_t)), context->memory_data);
+if (sigs == NULL) goto EXIT;
+reps = sigs + (size_t)nclasses * sigwords;
+columns = (uint16_t *)(reps + nclasses);
+memset(sigs, 0, (size_t)nclasses * sigwords * sizeof(uint32_t));
+
+ncolumns = 0;
+for (a = 0; a < nclasses; a++)
+  {
+  uint32_t *sig = sigs + (size_t)a * sigwords;
+
+  for (j = 0; j < nitems; j++)
+    if (item_accepts(items[j].item, classes + a)) sig[j/32] |= 1u << (j%32);
+
+  for (i = 0; i < ncolumns; i++)
+    if (memcmp(sigs + (size_t)reps[i] * sigwords, sig,
+        sigwords * sizeof(uint32_t)) == 0) break;
+
+  if (i >= ncolumns) reps[ncolumns++] = a;
+  columns[a] = (uint16_t)i;
+  }
+
+/* The column numbers replace the class numbers in the character table. */
+
+dfa->ncolumns = ncolumns;
+dfa->bowcolumn = columns[nclasses - 2];
+dfa->eowcolumn = columns[nclasses - 1];
+dfa->lookback = lookback;
+
+for (n = 0; n < (size_t)(context->charpagecount) << CHARPAGE_SHIFT; n++)
+  context->charpages[n].rclass = columns[context->charpages[n].rclass];
+
+/* If the rules are suitable, build the joining table. */
+
+if (!build_join_table(context, classes, reps)) goto EXIT;
+
+/* For each window position and column, make a bit map of the rules that fail
+at that position. */
+
+words = (nrules + 31)/32;
+limit = (size_t)maxlen * ncolumns * words;
+if (limit > DFA_MAX_ENTRIES) goto NODFA;
+
+kills = context->malloc(limit * sizeof(uint32_t), context->memory_data);
+if (kills == NULL) goto EXIT;
+memset(kills, 0, limit * sizeof(uint32_t));
+
+for (j = 0; j < nitems; j++)
+  {
+  rule_item *ri = items + j;
+  for (i = 0; i < ncolumns; i++)
+    {
+    if ((sigs[(size_t)reps[i] * sigwords + j/32] & (1u << (j%32))) == 0)
+      kills[((size_t)ri->pos * ncolumns + i) * words + ri->rule/32] |=
+        1u << (ri->rule%32);
+    }
+  }
+
+/* Get working memory for the states, including one extra set of rule bits
+and a hash table for finding existing states. */
+
+maxstates = DFA_MAX_ENTRIES/ncolumns;
+if (maxstates > DFA_MAX_STATES) maxstates = DFA_MAX_STATES;
+for (hashsize = 1; hashsize < 2 * maxstates; hashsize <<= 1) {}
+
+statebits = context->malloc(((size_t)(maxstates + 1) * words + maxstates +
+  hashsize) * sizeof(uint32_t), context->memory_data);
+table = context->malloc((size_t)maxstates * ncolumns * sizeof(int32_t),
+  context->memory_data);
+if (statebits == NULL || table == NULL) goto EXIT;
+statepos = statebits + (size_t)(maxstates + 1) * words;
+hashtable = statepos + maxstates;
+memset(hashtable, 0, hashsize * sizeof(uint32_t));
+
+/* The initial state is at position zero, with all rules alive. It is not put
+in the hash table because no transition can lead back to position zero. */
+
+memset(statebits, 0, words * sizeof(uint32_t));
+for (i = 0; i < nrules; i++) statebits[i/32] |= 1u << (i%32);
+statepos[0] = 0;
+nstates = 1;
+
+for (s = 0; s < nstates; s++)
+  {
+  uint32_t pos = statepos[s];
+
+  for (a = 0; a < ncolumns; a++)
+    {
+    uint32_t *bits = statebits + (size_t)s * words;
+    uint32_t *kill = kills + ((size_t)pos * ncolumns + a) * words;
+    uint32_t *newbits = statebits + (size_t)nstates * words;
+    uint32_t first, hash;
+    int32_t v = DFA_NOMATCH;
+
+    for (w = 0; w < words; w++) newbits[w] = bits[w] & ~kill[w];
+    for (w = 0; w < words; w++) if (newbits[w] != 0) break;
+
+    if (w < words)
+      {
+      for (first = w * 32; (newbits[w] & (1u << (first%32))) == 0; first++) {}
+
+      /* The first surviving rule has matched. */
+
+      if (rulelen[first] <= pos + 1) v = DFA_MATCH(first); else
+
+      /* Find or create the state for the next position. */
+
+        {
+        hash = pos + 1;
+        for (w = 0; w < words; w++) hash = hash * 31 + newbits[w];
+
+        for (hash &= hashsize - 1; hashtable[hash] != 0;
+             hash = (hash + 1) & (hashsize - 1))
+          {
+          uint32_t t = hashtable[hash] - 1;
+          if (statepos[t] == pos + 1 && memcmp(statebits + (size_t)t * words,
+              newbits, words * sizeof(uint32_t)) == 0) break;
+          }
+
+        if (hashtable[hash] != 0) v = (int32_t)(hashtable[hash] - 1); else
+          {
+          if (nstates >= maxstates) goto NODFA;
+          statepos[nstates] = pos + 1;
+          hashtable[hash] = nstates + 1;
+          v = (int32_t)(nstates++);
+          }
+        }
+      }
+
+    table[(size_t)s * ncolumns + a] = v;
+    }
+  }
+
+/* Save the automaton. */
+
+dfa->table = context->malloc((size_t)nstates * ncolumns * sizeof(int32_t),
+  context->memory_data);
+if (dfa->table == NULL) goto EXIT;
+memcpy(dfa->table, table, (size_t)nstates * ncolumns * sizeof(int32_t));
+dfa->nstates = nstates;
+yield = TRUE;
+goto EXIT;
+
+/* The automaton is too big; build a dispatch index instead. */
+
+NODFA:
+yield = build_rule_index(context, items, nitems, nrules, sigs, sigwords,
+  reps);
+goto EXIT;
+
+/* The rule classes cannot be set up; the rules will be interpreted one by
+one. */
+
+GIVEUP:
+yield = TRUE;
+
+EXIT:
+if (items != NULL) context->free(items, context->memory_data);
+if (classes != NULL) context->free(classes, context->memory_data);
+if (sigs != NULL) context->free(sigs, context->memory_data);
+if (kills != NULL) context->free(kills, context->memory_data);
+if (statebits != NULL) context->free(statebits, context->memory_data);
+if (table != NULL) context->free(table, context->memory_data);
+return yield;
+}
+
+
+
+/*************************************************
+*     Find the largest possible output           *
+*************************************************/
+
+/* This finds the largest code point that formatting can substitute for an
+input character, and the largest number of code points that can be output for
+each input code point. The latter is one unless there is a rule whose
+replacement has more items than the characters it replaces; such a rule
+consumes at least one letter, or the whole of the rest of the word if it has
+no parentheses.
+
+Arguments:
+  context     the context
+  nodes       the flattened character tree
+  nodecount   the number of nodes
+
+Returns:      nothing
+*/
+
+static void
+find_expansion(b2pf_context *context, tree_node **nodes, size_t nodecount)
+{
+size_t n;
+uint32_t maxsubst = 0;
+uint32_t expansion = 1;
+coded_rule *r;
+
+for (n = 0; n < nodecount; n++)
+  {
+  int i;
+  if (nodes[n]->type != CT_PRES) continue;
+  for (i = 0; i < 4; i++)
+    if (nodes[n]->pforms[i] > maxsubst) maxsubst = nodes[n]->pforms[i];
+  }
+
+for (n = 1; n <= context->ligcount; n++)
+  if (context->ligatures[n].code > maxsubst)
+    maxsubst = context->ligatures[n].code;
+
+for (r = context->rules; r != NULL; r = r->next)
+  {
+  uint32_t *rp = r->code;
+  uint32_t items = 0;
+  uint32_t replen = (r->replen == 0)? 1 : r->replen;
+
+  while (*rp != R_REND && *rp != R_BECOMES) rp++;
+  if (*rp == R_REND) continue;
+
+  for (rp++; *rp != R_REND; rp++)
+    {
+    items++;
+    if ((*rp & 0x80000000u) == 0 && *rp > maxsubst) maxsubst = *rp;
+    }
+
+  if ((items + replen - 1)/replen > expansion)
+    expansion = (items + replen - 1)/replen;
+  }
+
+context->maxsubst = maxsubst;
+context->expansion = expansion;
+}
+
+
+
+/*************************************************
+*          Build the compiled tables             *
+*************************************************/
+
+/* The character tree is flattened into a page table, so that finding the
+properties of a code point is just two indexing operations. Code points that
+are not in the tree have the type CT_NONE. Then the rules are compiled into an
+automaton, and the ligature trees are turned into matrices indexed by the
+numbers of their first and second characters.
+
+Argument:  the context
+Returns:   TRUE on success, FALSE if memory could not be obtained
+*/
+
+BOOL
+PRIV(build_tables)(b2pf_context *context)
+{
+BOOL yield = FALSE;
+size_t i, n;
+size_t nodecount = 0;
+uint32_t c;
+uint32_t pagessize = INITIAL_PAGECOUNT;
+tree_node **nodes = NULL;
+
+/* Get the basic memory. Page zero is always the empty page. */
+
+context->pageindex = context->malloc(CHARPAGE_COUNT * sizeof(uint16_t),
+  context->memory_data);
+context->charpages = context->malloc(
+  ((size_t)pagessize << CHARPAGE_SHIFT) * sizeof(char_props),
+  context->memory_data);
+if (context->pageindex == NULL || context->charpages == NULL) goto EXIT;
+
+memset(context->pageindex, 0, CHARPAGE_COUNT * sizeof(uint16_t));
+memset(context->charpages, 0, CHARPAGE_SIZE * sizeof(char_props));
+for (i = 0; i < CHARPAGE_SIZE; i++) context->charpages[i].type = CT_NONE;
+context->charpagecount = 1;
+
+/* Flatten the tree, then fill in the properties of each code point. */
+
+collect_nodes(context->chartreebase, NULL, &nodecount);
+if (nodecount > 0)
+  {
+  nodes = context->malloc(nodecount * sizeof(tree_node *),
+    context->memory_data);
+  if (nodes == NULL) goto EXIT;
+  nodecount = 0;
+  collect_nodes(context->chartreebase, nodes, &nodecount);
+  }
+
+for (n = 0; n < nodecount; n++)
+  {
+  tree_node *t = nodes[n];
+  uint32_t last = (t->last > MAX_UTF_CODE_POINT)?
+    MAX_UTF_CODE_POINT : (uint32_t)(t->last);
+
+  for (c = (uint32_t)(t->first); c <= last; c++)
+    {
+    char_props *cp = writable_props(context, c, &pagessize);
+    if (cp == NULL) goto EXIT;
+    cp->type = t->type;
+    if (t->type == CT_PRES)
+      {
+      memcpy(cp->pforms, t->pforms, sizeof(cp->pforms));
+      cp->rclass = form_mask(cp);
+      }
+    }
+  }
+
+/* Find the smallest code point that can start a word, so that runs of
+smaller ones can be skipped without looking them up. The nodes are in code
+point order. */
+
+for (n = 0; n < nodecount; n++)
+  {
+  if (nodes[n]->type == CT_COMB) continue;
+  context->wordstart = (uint32_t)(nodes[n]->first);
+  break;
+  }
+
+/* Number the ligature characters, then create the ligature table and the
+matrices. The ligature table's entry zero is unused. */
+
+if (!number_lig_chars(context, context->ligtreebase, FALSE,
+      &(context->ligmatrix), &pagessize) ||
+    !number_lig_chars(context, context->aftertreebase, TRUE,
+      &(context->aftmatrix), &pagessize))
+  goto EXIT;
+
+/* Compile the rules. This may add literal characters to the table. */
+
+if (!build_rule_dfa(context, &pagessize)) goto EXIT;
+
+n = 0;
+collect_nodes(context->ligtreebase, NULL, &n);
+collect_nodes(context->aftertreebase, NULL, &n);
+
+context->ligatures = context->malloc((n + 1) * sizeof(ligature),
+  context->memory_data);
+if (context->ligatures == NULL) goto EXIT;
+
+if (context->ligmatrix.nfirst > 0)
+  {
+  size_t size = (size_t)(context->ligmatrix.nfirst) *
+    context->ligmatrix.nsecond * sizeof(uint32_t);
+  context->ligmatrix.matrix = context->malloc(size, context->memory_data);
+  if (context->ligmatrix.matrix == NULL) goto EXIT;
+  memset(context->ligmatrix.matrix, 0, size);
+  }
+
+if (context->aftmatrix.nfirst > 0)
+  {
+  size_t size = (size_t)(context->aftmatrix.nfirst) *
+    context->aftmatrix.nsecond * sizeof(uint32_t);
+  context->aftmatrix.matrix = context->malloc(size, context->memory_data);
+  if (context->aftmatrix.matrix == NULL) goto EXIT;
+  memset(context->aftmatrix.matrix, 0, size);
+  }
+
+fill_ligatures(context, context->ligtreebase, FALSE, &(context->ligmatrix));
+fill_ligatures(context, context->aftertreebase, TRUE, &(context->aftmatrix));
+find_expansion(context, nodes, nodecount);
+
+/* Finally, merge identical pages. */
+
+yield = share_pages(context);
+
+EXIT:
+if (nodes != NULL) context->free(nodes, context->memory_data);
+if (!yield) PRIV(free_tables)(context);
+return yield;
+}
+
+
+
+/*************************************************
+*           Free the compiled tables             *
+*************************************************/
+
+/* This is called when a context is freed and whenever it has to be checked
+again after a change. For a context that was loaded from an image, the tables
+are in the image.
+
+Argument:  the context
+Returns:   nothing
+*/
+
+void
+PRIV(free_tables)(b2pf_context *context)
+{
+if (context->image != NULL) PRIV(release_image)(context);
+else
+  {
+  if (context->pageindex != NULL)
+    context->free(context->pageindex, context->memory_data);
+  if (context->charpages != NULL)
+    context->free(context->charpages, context->memory_data);
+  if (context->ligatures != NULL)
+    context->free(context->ligatures, context->memory_data);
+  if (context->ligmatrix.matrix != NULL)
+    context->free(context->ligmatrix.matrix, context->memory_data);
+  if (context->aftmatrix.matrix != NULL)
+    context->free(context->aftmatrix.matrix, context->memory_data);
+  if (context->dfa.table != NULL)
+    context->free(context->dfa.table, context->memory_data);
+  if (context->dfa.rules != NULL)
+    context->free(context->dfa.rules, context->memory_data);
+  if (context->dfa.index != NULL)
+    context->free(context->dfa.index, context->memory_data);
+  if (context->dfa.jointable != NULL)
+    context->free(context->dfa.jointable, context->memory_data);
+  }
+
+/* Cached callback answers are indexed by ligature number. */
+
+if (context->ligverdicts != NULL)
+  context->free(context->ligverdicts, context->memory_data);
+context->ligverdicts = NULL;
+
+context->pageindex = NULL;
+context->charpages = NULL;
+context->ligatures = NULL;
+context->charpagecount = 0;
+context->ligcount = 0;
+context->maxsubst = 0;
+context->expansion = 1;
+context->wordstart = MAX_UTF_CODE_POINT + 1;
+memset(&(context->ligmatrix), 0, sizeof(lig_matrix));
+memset(&(context->aftmatrix), 0, sizeof(lig_matrix));
+memset(&(context->dfa), 0, sizeof(rule_dfa));
+}
+
+/* End of b2pf_compile.c */
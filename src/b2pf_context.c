@@ -235,23 +235,29 @@ return FALSE;
 *************************************************/
 
 /* This function is called at the start of b2pf_format_string() when there have
-been changes to the context. It check for inconsistencies in the context.
-Details are stored in the context, for retrieval by b2pf_get_check_message().
+been changes to the context. It compiles the character and ligature trees into
+tables, and then checks for inconsistencies in the context. Details of any
+inconsistency are stored in the context, for retrieval by
+b2pf_get_check_message(). The tables remain usable after a check error.
 
 Argument:  pointer to the context
-Returns:   TRUE for success, FALSE for fail
+Returns:   B2PF_SUCCESS, B2PF_ERROR_CONTEXTCHECK, or B2PF_ERROR_MEMORY
 */
 
-BOOL
+int
 PRIV(check_context)(b2pf_context *context)
 {
+PRIV(free_tables)(context);
+if (!PRIV(build_tables)(context)) return B2PF_ERROR_MEMORY;
+
+context->check_error = CHECK_ERROR0;  /* No error */
+context->checked = TRUE;
+
 if (!check_ligatures(context, context->ligtreebase, TRUE) ||
     !check_ligatures(context, context->aftertreebase, FALSE))
-  return FALSE;
+  return B2PF_ERROR_CONTEXTCHECK;
 
-context->checked = TRUE;
-context->check_error = CHECK_ERROR0;  /* No error */
-return TRUE;
+return B2PF_SUCCESS;
 }
 
 
@@ -299,11 +305,15 @@ if (context == NULL) return;
 free_tree(context, context->chartreebase);
 free_tree(context, context->ligtreebase);
 free_tree(context, context->aftertreebase);
+PRIV(free_tables)(context);
 for (rule = context->rules; rule != NULL; rule = next)
   {
   next = rule->next;
   context->free(rule, context->memory_data);
   }
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_destroy(&(context->verdict_lock));
+#endif
 context->free(context, context->memory_data);
 }
 
@@ -346,6 +356,15 @@ if (c == 'U' && *p == '+' && Uisxdigit(p[1]))
   c = (uint32_t)x;
   }
 
+/* A literal character is not UTF-checked, but it must be one that can appear
+in a valid string, because the character table covers only those. */
+
+else if (c > MAX_UTF_CODE_POINT)
+  {
+  *errptr = B2PF_ERROR_UTF8_ERR13;
+  return NULL;
+  }
+
 *cptr = c;
 return p;
 }
@@ -392,6 +411,58 @@ return ++p;
 
 
 
+/*************************************************
+*          Read ligature options                 *
+*************************************************/
+
+/* The only option is "group=n", which puts the ligature into group n, where n
+is less than LIG_GROUPS. Options are separated by white space.
+
+Arguments:
+  p          points to initial '['
+  gptr       where to put the group number
+  errptr     where to return an error code
+
+Returns:     update pointer or NULL on error
+*/
+
+static uschar *
+read_ligature_options(uschar *p, uint32_t *gptr, int *errptr)
+{
+p++;
+
+for (;;)
+  {
+  uint32_t n;
+
+  while (Uisspace(*p)) p++;
+  if (*p == 0 || *p == ']') break;
+  if (strncmp((char *)p, "group=", 6) != 0 || !isdigit(p[6]))
+    {
+    *errptr = B2PF_ERROR_BADGROUP;
+    return NULL;
+    }
+  p += 6;
+  for (n = 0; isdigit(*p) && n < LIG_GROUPS; p++) n = n * 10 + *p - '0';
+  if (n >= LIG_GROUPS || (*p != ']' && !Uisspace(*p)))
+    {
+    *errptr = B2PF_ERROR_BADGROUP;
+    return NULL;
+    }
+  *gptr = n;
+  }
+
+if (*p != ']')
+  {
+  *errptr = B2PF_ERROR_MISSINGOPTKET;
+  return NULL;
+  }
+
+return ++p;
+}
+
+
+
 /*************************************************
 *            Process one rules line              *
 *************************************************/
@@ -424,6 +495,7 @@ coded_rule *rule, **rulesptr;
 uschar *p = (uschar *)rline;
 
 if (context == NULL || rline == NULL) return B2PF_ERROR_NULL;
+if (context->frozen || context->image != NULL) return B2PF_ERROR_FROZEN;
 prelen = replen = 0;   /* Pre-assertion and replacement lengths */
 hadbra = hadket = hadarrow = FALSE;
 
@@ -503,6 +575,15 @@ switch (c)
 
   READLIG:
   while (Uisspace(*p)) p++;
+  options = 0;   /* Ligature group */
+
+  if (*p == '[')
+    {
+    p = read_ligature_options(p, &options, &errorcode);
+    if (p == NULL) return errorcode;
+    while (Uisspace(*p)) p++;
+    }
+
   for (i = 0; i < 3; i++)
     {
     if (*p == 0 || *p == '#') return B2PF_ERROR_BADLIGATURE;
@@ -520,6 +601,7 @@ switch (c)
   t->first = t->last = (t->first << 32) | lig[1];
   t->type = ttype;
   t->pforms[0] = lig[2];
+  t->pforms[1] = options;
   if (!PRIV(tree_insert)(tbase, t)) return B2PF_ERROR_DUPLIGATURE;
 
 #ifdef DEBUGTREE
@@ -824,6 +906,11 @@ uschar buffer[128];
 (void)options;   /* No options yet defined */
 
 if (context == NULL || lineptr == NULL) return B2PF_ERROR_NULL;
+if (context->frozen || context->image != NULL)
+  {
+  *lineptr = 0;
+  return B2PF_ERROR_FROZEN;
+  }
 
 /* If the rules file name is empty, do nothing */
 
@@ -911,7 +998,9 @@ return errorcode;
 *      Add a callback function to a context      *
 *************************************************/
 
-/* Arguments:
+/* Any answers that were remembered from a previous callback are forgotten.
+
+Arguments:
   context    the context
   callback   the callback function
   data       a data value for the callback
@@ -924,16 +1013,112 @@ b2pf_context_set_callback(b2pf_context *context, uint32_t options,
   int(*callback)(uint32_t, void *), void *data)
 {
 if (context == NULL) return B2PF_ERROR_NULL;
+if (context->frozen) return B2PF_ERROR_FROZEN;
 if ((options & ~B2PF_CALLBACK_OPTIONS) != 0) return B2PF_ERROR_BADOPTIONS;
 context->callback = callback;
 context->callback_data = data;
 context->options &= ~B2PF_CALLBACK_OPTIONS;
 context->options |= options;
+return b2pf_context_clear_callback_cache(context);
+}
+
+
+
+/*************************************************
+*   Add a ligature list callback to a context    *
+*************************************************/
+
+/* The list callback is called once with all the ligatures in the context, and
+its answers are remembered until the cache is cleared. It is used only when
+the B2PF_CALLBACK_LIGATURE option is set. A NULL callback removes it. Any
+answers that were remembered from a previous callback are forgotten.
+
+Arguments:
+  context    the context
+  callback   the list callback function, or NULL
+  data       a data value for the callback
+
+Returns:     0 on success or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_set_list_callback(b2pf_context *context,
+  void(*callback)(const uint32_t *, uint8_t *, uint32_t, void *), void *data)
+{
+if (context == NULL) return B2PF_ERROR_NULL;
+if (context->frozen) return B2PF_ERROR_FROZEN;
+context->listcallback = callback;
+context->listcallback_data = data;
+return b2pf_context_clear_callback_cache(context);
+}
+
+
+
+/*************************************************
+*       Forget cached callback answers           *
+*************************************************/
+
+/* This is for use when the answers that a callback would give have changed,
+for example, because the font has changed. It may be used on a compiled
+context, even while other threads are formatting with it.
+
+Argument:  the context
+Returns:   0 on success or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_clear_callback_cache(b2pf_context *context)
+{
+if (context == NULL) return B2PF_ERROR_NULL;
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_lock(&(context->verdict_lock));
+#endif
+if (context->ligverdicts != NULL)
+  {
+  context->free(context->ligverdicts, context->memory_data);
+  context->ligverdicts = NULL;
+  }
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_unlock(&(context->verdict_lock));
+#endif
 return 0;
 }
 
 
 
+/*************************************************
+*      Compile a context and make it read-only   *
+*************************************************/
+
+/* Normally a context is compiled and checked by the first call to
+b2pf_format_string() after it has been changed. This function does it
+explicitly, and then "freezes" the context so that it cannot be changed again.
+Thereafter, formatting functions only read the context, so it can be shared
+between threads. A context check error does not prevent freezing; it is
+returned again by each formatting call. After a memory error, the context is
+not frozen.
+
+Argument:  the context
+Returns:   B2PF_SUCCESS, B2PF_ERROR_CONTEXTCHECK, or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_compile(b2pf_context *context)
+{
+int rc;
+
+if (context == NULL) return B2PF_ERROR_NULL;
+
+if (!context->checked) rc = PRIV(check_context)(context);
+  else rc = (context->check_error == CHECK_ERROR0)?
+    B2PF_SUCCESS : B2PF_ERROR_CONTEXTCHECK;
+
+if (rc != B2PF_ERROR_MEMORY) context->frozen = TRUE;
+return rc;
+}
+
+
+
 /*************************************************
 *         Create and initialize a context        *
 *************************************************/
@@ -972,15 +1157,36 @@ if (context == NULL) return B2PF_ERROR_MEMORY;
 context->malloc = private_malloc;
 context->free = private_free;
 context->callback = NULL;
+context->listcallback = NULL;
 context->memory_data = memory_data;
 context->callback_data = NULL;
+context->listcallback_data = NULL;
+context->ligverdicts = NULL;
 context->chartreebase = NULL;
 context->ligtreebase = NULL;
 context->aftertreebase = NULL;
 context->rules = NULL;
+context->pageindex = NULL;
+context->charpages = NULL;
+context->ligatures = NULL;
+memset(&(context->ligmatrix), 0, sizeof(lig_matrix));
+memset(&(context->aftmatrix), 0, sizeof(lig_matrix));
+memset(&(context->dfa), 0, sizeof(rule_dfa));
+context->image = NULL;
+context->imagesize = 0;
+context->imageowned = FALSE;
+context->charpagecount = 0;
+context->ligcount = 0;
+context->maxsubst = 0;
+context->expansion = 1;
+context->wordstart = MAX_UTF_CODE_POINT + 1;
 context->options = options;
 context->checked = FALSE;
+context->frozen = FALSE;
 context->check_error = CHECK_ERROR0;  /* No error */
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_init(&(context->verdict_lock), NULL);
+#endif
 
 rc = b2pf_context_add_file(context, rules_name, rules_dir_list, options,
   lineptr);
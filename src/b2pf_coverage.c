@@ -0,0 +1,126 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains functions for creating and using coverage sets, which
+record which ligatures a font can display.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+
+
+/*************************************************
+*           Create a coverage set                *
+*************************************************/
+
+/* The characters that a font supports are given as a list of ranges, each of
+which is a pair of code points, the first and last in the range. The ranges
+may be in any order. For each ligature in the context, a bit is set if its
+result is in any of the ranges, so the set takes one bit per ligature, however
+many characters the font has. The context must have been compiled by
+b2pf_context_compile(), so that its ligatures cannot change. The set takes its
+memory management functions from the context.
+
+Arguments:
+  context     the context
+  ranges      a vector of 2 * count code points
+  count       the number of ranges
+  covptr      where to put the coverage set pointer if successful
+
+Returns:      B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_coverage_create(b2pf_context *context, const uint32_t *ranges,
+  size_t count, b2pf_coverage **covptr)
+{
+b2pf_coverage *cov;
+size_t bytes, i;
+uint32_t n;
+
+if (context == NULL || (ranges == NULL && count != 0) || covptr == NULL)
+  return B2PF_ERROR_NULL;
+if (!context->frozen) return B2PF_ERROR_NOTCOMPILED;
+
+bytes = context->ligcount/8 + 1;
+cov = context->malloc(sizeof(b2pf_coverage) + bytes, context->memory_data);
+if (cov == NULL) return B2PF_ERROR_MEMORY;
+
+cov->malloc = context->malloc;
+cov->free = context->free;
+cov->memory_data = context->memory_data;
+cov->context = context;
+cov->bits = (uint8_t *)(cov + 1);
+memset(cov->bits, 0, bytes);
+
+for (n = 1; n <= context->ligcount; n++)
+  {
+  uint32_t c = context->ligatures[n].code;
+  for (i = 0; i < count; i++)
+    {
+    if (c >= ranges[2*i] && c <= ranges[2*i + 1])
+      {
+      cov->bits[n/8] |= (uint8_t)(1u << (n%8));
+      break;
+      }
+    }
+  }
+
+*covptr = cov;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*            Free a coverage set                 *
+*************************************************/
+
+/*
+Argument:  the coverage set, or NULL
+Returns:   nothing
+*/
+
+B2PF_EXP_DEFN void
+b2pf_coverage_free(b2pf_coverage *cov)
+{
+if (cov == NULL) return;
+cov->free(cov, cov->memory_data);
+}
+
+/* End of b2pf_coverage.c */
@@ -92,6 +92,14 @@ static const uschar error_texts[] =
   "\\n, \\N, \\p, and \\P are invalid in replacement text\0"
   /* 30 */
   "Callback requested but no callback function is set\0"
+  "Context has been compiled and can no longer be changed\0"
+  "Context has not been compiled by b2pf_context_compile()\0"
+  "Input contains nothing to format, so no output was written\0"
+  "Failed to open, read, or write context image file\0"
+  /* 35 */
+  "File is not a context image for this version of B2PF on this architecture\0"
+  "Coverage set was created for a different context\0"
+  "Invalid ligature option (only group=0 to group=31 is recognized)\0"
   ;
 
 /* UTF error texts are in the same format. */
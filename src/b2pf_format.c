@@ -43,263 +43,455 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "b2pf_internal.h"
 
 
-/* This is a fake character tree node that is used for ligatures that are not
-listed in the character tree. */
+/* This value is returned by match_rule() when a rule does not match. It must
+not be the same as any error code. */
 
-static tree_node default_miscchar = {
-  NULL, NULL,      /* left, right */
-  0, 0,            /* first, last (should never be consulted) */
-  { 0, 0, 0, 0 },  /* no presentation forms */
-  0,               /* balance factor (never consulted) */
-  CT_MISC          /* type */
-  };
+#define RULE_NOMATCH  (-1000)
 
 
 
 /*************************************************
-*      Convert a word to presentation form       *
+*     Match a rule and output its replacement    *
 *************************************************/
 
-/* This is what the whole library is about.
+/* This is the interpreter for a single rule at a given position in a word.
 
 Arguments:
+  r              the rule
+  i              the current position in the word
   word           points to start of word
   count          number of characters in the word (at least 1)
-  treecache      cache of tree pointers for each character
+  propcache      cache of property pointers for each character
   outbuffer      output buffer
   outsize        size of output buffer
   outusedptr     pointer to output used value
-  context        the current context
-  error_offset   where to return an offset on error (initialized to 0)
+  resumeptr      where to return the position after the replaced characters
 
-Returns:         B2PF_SUCCESS or an error code
+Returns:         B2PF_SUCCESS if the rule matched, RULE_NOMATCH if it did not,
+                   or an error code
 */
 
 static int
-format_word(uint32_t *word, size_t count, tree_node **treecache,
-  uint32_t *outbuffer, size_t outsize, size_t *outusedptr,
-  b2pf_context *context, size_t *error_offset)
+match_rule(coded_rule *r, size_t i, uint32_t *word, size_t count,
+  const char_props **propcache, uint32_t *outbuffer, size_t outsize,
+  size_t *outusedptr, size_t *resumeptr)
 {
-tree_node *t;
-size_t i;
+const char_props *t = NULL;
+uint32_t *rp;
+size_t j, k, kket;
+size_t wildcount = 0;
 size_t outused = *outusedptr;
+size_t wildmatch[WORDMAX];
 
-/* Scan character by character and apply the rules. */
+/* k is the scanning index. Start at the current character and go back by the
+number of chars in the pre-assertion. We have to include combiners with each
+character, so cannot just do a substraction. */
 
-for (i = 0; i < count; i++)
+k = i;
+kket = count;   /* Haven't hit ket yet */
+
+for (j = 0; j < r->prelen; j++)
   {
-  coded_rule *r;
-  uint32_t *rp;
+  for (;;)
+    {
+    if (k == 0) return RULE_NOMATCH;  /* Too few preceding characters */
+    if ((propcache[--k])->type != CT_COMB) break;
+    }
+  }
 
-  *error_offset = i;  /* In case any errors occur */
+/* Check the rule */
+
+for (rp = r->code; *rp != R_REND && *rp != R_BECOMES; rp++)
+  {
+  /* Rule items >= R_ANY must have a character to match. */
+
+  if (*rp >= R_ANY || (*rp & 0x80000000u) == 0)
+    {
+    if (k >= count) return RULE_NOMATCH;  /* No character available */
+    t = propcache[k];
+    }
+
+  switch(*rp)
+    {
+    case R_WSTART:
+    if (i > 0) return RULE_NOMATCH;
+    break;
+
+    case R_WEND:
+    if (k != count) return RULE_NOMATCH;
+    break;
+
+    case R_BRA:
+    if (k != i) return B2PF_ERROR_INTERNAL2;
+    break;
+
+    case R_KET:
+    kket = k;
+    break;
+
+    case R_NOTJOINNEXT:
+    if (t->type == CT_PRES &&
+         (t->pforms[F_INITIAL] != 0 || t->pforms[F_MEDIAL] != 0))
+      return RULE_NOMATCH;
+    break;
+
+    case R_NOTJOINPREV:
+    if (t->type == CT_PRES &&
+         (t->pforms[F_FINAL] != 0 || t->pforms[F_MEDIAL] != 0))
+      return RULE_NOMATCH;
+    break;
+
+    case R_ANY:
+    break;
+
+    case R_FINAL:
+    if (t->type != CT_PRES || t->pforms[F_FINAL] == 0) return RULE_NOMATCH;
+    break;
+
+    case R_INITIAL:
+    if (t->type != CT_PRES || t->pforms[F_INITIAL] == 0) return RULE_NOMATCH;
+    break;
+
+    case R_MEDIAL:
+    if (t->type != CT_PRES || t->pforms[F_MEDIAL] == 0) return RULE_NOMATCH;
+    break;
+
+    case R_JOINNEXT:
+    if (t->type != CT_PRES ||
+      (t->pforms[F_INITIAL] == 0 && t->pforms[F_MEDIAL] == 0))
+        return RULE_NOMATCH;
+    break;
+
+    case R_JOINPREV:
+    if (t->type != CT_PRES ||
+      (t->pforms[F_MEDIAL] == 0 && t->pforms[F_FINAL] == 0))
+        return RULE_NOMATCH;
+    break;
+
+    case R_ISOLATED:
+    if (t->type != CT_PRES || t->pforms[F_ISOLATED] == 0) return RULE_NOMATCH;
+    break;
+
+    default:
+    if ((*rp & 0x80000000u) != 0) return B2PF_ERROR_INTERNAL1;
+    if (word[k] != *rp) return RULE_NOMATCH;
+    break;
+    }
+
+  /* If we accepted a character, advance past it and any following combiners.
+  Remember the positions of any non-literals. */
 
-  for (r = context->rules; r != NULL; r = r->next)
+  if ((*rp & 0x80000000u) == 0)
     {
-    size_t j, k, kket;
-    size_t wildcount = 0;
-    size_t wildmatch[WORDMAX];
+    while (++k < count && (propcache[k])->type == CT_COMB) {}
+    }
+
+  else if (*rp >= R_ANY)
+    {
+    if (k >= i && k <= kket) wildmatch[wildcount++] = k;
+    while (++k < count && (propcache[k])->type == CT_COMB) {}
+    }
+  }    /* End of rule matching scan */
 
-    /* k is the scanning index. Start at the current character and go back by
-    the number of chars in the pre-assertion. We have to include combiners with
-    each character, so cannot just do a substraction. */
+/* The rule has successfully matched. Handle a replacement. */
 
-    k = i;
-    kket = count;   /* Haven't hit ket yet */
+if (*rp == R_BECOMES) rp++;  /* Point to replacement */
+k = 0;
 
-    for (j = 0; j < r->prelen; j++)
+for (; *rp != R_REND; rp++)
+  {
+  if ((*rp & 0x80000000u) != 0)
+    {
+    if (k >= wildcount) return B2PF_ERROR_NOTYPE;
+    j = wildmatch[k++];
+
+    if (*rp == R_ANY)
       {
       for (;;)
         {
-        if (k == 0) goto NEXTRULE;  /* Too few preceding characters */
-        if ((treecache[--k])->type != CT_COMB) break;
+        if (outused >= outsize) return B2PF_ERROR_OVERFLOW;
+        outbuffer[outused++] = word[j++];
+        if (j >= count || (propcache[j])->type != CT_COMB) break;
         }
       }
 
-    /* Check the rule */
-
-    for (rp = r->code; *rp != R_REND && *rp != R_BECOMES; rp++)
+    else
       {
-      /* Rule items >= R_ANY must have a character to match. */
+      uint32_t form;
 
-      if (*rp >= R_ANY || (*rp & 0x80000000u) == 0)
-        {
-        if (k >= count) goto NEXTRULE;  /* No character available */
-        t = treecache[k];
-        }
+      t = propcache[j];
+      if (t->type != CT_PRES) return B2PF_ERROR_NOPFORM;
 
       switch(*rp)
         {
-        case R_WSTART:
-        if (i > 0) goto NEXTRULE;
-        break;
+        default: return B2PF_ERROR_INTERNAL3;
+        case R_ISOLATED: form = F_ISOLATED; break;
+        case R_FINAL: form = F_FINAL; break;
+        case R_INITIAL: form = F_INITIAL; break;
+        case R_MEDIAL: form = F_MEDIAL; break;
+        case R_JOINNEXT: form = (i == 0)? F_INITIAL : F_MEDIAL; break;
 
-        case R_WEND:
-        if (k != count) goto NEXTRULE;
+        case R_JOINPREV:
+        for (k = kket; k < count; k++)
+          if ((propcache[k])->type != CT_COMB) break;
+        form = (k >= count)? F_FINAL : F_MEDIAL;
         break;
+        }
 
-        case R_BRA:
-        if (k != i) return B2PF_ERROR_INTERNAL2;
-        break;
+      if (t->pforms[form] == 0) return B2PF_ERROR_NOPFORM;
 
-        case R_KET:
-        kket = k;
-        break;
+      if (outused >= outsize) return B2PF_ERROR_OVERFLOW;
+      outbuffer[outused++] = t->pforms[form];
 
-        case R_NOTJOINNEXT:
-        if (t->type == CT_PRES &&
-             (t->pforms[F_INITIAL] != 0 || t->pforms[F_MEDIAL] != 0))
-          goto NEXTRULE;
-        break;
+      j++;
+      for (;;)
+        {
+        if (j >= count || (propcache[j])->type != CT_COMB) break;
+        if (outused >= outsize) return B2PF_ERROR_OVERFLOW;
+        outbuffer[outused++] = word[j++];
+        }
+      }
+    }
 
-        case R_NOTJOINPREV:
-        if (t->type == CT_PRES &&
-             (t->pforms[F_FINAL] != 0 || t->pforms[F_MEDIAL] != 0))
-          goto NEXTRULE;
-        break;
+  else
+    {
+    if (outused >= outsize) return B2PF_ERROR_OVERFLOW;
+    outbuffer[outused++] = *rp;
+    }
+  }
 
-        case R_ANY:
-        break;
+*outusedptr = outused;
+*resumeptr = kket;
+return B2PF_SUCCESS;
+}
 
-        case R_FINAL:
-        if (t->type != CT_PRES || t->pforms[F_FINAL] == 0) goto NEXTRULE;
-        break;
 
-        case R_INITIAL:
-        if (t->type != CT_PRES || t->pforms[F_INITIAL] == 0) goto NEXTRULE;
-        break;
 
-        case R_MEDIAL:
-        if (t->type != CT_PRES || t->pforms[F_MEDIAL] == 0) goto NEXTRULE;
-        break;
+/*************************************************
+*     Find the first matching rule by automaton  *
+*************************************************/
 
-        case R_JOINNEXT:
-        if (t->type != CT_PRES ||
-          (t->pforms[F_INITIAL] == 0 && t->pforms[F_MEDIAL] == 0))
-            goto NEXTRULE;
-        break;
+/* The automaton is run over the rule classes of the word's letters, starting
+dfa.lookback letters before the current one. Positions outside the word use
+the sentinel columns.
 
-        case R_JOINPREV:
-        if (t->type != CT_PRES ||
-          (t->pforms[F_MEDIAL] == 0 && t->pforms[F_FINAL] == 0))
-            goto NEXTRULE;
-        break;
+Arguments:
+  dfa            the rule automaton
+  lclass         the rule classes of the letters in the word
+  nletters       the number of letters
+  m              the number of the current letter
 
-        case R_ISOLATED:
-        if (t->type != CT_PRES || t->pforms[F_ISOLATED] == 0) goto NEXTRULE;
-        break;
+Returns:         the first rule that matches, or NULL if none does
+*/
 
-        default:
-        if ((*rp & 0x80000000u) != 0) return B2PF_ERROR_INTERNAL1;
-        if (word[k] != *rp) goto NEXTRULE;
-        break;
-        }
+static coded_rule *
+dfa_search(const rule_dfa *dfa, const uint16_t *lclass, int nletters, int m)
+{
+int li = m - (int)(dfa->lookback);
+int32_t v = 0;
 
-      /* If we accepted a character, advance past it and any following
-      combiners. Remember the positions of any non-literals. */
+for (;;)
+  {
+  uint32_t col = (li < 0)? dfa->bowcolumn :
+    (li >= nletters)? dfa->eowcolumn : lclass[li];
+  v = dfa->table[(size_t)v * dfa->ncolumns + col];
+  if (v < 0) break;
+  li++;
+  }
 
-      if ((*rp & 0x80000000u) == 0)
-        {
-        while (++k < count && (treecache[k])->type == CT_COMB) {}
-        }
+return (v == DFA_NOMATCH)? NULL : dfa->rules[DFA_RULE(v)];
+}
 
-      else if (*rp >= R_ANY)
-        {
-        if (k >= i && k <= kket) wildmatch[wildcount++] = k;
-        while (++k < count && (treecache[k])->type == CT_COMB) {}
-        }
-      }    /* End of rule matching scan */
 
-    /* A rule has successfully matched. Handle a replacement. */
 
-    if (*rp == R_BECOMES) rp++;  /* Point to replacement */
-    k = 0;
+/*************************************************
+*       Convert a word by the joining table      *
+*************************************************/
 
-    for (; *rp != R_REND; rp++)
-      {
-      if ((*rp & 0x80000000u) != 0)
-        {
-        if (k >= wildcount) return B2PF_ERROR_NOTYPE;
-        j = wildmatch[k++];
+/* This is used when all the rules just choose a form for one letter according
+to its neighbours. Each letter's form is looked up from the columns of the
+previous, current, and next letters, and the letter and its combiners are
+output in one pass. The result is the same as interpreting the rules.
 
-        if (*rp == R_ANY)
-          {
-          for (;;)
-            {
-            if (outused > outsize) return B2PF_ERROR_OVERFLOW;
-            outbuffer[outused++] = word[j++];
-            if (j >= count || (treecache[j])->type != CT_COMB) break;
-            }
-          }
+Arguments:
+  word           points to start of word
+  count          number of characters in the word (at least 1)
+  propcache      cache of property pointers for each character
+  outbuffer      output buffer
+  outsize        size of output buffer
+  outusedptr     pointer to output used value
+  dfa            the rule automaton, containing the joining table
+  error_offset   where to return an offset on error
 
-        else
-          {
-          uint32_t form;
+Returns:         B2PF_SUCCESS or B2PF_ERROR_OVERFLOW
+*/
+
+static int
+join_word(const uint32_t *word, size_t count, const char_props **propcache,
+  uint32_t *outbuffer, size_t outsize, size_t *outusedptr,
+  const rule_dfa *dfa, size_t *error_offset)
+{
+const uschar *jt = dfa->jointable;
+size_t nc = dfa->ncolumns;
+size_t i, next;
+size_t outused = *outusedptr;
+uint32_t prev = dfa->bowcolumn;
 
-          t = treecache[j];
-          if (t->type != CT_PRES) return B2PF_ERROR_NOPFORM;
+for (i = 0; i < count; i = next)
+  {
+  const char_props *t = propcache[i];
+  uint32_t after;
+  uschar form;
 
-          switch(*rp)
-            {
-            default: return B2PF_ERROR_INTERNAL3;
-            case R_ISOLATED: form = F_ISOLATED; break;
-            case R_FINAL: form = F_FINAL; break;
-            case R_INITIAL: form = F_INITIAL; break;
-            case R_MEDIAL: form = F_MEDIAL; break;
-            case R_JOINNEXT: form = (i == 0)? F_INITIAL : F_MEDIAL; break;
-
-            case R_JOINPREV:
-            for (k = kket; k < count; k++)
-              if ((treecache[k])->type != CT_COMB) break;
-            form = (k >= count)? F_FINAL : F_MEDIAL;
-            break;
-            }
+  for (next = i + 1; next < count && (propcache[next])->type == CT_COMB;
+       next++) {}
+  after = (next < count)? (propcache[next])->rclass : dfa->eowcolumn;
+  form = jt[((size_t)prev * nc + t->rclass) * nc + after];
 
-          if (t->pforms[form] == 0) return B2PF_ERROR_NOPFORM;
+  if (outsize - outused < next - i)
+    {
+    *error_offset = i;
+    return B2PF_ERROR_OVERFLOW;
+    }
 
-          if (outused > outsize) return B2PF_ERROR_OVERFLOW;
-          outbuffer[outused++] = t->pforms[form];
+  outbuffer[outused++] = (form == JOIN_COPY)? word[i] : t->pforms[form];
+  if (next - i > 1)
+    {
+    memcpy(outbuffer + outused, word + i + 1,
+      (next - i - 1) * sizeof(uint32_t));
+    outused += next - i - 1;
+    }
 
-          j++;
-          for (;;)
-            {
-            if (j >= count || (treecache[j])->type != CT_COMB) break;
-            if (outused > outsize) return B2PF_ERROR_OVERFLOW;
-            outbuffer[outused++] = word[j++];
-            }
-          }
-        }
+  prev = t->rclass;
+  }
 
-      else
-        {
-        if (outused > outsize) return B2PF_ERROR_OVERFLOW;
-        outbuffer[outused++] = *rp;
-        }
-      }
+*outusedptr = outused;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*      Convert a word to presentation form       *
+*************************************************/
+
+/* This is what the whole library is about. If there is a joining table, it is
+used to convert the whole word at once. If there is a rule automaton, it is
+used to find the one rule that can match at each position. Otherwise, if
+there is a dispatch index, only the candidate rules for the current letter are
+tried, in order; failing that, all the rules are tried in order.
+
+Arguments:
+  word           points to start of word
+  count          number of characters in the word (at least 1)
+  propcache      cache of property pointers for each character
+  outbuffer      output buffer
+  outsize        size of output buffer
+  outusedptr     pointer to output used value
+  context        the current context
+  error_offset   where to return an offset on error (initialized to 0)
+
+Returns:         B2PF_SUCCESS or an error code
+*/
+
+static int
+format_word(uint32_t *word, size_t count, const char_props **propcache,
+  uint32_t *outbuffer, size_t outsize, size_t *outusedptr,
+  b2pf_context *context, size_t *error_offset)
+{
+const rule_dfa *dfa = &(context->dfa);
+size_t i;
+size_t outused = *outusedptr;
+int m = 0;
+int nletters = 0;
+size_t letters[WORDMAX];
+uint16_t lclass[WORDMAX];
 
-    i = kket - 1;   /* one before where to resume scanning */
+if (dfa->jointable != NULL)
+  return join_word(word, count, propcache, outbuffer, outsize, outusedptr,
+    dfa, error_offset);
 
-    break;  /* Skip following rules */
+/* For the automaton, make a list of the positions and rule classes of the
+letters, that is, the non-combiners. */
 
-    NEXTRULE: continue;
+if (dfa->table != NULL)
+  {
+  for (i = 0; i < count; i++)
+    {
+    if ((propcache[i])->type == CT_COMB) continue;
+    letters[nletters] = i;
+    lclass[nletters++] = (propcache[i])->rclass;
     }
+  }
 
-  /* If no rule matched, copy this character and any following combiners. */
+/* Scan character by character and apply the rules. */
+
+for (i = 0; i < count; i++)
+  {
+  coded_rule *r;
+  size_t resume;
+  int rc = RULE_NOMATCH;
+
+  *error_offset = i;  /* In case any errors occur */
+
+  if (dfa->table != NULL)
+    {
+    while (m < nletters && letters[m] < i) m++;
+    r = dfa_search(dfa, lclass, nletters, m);
+    if (r != NULL)
+      rc = match_rule(r, i, word, count, propcache, outbuffer, outsize,
+        &outused, &resume);
+    }
 
-  if (r == NULL)
+  else if (dfa->index != NULL)
     {
-    size_t j;
-    if (outused > outsize) return B2PF_ERROR_OVERFLOW;
-    outbuffer[outused++] = word[i];
+    const uint32_t *ip = dfa->index + propcache[i]->rclass +
+      ((i == 0)? 0 : dfa->ncolumns);
+    uint32_t n;
 
-    for (j = i + 1; j < count; j++)
+    for (n = ip[0]; n < ip[1]; n++)
       {
-      if ((treecache[j])->type != CT_COMB) break;
-      if (outused > outsize) return B2PF_ERROR_OVERFLOW;
-      outbuffer[outused++] = word[++i];
+      r = dfa->rules[dfa->indexrules[n]];
+      rc = match_rule(r, i, word, count, propcache, outbuffer, outsize,
+        &outused, &resume);
+      if (rc != RULE_NOMATCH) break;
       }
     }
-  }   /* End of loop scanning the word's characters. */
 
+  else
+    {
+    uint32_t n;
+
+    for (n = 0; n < dfa->nrules; n++)
+      {
+      r = dfa->rules[n];
+      rc = match_rule(r, i, word, count, propcache, outbuffer, outsize,
+        &outused, &resume);
+      if (rc != RULE_NOMATCH) break;
+      }
+    }
+
+  /* If a rule matched, continue after the replaced characters. */
+
+  if (rc == B2PF_SUCCESS)
+    {
+    i = resume - 1;   /* one before where to resume scanning */
+    continue;
+    }
+
+  if (rc != RULE_NOMATCH) return rc;
+
+  /* If no rule matched, copy this character and any following combiners. */
+
+  if (outused >= outsize) return B2PF_ERROR_OVERFLOW;
+  outbuffer[outused++] = word[i];
+
+  while (i + 1 < count && (propcache[i + 1])->type == CT_COMB)
+    {
+    if (outused >= outsize) return B2PF_ERROR_OVERFLOW;
+    outbuffer[outused++] = word[++i];
+    }
+  }   /* End of loop scanning the word's characters. */
 
 *outusedptr = outused;
 return B2PF_SUCCESS;
@@ -307,6 +499,101 @@ return B2PF_SUCCESS;
 
 
 
+/*************************************************
+*       Ask whether a ligature can be used       *
+*************************************************/
+
+/* This is called only when the B2PF_CALLBACK_LIGATURE option is set. Without
+caching, the callback is called every time. Otherwise, the answer for each
+ligature is remembered in the context until the cache is cleared. If there is
+a list callback, it is called to get answers for every ligature at once when
+the cache is empty. The cache is shared by all threads that use the context,
+so it is protected by a lock, which is held while a callback is running so that
+each answer is sought only once.
+
+Arguments:
+  context     the context
+  lig         the ligature
+  usable      where to return TRUE if the ligature can be used
+
+Returns:      B2PF_SUCCESS or an error code
+*/
+
+static int
+check_ligature(b2pf_context *context, const ligature *lig, BOOL *usable)
+{
+uint32_t n = (uint32_t)(lig - context->ligatures);
+uint8_t *verdicts;
+int rc = B2PF_SUCCESS;
+
+if ((context->options & B2PF_CALLBACK_CACHE) == 0 &&
+    context->listcallback == NULL)
+  {
+  if (context->callback == NULL) return B2PF_ERROR_NOCALLBACK;
+  *usable = context->callback(lig->code, context->callback_data) != 0;
+  return B2PF_SUCCESS;
+  }
+
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_lock(&(context->verdict_lock));
+#endif
+
+verdicts = context->ligverdicts;
+if (verdicts == NULL)
+  {
+  verdicts = context->malloc(context->ligcount + 1, context->memory_data);
+  if (verdicts == NULL)
+    {
+    rc = B2PF_ERROR_MEMORY;
+    goto EXIT;
+    }
+  memset(verdicts, LIG_UNKNOWN, context->ligcount + 1);
+
+  if (context->listcallback != NULL)
+    {
+    uint32_t i;
+    uint32_t *codes = context->malloc(
+      ((size_t)context->ligcount + 1) * sizeof(uint32_t), context->memory_data);
+    if (codes == NULL)
+      {
+      context->free(verdicts, context->memory_data);
+      rc = B2PF_ERROR_MEMORY;
+      goto EXIT;
+      }
+    for (i = 1; i <= context->ligcount; i++)
+      codes[i] = context->ligatures[i].code;
+    context->listcallback(codes + 1, verdicts + 1, context->ligcount,
+      context->listcallback_data);
+    for (i = 1; i <= context->ligcount; i++)
+      verdicts[i] = (verdicts[i] != 0)? LIG_USABLE : LIG_UNUSABLE;
+    context->free(codes, context->memory_data);
+    }
+
+  context->ligverdicts = verdicts;
+  }
+
+if (verdicts[n] == LIG_UNKNOWN)
+  {
+  if (context->callback == NULL)
+    {
+    rc = B2PF_ERROR_NOCALLBACK;
+    goto EXIT;
+    }
+  verdicts[n] = (context->callback(lig->code, context->callback_data) != 0)?
+    LIG_USABLE : LIG_UNUSABLE;
+  }
+
+*usable = verdicts[n] == LIG_USABLE;
+
+EXIT:
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_unlock(&(context->verdict_lock));
+#endif
+return rc;
+}
+
+
+
 /*************************************************
 *      Convert a string to presentation form     *
 *************************************************/
@@ -314,7 +601,9 @@ return B2PF_SUCCESS;
 /* The string is scanned for words, that is, sequences that start with a known
 letter and contain only letters and combiners. Ligatures are processed while
 extracting a word. Then each word is processed according to the rules. All
-other characters are copied verbatim.
+other characters are copied verbatim. If there is a word cache, the output for
+each word is sought there before processing it, and added afterwards if it was
+not found. The input is not modified, so it can be the caller's UTF-32 string.
 
 Arguments:
   inbuffer      input, in 32-bit characters
@@ -323,28 +612,28 @@ Arguments:
   outsize       size of output buffer
   outusedptr    where to put the amount used
   context       the current context
+  cache         a word cache, or NULL
+  coverage      a coverage set, or NULL
+  groups        the enabled ligature groups
   error_offset  where to return an offset after an error
 
 Returns:        B2PF_SUCCESS or an error code
 */
 
 int
-PRIV(format_string)(uint32_t *inbuffer, size_t insize, uint32_t *outbuffer,
+PRIV(format_string)(const uint32_t *inbuffer, size_t insize, uint32_t *outbuffer,
   size_t outsize, size_t *outusedptr, b2pf_context *context,
+  b2pf_word_cache *cache, const b2pf_coverage *coverage, uint32_t groups,
   size_t *error_offset)
 {
-int yield = B2PF_SUCCESS;
-uint32_t *p = inbuffer;
-uint32_t *pend = inbuffer + insize;
+const uint32_t *p = inbuffer;
+const uint32_t *pend = inbuffer + insize;
 size_t outused = 0;
 size_t save_outused;
 
 if (inbuffer == NULL || outbuffer == NULL || outusedptr == NULL ||
     context == NULL || error_offset == NULL) return B2PF_ERROR_NULL;
 
-if (!context->checked && !PRIV(check_context)(context))
-  yield = B2PF_ERROR_CONTEXTCHECK;
-
 /* Scan the string searching for the starts of words, copying any non-word
 characters and combiners, which cannot start a word. Then read each word and
 cause it to be processed. */
@@ -352,67 +641,104 @@ cause it to be processed. */
 while (p < pend)
   {
   int rc;
+  size_t skip;
   size_t wordcount = 0;
   size_t word_error_offset = 0;
-  uschar previous_type;
-  uint32_t previous;
+  size_t keylen = 0;
+  uint32_t hash = 0;
+  const uint32_t *key = p;
+  const uint32_t *consumed = p;
+  const char_props *previous;
   uint32_t word[WORDMAX];
-  tree_node *treecache[WORDMAX];
-  tree_node *t = PRIV(tree_search)(context->chartreebase, *p);
+  const char_props *propcache[WORDMAX];
+  const char_props *t;
 
-  /* Not a start of word character */
+  /* Copy any characters that cannot start a word, that is, unknown characters
+  and combiners. */
 
-  if (t == NULL || t->type == CT_COMB)
+  skip = PRIV(skip_nonword)(context, p, pend - p);
+  if (skip > 0)
     {
-    if (outused >= outsize)
+    if (outsize - outused < skip)
       {
-      *error_offset = p - inbuffer;
+      *error_offset = (p - inbuffer) + (outsize - outused);
       return B2PF_ERROR_OVERFLOW;
       }
-    outbuffer[outused++] = *p++;
+    memcpy(outbuffer + outused, p, skip * sizeof(uint32_t));
+    outused += skip;
+    p += skip;
     continue;
     }
 
-  /* We are now at the start of a word. Save the first character and its tree
-  pointer. */
+  t = GET_PROPS(context, *p);
+
+  /* We are now at the start of a word. If there is a cache, find the end of
+  the word, which is at the next unknown character, and look it up. */
+
+  if (cache != NULL)
+    {
+    const uint32_t *q;
+    for (q = p + 1; q < pend; q++)
+      if (GET_PROPS(context, *q)->type == CT_NONE) break;
+
+    if (q - p <= WORDMAX)
+      {
+      size_t n;
+      keylen = q - p;
+      hash = PRIV(word_hash)(p, keylen);
+      if (PRIV(word_cache_find)(cache, p, keylen, hash, outbuffer + outused,
+            outsize - outused, &n))
+        {
+        outused += n;
+        p = q;
+        continue;
+        }
+      }
+    }
+
+  /* Save the first character and its properties pointer. */
 
-  previous = word[wordcount] = *p;
-  previous_type = t->type;
-  treecache[wordcount++] = t;
+  word[wordcount] = *p;
+  previous = propcache[wordcount++] = t;
   *error_offset = p - inbuffer;  /* In case of error while formatting */
 
   /* Read the rest of the word. Any character in the characters tree is
-  allowed. Check with the previous character for a possible ligature. */
+  allowed. Check with the previous character for a possible ligature. A
+  non-combiner that has been used as the second character of a ligature
+  further back is skipped. Such characters are always the only non-combiners
+  between the current position and the end of the last one, so only that end
+  needs to be remembered. */
 
   for (++p; p < pend; p++)
     {
-    tree_node *tt = NULL;   /* No ligature */
-    uint32_t *pp = p;       /* Pointer to second ligature character */
-    uint32_t c = *p;        /* Second ligature character */
+    const ligature *lig = NULL;   /* No ligature */
+    const uint32_t *pp = p;       /* Pointer to second ligature character */
+    uint32_t c = *p;              /* Second ligature character */
 
-    t = PRIV(tree_search)(context->chartreebase, c);
-    if (t == NULL) break;  /* Unknown character ends word */
+    t = GET_PROPS(context, c);
+    if (p < consumed && t->type != CT_COMB) continue;
+    if (t->type == CT_NONE) break;  /* Unknown character ends word */
 
     /* Ligatures can be formed by combining characters as well as by
     non-combining characters, but not between one of each. However, if a
     non-combiner is followed by a combiner, look past one or more combiners to
-    see if the next non-combiner can ligature with the first character. */
+    see if the next non-combiner can ligature with the first character. There
+    is nothing to do if the previous character does not start any ligature. */
 
-    if (previous_type != CT_COMB || t->type == CT_COMB) /* Ligature possible */
+    if (previous->ligfirst != 0 &&
+        (previous->type != CT_COMB || t->type == CT_COMB))
       {
-      uint64_t lkey = previous;
-      lkey = (lkey << 32) | c;
+      const char_props *second = t;
 
-      if (previous_type != CT_COMB && t->type == CT_COMB)
+      if (previous->type != CT_COMB && t->type == CT_COMB)
         {
         for (pp = p+1; pp < pend; pp++)
           {
-          uint32_t cc = *pp;
-          tt = PRIV(tree_search)(context->chartreebase, cc);
-          if (tt == NULL) goto ENDLIGCHECK;  /* Not a ligature */
-          if (tt->type != CT_COMB)           /* Found possible 2nd char */
+          const char_props *cc = GET_PROPS(context, *pp);
+          if (cc->type == CT_NONE) goto ENDLIGCHECK;  /* Not a ligature */
+          if (cc->type != CT_COMB && pp >= consumed) /* Found possible 2nd char */
             {
-            lkey = (lkey & 0xffffffff00000000u) | cc;
+            second = cc;
             break;
             }
           }
@@ -420,42 +746,53 @@ while (p < pend)
 
       /* Check for a ligature */
 
-      tt = PRIV(tree_search)(context->ligtreebase, lkey);
+      if (second->ligsecond != 0)
+        {
+        uint32_t n = LIG_LOOKUP(context->ligmatrix, previous->ligfirst,
+          second->ligsecond);
+        if (n != 0) lig = context->ligatures + n;
+        }
       }
 
     ENDLIGCHECK:
 
-    /* If we found a ligature, and a suitable callback is set up, use it to
-    check this ligature. Typically the application checks whether it is
+    /* A ligature whose group is not enabled is ignored. If we found a
+    ligature, and there is a coverage set or a suitable callback is set up, use
+    it to check this ligature. Typically the application checks whether it is
     available in the current font. */
 
-    if (tt != NULL && (context->options & B2PF_CALLBACK_LIGATURE) != 0)
+    if (lig != NULL && (groups & (1u << lig->group)) == 0)
+      lig = NULL;  /* Group not enabled */
+
+    if (lig != NULL && coverage != NULL &&
+        !COVERED(coverage, lig - context->ligatures))
+      lig = NULL;  /* Not in the font */
+
+    if (lig != NULL && (context->options & B2PF_CALLBACK_LIGATURE) != 0)
       {
-      if (context->callback == NULL) return B2PF_ERROR_NOCALLBACK;
-      if (context->callback(tt->pforms[0], context->callback_data) == 0)
-        tt = NULL;  /* Do not use this ligature */
+      BOOL usable;
+      rc = check_ligature(context, lig, &usable);
+      if (rc != B2PF_SUCCESS) return rc;
+      if (!usable) lig = NULL;  /* Do not use this ligature */
       }
 
-    /* If the ligature is accepted, replace the previous character. If the
-    ligature has not been defined in the characters tree, treat it as a
-    miscellaneous character by pointing to a fake node. */
+    /* If the ligature is accepted, replace the previous character. The
+    ligature table contains a copy of the ligature's properties, with a type of
+    CT_MISC if it is not defined in the characters tree. */
 
-    if (tt != NULL)
+    if (lig != NULL)
       {
-      previous = word[wordcount-1] = tt->pforms[0];
-      t = PRIV(tree_search)(context->chartreebase, previous);
-      if (t == NULL) t = &default_miscchar;
-      treecache[wordcount-1] = t;
-      previous_type = t->type;
+      word[wordcount-1] = lig->code;
+      previous = propcache[wordcount-1] = &(lig->props);
 
       /* If pp > p it means we skipped some combiners between two non-combiners
-      that formed a ligature. Move all the intermediate characters up by one so
-      as to remove the second character from the input. */
+      that formed a ligature. The current character has not been used, so read
+      it again, and skip the second character when it is reached. */
 
-      while (pp > p)
+      if (pp > p)
         {
-        pp[0] = pp[-1];
-        pp--;
+        consumed = pp + 1;
+        p--;
         }
       }
 
@@ -468,9 +805,8 @@ while (p < pend)
         *error_offset = p - inbuffer;
         return B2PF_ERROR_OVERLONGWORD;
         }
-      previous = word[wordcount] = c;
-      previous_type = t->type;
-      treecache[wordcount++] = t;
+      word[wordcount] = c;
+      previous = propcache[wordcount++] = t;
       }
 
     }  /* End of loop to get the next word */
@@ -478,7 +814,7 @@ while (p < pend)
   /* p is now pointing after the word. */
 
   save_outused = outused;  /* Start of word */
-  rc = format_word(word, wordcount, treecache, outbuffer, outsize, &outused,
+  rc = format_word(word, wordcount, propcache, outbuffer, outsize, &outused,
     context, &word_error_offset);
 
   if (rc != B2PF_SUCCESS)
@@ -487,69 +823,89 @@ while (p < pend)
     return rc;
     }
 
-  /* If there is an "after" tree, scan the output word for possible ligatures
-  to apply at this point. */
+  /* If there is an "after" tree, scan the output word once for possible
+  ligatures to apply at this point. Only non-combiner ligatures are recognized
+  here, so each non-combiner is checked against the most recent one, ignoring
+  any combiners between them. The word is compacted as it is scanned: when a
+  ligature is accepted, the first character is replaced, and the second is
+  not copied. The replacement may itself form a ligature with the next
+  non-combiner. */
 
-  if (context->aftertreebase != NULL)
+  if (context->aftmatrix.matrix != NULL)
     {
-    size_t x = save_outused;
-    while (x < outused - 1)
-      {
-      size_t y;
-      uint64_t lkey;
-      tree_node *tt;
+    size_t x = 0;                       /* Offset of first character */
+    size_t y = save_outused;            /* Where to write */
+    size_t z;                           /* Where to read */
+    const char_props *first = NULL;     /* No first character yet */
 
-      /* Only non-combiner ligatures are recognized here. */
+    for (z = save_outused; z < outused; z++)
+      {
+      uint32_t c = outbuffer[z];
+      const char_props *second = GET_PROPS(context, c);
 
-      t = PRIV(tree_search)(context->chartreebase, outbuffer[x]);
-      if (t != NULL && t->type == CT_COMB)
+      if (second->type != CT_COMB)
         {
-        x++;
-        continue;
-        }
+        const ligature *lig = NULL;
 
-      for (y = x + 1; y < outused; y++)
-        {
-        t = PRIV(tree_search)(context->chartreebase, outbuffer[y]);
-        if (t == NULL || t->type != CT_COMB) break;
-        }
-      if (y >= outused) break;  /* No following non-combiner; end of word */
+        if (first != NULL && first->aftfirst != 0 && second->aftsecond != 0)
+          {
+          uint32_t n = LIG_LOOKUP(context->aftmatrix, first->aftfirst,
+            second->aftsecond);
+          if (n != 0) lig = context->ligatures + n;
+          }
 
-      lkey = outbuffer[x];
-      lkey = (lkey << 32) | outbuffer[y];
-      tt = PRIV(tree_search)(context->aftertreebase, lkey);
+        /* A ligature whose group is not enabled is ignored. If we found a
+        ligature, and there is a coverage set or a suitable callback is set
+        up, use it to check this ligature. Typically the application checks
+        whether it is available in the current font. */
 
-      /* If we found a ligature, and a suitable callback is set up, use it to
-      check this ligature. Typically the application checks whether it is
-      available in the current font. */
+        if (lig != NULL && (groups & (1u << lig->group)) == 0)
+          lig = NULL;  /* Group not enabled */
 
-      if (tt != NULL && (context->options & B2PF_CALLBACK_LIGATURE) != 0)
-        {
-        if (context->callback == NULL) return B2PF_ERROR_NOCALLBACK;
-        if (context->callback(tt->pforms[0], context->callback_data) == 0)
-          tt = NULL;  /* Do not use this ligature */
-        }
+        if (lig != NULL && coverage != NULL &&
+            !COVERED(coverage, lig - context->ligatures))
+          lig = NULL;  /* Not in the font */
+
+        if (lig != NULL && (context->options & B2PF_CALLBACK_LIGATURE) != 0)
+          {
+          BOOL usable;
+          rc = check_ligature(context, lig, &usable);
+          if (rc != B2PF_SUCCESS) return rc;
+          if (!usable) lig = NULL;  /* Do not use this ligature */
+          }
 
-      /* If no (acceptable) ligature found, advance to next character. If
-      found, replace the current character, slide up the rest of the word, and
-      rescan from the current character. */
+        /* If a ligature is accepted, replace the first character, and drop
+        the second. A replacement that is a combiner cannot be the first
+        character of another ligature. */
+
+        if (lig != NULL)
+          {
+          outbuffer[x] = lig->code;
+          first = GET_PROPS(context, lig->code);
+          if (first->type == CT_COMB) first = NULL;
+          continue;
+          }
+
+        /* Otherwise, this character becomes the first of a possible
+        ligature. */
 
-      if (tt == NULL)
-        {
         x = y;
-        continue;
+        first = second;
         }
 
-      outbuffer[x] = tt->pforms[0];
-      memmove(outbuffer + y, outbuffer + (y+1),
-        (outused - (y+1))*sizeof(uint32_t));
-      outused--;
+      outbuffer[y++] = c;
       }
+
+    outused = y;
     }
+
+  if (keylen > 0)
+    PRIV(word_cache_add)(cache, key, keylen, hash, outbuffer + save_outused,
+      outused - save_outused);
   }
 
 *outusedptr = outused;
-return yield;   /* Either B2PF_SUCCESS or B2PF_ERROR_CONTEXTCHECK */
+return B2PF_SUCCESS;
 }
 
 /* End of b2pf_format.c */
@@ -0,0 +1,972 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains functions for saving a checked context as an image in a
+file or in memory, and for creating a context from such an image without
+reading a rules file or compiling anything. An image contains no pointers, so
+it can be mapped into memory at any address and used in place.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* An image starts with a header that contains the scalar values from the
+context and the offsets of the tables, each of which starts on an IMAGE_ALIGN
+boundary. An offset of zero means that the table is absent. The rules follow
+the tables, each one aligned, with a zero "next" field. The magic number is
+written in native byte order, so an image from a machine with the other byte
+order is not recognized. The sizes of the structures identify images that were
+written by a build with a different layout. */
+
+#define IMAGE_MAGIC     0x46503242u   /* "B2PF" in little-endian order */
+#define IMAGE_VERSION   3
+#define IMAGE_ALIGN     8
+
+#define IMAGE_ROUND(n)  (((n) + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1))
+
+typedef struct image_header {
+  uint32_t magic;
+  uint32_t version;
+  uint16_t headersize;       /* sizeof(image_header) */
+  uint16_t propssize;        /* sizeof(char_props) */
+  uint16_t ligsize;          /* sizeof(ligature) */
+  uint16_t rulesize;         /* offsetof(coded_rule, code) */
+  uint64_t hash;             /* hash of the image with this field zero */
+  uint64_t length;           /* length of the whole image */
+  uint64_t pageindex;        /* offsets of the tables */
+  uint64_t charpages;
+  uint64_t ligatures;
+  uint64_t ligmatrix;
+  uint64_t aftmatrix;
+  uint64_t dfatable;
+  uint64_t dfaindex;
+  uint64_t jointable;
+  uint64_t rules;
+  uint32_t indexsize;        /* elements in the dispatch index */
+  uint32_t charpagecount;
+  uint32_t ligcount;
+  uint32_t maxsubst;
+  uint32_t expansion;
+  uint32_t wordstart;
+  uint32_t check_error;
+  uint32_t ligs[2];
+  uint32_t prelig_error;
+  uint32_t lignfirst;
+  uint32_t lignsecond;
+  uint32_t aftnfirst;
+  uint32_t aftnsecond;
+  uint32_t nrules;
+  uint32_t nstates;
+  uint32_t ncolumns;
+  uint32_t bowcolumn;
+  uint32_t eowcolumn;
+  uint32_t lookback;
+} image_header;
+
+
+
+/*************************************************
+*              Hash an image                     *
+*************************************************/
+
+/* This is a 64-bit FNV-1a hash over the bytes of the image, treating the hash
+field in the header as zero.
+
+Arguments:
+  image       the image
+  length      its length
+
+Returns:      the hash value
+*/
+
+static uint64_t
+image_hash(const uschar *image, size_t length)
+{
+uint64_t hash = 14695981039346656037ull;
+size_t i;
+
+for (i = 0; i < length; i++)
+  {
+  uschar b = (i >= offsetof(image_header, hash) &&
+    i < offsetof(image_header, hash) + sizeof(uint64_t))? 0 : image[i];
+  hash ^= b;
+  hash *= 1099511628211ull;
+  }
+
+return hash;
+}
+
+
+
+/*************************************************
+*       Find the length of a rule's code         *
+*************************************************/
+
+/*
+Argument:  the rule
+Returns:   the number of code items, including the final R_REND
+*/
+
+static size_t
+rule_code_length(const coded_rule *r)
+{
+size_t n = 0;
+while (r->code[n] != R_REND) n++;
+return n + 1;
+}
+
+
+
+/*************************************************
+*       Allocate space for a table               *
+*************************************************/
+
+/*
+Arguments:
+  lengthptr   points to the length of the image so far
+  size        the size of the table
+
+Returns:      the offset of the table, or zero if its size is zero
+*/
+
+static uint64_t
+place(size_t *lengthptr, size_t size)
+{
+size_t offset = *lengthptr;
+if (size == 0) return 0;
+*lengthptr += IMAGE_ROUND(size);
+return offset;
+}
+
+
+
+/*************************************************
+*       Copy character properties                *
+*************************************************/
+
+/* The fields are copied one by one, so that the padding in the destination,
+which has been zeroed, does not depend on how the source was assigned.
+
+Arguments:
+  to          the destination
+  from        the source
+
+Returns:      nothing
+*/
+
+static void
+copy_props(char_props *to, const char_props *from)
+{
+memcpy(to->pforms, from->pforms, sizeof(to->pforms));
+to->ligfirst = from->ligfirst;
+to->ligsecond = from->ligsecond;
+to->aftfirst = from->aftfirst;
+to->aftsecond = from->aftsecond;
+to->rclass = from->rclass;
+to->type = from->type;
+}
+
+
+
+/*************************************************
+*           Build an image of a context          *
+*************************************************/
+
+/* The context must have been checked. The image is built in memory that is
+obtained from the context's allocator and is zeroed first, so that its bytes,
+and therefore its hash, depend only on the content of the context. The callback
+settings are not included.
+
+Arguments:
+  context     the context
+  lengthptr   where to return the length of the image
+
+Returns:      the image, or NULL if memory could not be obtained
+*/
+
+static uschar *
+build_image(b2pf_context *context, size_t *lengthptr)
+{
+rule_dfa *dfa = &(context->dfa);
+image_header *h;
+uschar *image;
+size_t i, rulebytes;
+size_t length = IMAGE_ROUND(sizeof(image_header));
+size_t pagebytes = ((size_t)(context->charpagecount) << CHARPAGE_SHIFT) *
+  sizeof(char_props);
+size_t ligbytes = ((size_t)(context->ligcount) + 1) * sizeof(ligature);
+size_t lmbytes = (context->ligmatrix.matrix == NULL)? 0 :
+  (size_t)(context->ligmatrix.nfirst) * context->ligmatrix.nsecond *
+    sizeof(uint32_t);
+size_t ambytes = (context->aftmatrix.matrix == NULL)? 0 :
+  (size_t)(context->aftmatrix.nfirst) * context->aftmatrix.nsecond *
+    sizeof(uint32_t);
+size_t tablebytes = (dfa->table == NULL)? 0 :
+  (size_t)(dfa->nstates) * dfa->ncolumns * sizeof(int32_t);
+size_t indexsize = (dfa->index == NULL)? 0 :
+  2 * (size_t)(dfa->ncolumns) + 1 + dfa->index[2 * dfa->ncolumns];
+size_t joinbytes = (dfa->jointable == NULL)? 0 :
+  (size_t)(dfa->ncolumns) * dfa->ncolumns * dfa->ncolumns;
+uint64_t pageoff, charoff, ligoff, lmoff, amoff, tableoff, indexoff, joinoff;
+uint64_t ruleoff;
+
+rulebytes = 0;
+for (i = 0; i < dfa->nrules; i++)
+  rulebytes += IMAGE_ROUND(offsetof(coded_rule, code) +
+    rule_code_length(dfa->rules[i]) * sizeof(uint32_t));
+
+pageoff = place(&length, CHARPAGE_COUNT * sizeof(uint16_t));
+charoff = place(&length, pagebytes);
+ligoff = place(&length, ligbytes);
+lmoff = place(&length, lmbytes);
+amoff = place(&length, ambytes);
+tableoff = place(&length, tablebytes);
+indexoff = place(&length, indexsize * sizeof(uint32_t));
+joinoff = place(&length, joinbytes);
+ruleoff = place(&length, rulebytes);
+
+image = context->malloc(length, context->memory_data);
+if (image == NULL) return NULL;
+memset(image, 0, length);
+
+h = (image_header *)image;
+h->magic = IMAGE_MAGIC;
+h->version = IMAGE_VERSION;
+h->headersize = sizeof(image_header);
+h->propssize = sizeof(char_props);
+h->ligsize = sizeof(ligature);
+h->rulesize = offsetof(coded_rule, code);
+h->length = length;
+h->pageindex = pageoff;
+h->charpages = charoff;
+h->ligatures = ligoff;
+h->ligmatrix = lmoff;
+h->aftmatrix = amoff;
+h->dfatable = tableoff;
+h->dfaindex = indexoff;
+h->jointable = joinoff;
+h->rules = ruleoff;
+h->indexsize = (uint32_t)indexsize;
+h->charpagecount = context->charpagecount;
+h->ligcount = context->ligcount;
+h->maxsubst = context->maxsubst;
+h->expansion = context->expansion;
+h->wordstart = context->wordstart;
+h->check_error = context->check_error;
+if (context->check_error != CHECK_ERROR0)
+  {
+  h->ligs[0] = context->ligs[0];
+  h->ligs[1] = context->ligs[1];
+  h->prelig_error = (uint32_t)(context->prelig_error);
+  }
+h->lignfirst = context->ligmatrix.nfirst;
+h->lignsecond = context->ligmatrix.nsecond;
+h->aftnfirst = context->aftmatrix.nfirst;
+h->aftnsecond = context->aftmatrix.nsecond;
+h->nrules = dfa->nrules;
+h->nstates = dfa->nstates;
+h->ncolumns = dfa->ncolumns;
+h->bowcolumn = dfa->bowcolumn;
+h->eowcolumn = dfa->eowcolumn;
+h->lookback = dfa->lookback;
+
+memcpy(image + pageoff, context->pageindex,
+  CHARPAGE_COUNT * sizeof(uint16_t));
+memcpy(image + charoff, context->charpages, pagebytes);
+
+for (i = 1; i <= context->ligcount; i++)
+  {
+  ligature *lig = (ligature *)(image + ligoff) + i;
+  lig->code = context->ligatures[i].code;
+  lig->group = context->ligatures[i].group;
+  copy_props(&(lig->props), &(context->ligatures[i].props));
+  }
+
+if (lmoff != 0) memcpy(image + lmoff, context->ligmatrix.matrix, lmbytes);
+if (amoff != 0) memcpy(image + amoff, context->aftmatrix.matrix, ambytes);
+if (tableoff != 0) memcpy(image + tableoff, dfa->table, tablebytes);
+if (indexoff != 0)
+  memcpy(image + indexoff, dfa->index, indexsize * sizeof(uint32_t));
+if (joinoff != 0) memcpy(image + joinoff, dfa->jointable, joinbytes);
+
+for (i = 0; i < dfa->nrules; i++)
+  {
+  coded_rule *from = dfa->rules[i];
+  coded_rule *to = (coded_rule *)(image + ruleoff);
+  size_t n = rule_code_length(from);
+
+  to->options = from->options;
+  to->prelen = from->prelen;
+  to->replen = from->replen;
+  memcpy(to->code, from->code, n * sizeof(uint32_t));
+  ruleoff += IMAGE_ROUND(offsetof(coded_rule, code) + n * sizeof(uint32_t));
+  }
+
+h->hash = image_hash(image, length);
+*lengthptr = length;
+return image;
+}
+
+
+
+/*************************************************
+*         Obtain the image of a context          *
+*************************************************/
+
+/* The context is checked if it has been changed, as b2pf_context_compile()
+does. If it was loaded from an image, that image is returned; otherwise one is
+built, and the caller must free it.
+
+Arguments:
+  context     the context
+  imageptr    where to return the image
+  lengthptr   where to return its length
+
+Returns:      B2PF_SUCCESS, B2PF_ERROR_CONTEXTCHECK, or B2PF_ERROR_MEMORY
+*/
+
+static int
+obtain_image(b2pf_context *context, uschar **imageptr, size_t *lengthptr)
+{
+int rc;
+
+if (!context->checked) rc = PRIV(check_context)(context);
+  else rc = (context->check_error == CHECK_ERROR0)?
+    B2PF_SUCCESS : B2PF_ERROR_CONTEXTCHECK;
+if (rc == B2PF_ERROR_MEMORY) return rc;
+
+if (context->image != NULL)
+  {
+  *imageptr = context->image;
+  *lengthptr = context->imagesize;
+  }
+else
+  {
+  *imageptr = build_image(context, lengthptr);
+  if (*imageptr == NULL) return B2PF_ERROR_MEMORY;
+  }
+
+return rc;
+}
+
+
+
+/*************************************************
+*          Save a context as an image            *
+*************************************************/
+
+/* The context is checked if necessary. As for b2pf_context_compile(), a
+context check error does not prevent the image from being written; it is
+returned by this function, and again by each formatting call that uses a
+context loaded from the image. If the file cannot be written completely, it is
+removed.
+
+Arguments:
+  context     the context
+  filename    the name of the file to write
+
+Returns:      B2PF_SUCCESS, B2PF_ERROR_CONTEXTCHECK, or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_save(b2pf_context *context, const char *filename)
+{
+int rc;
+BOOL ok;
+size_t length;
+uschar *image;
+FILE *f;
+
+if (context == NULL || filename == NULL) return B2PF_ERROR_NULL;
+rc = obtain_image(context, &image, &length);
+if (rc == B2PF_ERROR_MEMORY) return rc;
+
+f = fopen(filename, "wb");
+if (f == NULL) ok = FALSE; else
+  {
+  ok = fwrite(image, 1, length, f) == length;
+  if (fclose(f) != 0) ok = FALSE;
+  if (!ok) (void)remove(filename);
+  }
+
+if (image != context->image) context->free(image, context->memory_data);
+return ok? rc : B2PF_ERROR_IMAGEFILE;
+}
+
+
+
+/*************************************************
+*       Save a context as an image in memory     *
+*************************************************/
+
+/* This is like b2pf_context_save(), but the image is copied into a buffer.
+If the buffer is too small, or NULL, B2PF_ERROR_OVERFLOW is returned, and the
+length that is needed is still returned, so the function can be called once
+to find the length, and again to get the image.
+
+Arguments:
+  context     the context
+  buffer      the buffer, or NULL
+  size        the size of the buffer in bytes
+  usedptr     where to return the length of the image
+
+Returns:      B2PF_SUCCESS, B2PF_ERROR_CONTEXTCHECK, or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_save_memory(b2pf_context *context, void *buffer, size_t size,
+  size_t *usedptr)
+{
+int rc;
+size_t length;
+uschar *image;
+
+if (context == NULL || usedptr == NULL) return B2PF_ERROR_NULL;
+rc = obtain_image(context, &image, &length);
+if (rc == B2PF_ERROR_MEMORY) return rc;
+
+*usedptr = length;
+if (buffer == NULL || length > size) rc = B2PF_ERROR_OVERFLOW;
+  else memcpy(buffer, image, length);
+
+if (image != context->image) context->free(image, context->memory_data);
+return rc;
+}
+
+
+
+/*************************************************
+*          Get the hash of a context             *
+*************************************************/
+
+/* The hash is that of the image that b2pf_context_save() would write, so it
+identifies the compiled content of the context. The context is checked if
+necessary; a context check error does not prevent the hash being computed.
+
+Arguments:
+  context     the context
+  hashptr     where to return the hash
+
+Returns:      B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_get_hash(b2pf_context *context, uint64_t *hashptr)
+{
+size_t length;
+uschar *image;
+
+if (context == NULL || hashptr == NULL) return B2PF_ERROR_NULL;
+
+if (context->image != NULL)
+  {
+  *hashptr = ((image_header *)(context->image))->hash;
+  return B2PF_SUCCESS;
+  }
+
+if (obtain_image(context, &image, &length) == B2PF_ERROR_MEMORY)
+  return B2PF_ERROR_MEMORY;
+*hashptr = ((image_header *)image)->hash;
+context->free(image, context->memory_data);
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*         Check the bounds of a table            *
+*************************************************/
+
+/*
+Arguments:
+  h           the image header
+  offset      the offset of the table
+  size        its size in bytes
+
+Returns:      TRUE if the table is aligned and lies within the image
+*/
+
+static BOOL
+table_ok(const image_header *h, uint64_t offset, uint64_t size)
+{
+return offset >= sizeof(image_header) && offset % IMAGE_ALIGN == 0 &&
+  size <= h->length && offset <= h->length - size;
+}
+
+
+
+/*************************************************
+*     Check the numbers in character properties  *
+*************************************************/
+
+/*
+Arguments:
+  h           the image header
+  cp          the properties
+
+Returns:      TRUE if the ligature numbers are within the ligature matrices,
+                and the rule class is a column of the rule tables, if any
+*/
+
+static BOOL
+props_ok(const image_header *h, const char_props *cp)
+{
+return cp->ligfirst <= h->lignfirst && cp->ligsecond <= h->lignsecond &&
+  cp->aftfirst <= h->aftnfirst && cp->aftsecond <= h->aftnsecond &&
+  ((h->dfatable == 0 && h->dfaindex == 0 && h->jointable == 0) ||
+    cp->rclass < h->ncolumns);
+}
+
+
+
+/*************************************************
+*          Check and attach an image             *
+*************************************************/
+
+/* The image must have been written by this version of the library on the same
+architecture, and its hash must be correct. Every value that is used to index
+a table is also checked, so that a damaged image cannot cause formatting to
+read outside the image. If all is well, the context's tables are set up to
+point into the image, and a vector of pointers to the rules is created.
+
+Arguments:
+  context     a new, empty context
+  image       the image
+  length      its length
+
+Returns:      B2PF_SUCCESS, B2PF_ERROR_BADIMAGE, or B2PF_ERROR_MEMORY
+*/
+
+static int
+attach_image(b2pf_context *context, uschar *image, size_t length)
+{
+const image_header *h = (const image_header *)image;
+rule_dfa *dfa = &(context->dfa);
+char_props *cp;
+uint64_t offset, size;
+uint32_t *matrix;
+uint32_t *index = NULL;
+int32_t *table = NULL;
+uschar *jointable = NULL;
+uint16_t *pageindex;
+size_t i, n;
+size_t maxitems = 0;
+
+if (length < sizeof(image_header) ||
+    h->magic != IMAGE_MAGIC ||
+    h->version != IMAGE_VERSION ||
+    h->headersize != sizeof(image_header) ||
+    h->propssize != sizeof(char_props) ||
+    h->ligsize != sizeof(ligature) ||
+    h->rulesize != offsetof(coded_rule, code) ||
+    h->length != length ||
+    h->hash != image_hash(image, length))
+  return B2PF_ERROR_BADIMAGE;
+
+/* The character table */
+
+if (h->charpagecount == 0 || h->charpagecount > CHARPAGE_COUNT + 1 ||
+    !table_ok(h, h->pageindex, CHARPAGE_COUNT * sizeof(uint16_t)) ||
+    !table_ok(h, h->charpages, ((uint64_t)(h->charpagecount) <<
+      CHARPAGE_SHIFT) * sizeof(char_props)))
+  return B2PF_ERROR_BADIMAGE;
+
+pageindex = (uint16_t *)(image + h->pageindex);
+for (i = 0; i < CHARPAGE_COUNT; i++)
+  if (pageindex[i] >= h->charpagecount) return B2PF_ERROR_BADIMAGE;
+
+/* The rule automaton or dispatch index */
+
+if (h->dfatable != 0)
+  {
+  size = (uint64_t)(h->nstates) * h->ncolumns;
+  if (h->nstates == 0 || h->ncolumns == 0 || h->bowcolumn >= h->ncolumns ||
+      h->eowcolumn >= h->ncolumns ||
+      !table_ok(h, h->dfatable, size * sizeof(int32_t)))
+    return B2PF_ERROR_BADIMAGE;
+  table = (int32_t *)(image + h->dfatable);
+
+  /* Each transition must be to a later state, as it is when the automaton is
+  built, so that the automaton always stops. */
+
+  for (i = 0; i < size; i++)
+    {
+    int32_t v = table[i];
+    if (v >= 0)
+      {
+      if ((uint32_t)v >= h->nstates || (uint32_t)v <= i / h->ncolumns)
+        return B2PF_ERROR_BADIMAGE;
+      }
+    else if (v != DFA_NOMATCH && DFA_RULE(v) >= h->nrules)
+      return B2PF_ERROR_BADIMAGE;
+    }
+  }
+
+if (h->dfaindex != 0)
+  {
+  size_t nlists = 2 * (size_t)(h->ncolumns);
+  if (h->indexsize <= nlists ||
+      !table_ok(h, h->dfaindex, (uint64_t)(h->indexsize) * sizeof(uint32_t)))
+    return B2PF_ERROR_BADIMAGE;
+  index = (uint32_t *)(image + h->dfaindex);
+  if (index[nlists] != h->indexsize - nlists - 1)
+    return B2PF_ERROR_BADIMAGE;
+  for (i = 0; i < nlists; i++)
+    if (index[i] > index[i+1]) return B2PF_ERROR_BADIMAGE;
+  for (i = nlists + 1; i < h->indexsize; i++)
+    if (index[i] >= h->nrules) return B2PF_ERROR_BADIMAGE;
+  }
+
+/* The joining table holds a form or JOIN_COPY for each combination of three
+columns. */
+
+if (h->jointable != 0)
+  {
+  if (h->ncolumns == 0 || h->ncolumns > 0xffffu ||
+      h->bowcolumn >= h->ncolumns || h->eowcolumn >= h->ncolumns)
+    return B2PF_ERROR_BADIMAGE;
+  size = (uint64_t)(h->ncolumns) * h->ncolumns * h->ncolumns;
+  if (!table_ok(h, h->jointable, size)) return B2PF_ERROR_BADIMAGE;
+  jointable = image + h->jointable;
+  for (i = 0; i < size; i++)
+    if (jointable[i] > F_FINAL && jointable[i] != JOIN_COPY)
+      return B2PF_ERROR_BADIMAGE;
+  }
+
+cp = (char_props *)(image + h->charpages);
+for (i = 0; i < (size_t)(h->charpagecount) << CHARPAGE_SHIFT; i++)
+  if (!props_ok(h, cp + i)) return B2PF_ERROR_BADIMAGE;
+
+/* The ligature table and matrices */
+
+if (!table_ok(h, h->ligatures,
+      ((uint64_t)(h->ligcount) + 1) * sizeof(ligature)))
+  return B2PF_ERROR_BADIMAGE;
+for (i = 1; i <= h->ligcount; i++)
+  {
+  ligature *lig = (ligature *)(image + h->ligatures) + i;
+  if (lig->group >= LIG_GROUPS || !props_ok(h, &(lig->props)))
+    return B2PF_ERROR_BADIMAGE;
+  }
+
+for (n = 0; n < 2; n++)
+  {
+  uint32_t nfirst = (n == 0)? h->lignfirst : h->aftnfirst;
+  offset = (n == 0)? h->ligmatrix : h->aftmatrix;
+  size = (uint64_t)nfirst * ((n == 0)? h->lignsecond : h->aftnsecond);
+
+  if (nfirst == 0) { if (offset != 0) return B2PF_ERROR_BADIMAGE; }
+  else
+    {
+    if (!table_ok(h, offset, size * sizeof(uint32_t)))
+      return B2PF_ERROR_BADIMAGE;
+    matrix = (uint32_t *)(image + offset);
+    for (i = 0; i < size; i++)
+      if (matrix[i] > h->ligcount) return B2PF_ERROR_BADIMAGE;
+    }
+  }
+
+/* The rules. Each must end with R_REND inside the image. No rule can output
+more code points, or look back over more letters, than it has items. */
+
+if (h->nrules > 0)
+  {
+  if (h->rules == 0 || h->nrules > length /
+      IMAGE_ROUND(offsetof(coded_rule, code) + sizeof(uint32_t)))
+    return B2PF_ERROR_BADIMAGE;
+  dfa->rules = context->malloc(h->nrules * sizeof(coded_rule *),
+    context->memory_data);
+  if (dfa->rules == NULL) return B2PF_ERROR_MEMORY;
+  }
+
+offset = h->rules;
+for (i = 0; i < h->nrules; i++)
+  {
+  const uint32_t *code, *start, *end;
+
+  if (!table_ok(h, offset, offsetof(coded_rule, code) + sizeof(uint32_t)))
+    goto BADRULES;
+  code = (uint32_t *)(image + offset + offsetof(coded_rule, code));
+  end = (uint32_t *)(image + (length & ~(size_t)(sizeof(uint32_t) - 1)));
+  start = code;
+  while (code < end && *code != R_REND) code++;
+  if (code >= end) goto BADRULES;
+  if ((size_t)(code - start) > maxitems) maxitems = (size_t)(code - start);
+  dfa->rules[i] = (coded_rule *)(image + offset);
+  offset = IMAGE_ROUND((size_t)((uschar *)(code + 1) - image));
+  }
+
+if (h->expansion == 0 || h->expansion > maxitems + 1 ||
+    h->lookback > maxitems + 1)
+  goto BADRULES;
+
+/* All is well; point the context at the tables. */
+
+context->pageindex = pageindex;
+context->charpages = cp;
+context->ligatures = (ligature *)(image + h->ligatures);
+context->ligmatrix.matrix = (h->ligmatrix == 0)? NULL :
+  (uint32_t *)(image + h->ligmatrix);
+context->ligmatrix.nfirst = h->lignfirst;
+context->ligmatrix.nsecond = h->lignsecond;
+context->aftmatrix.matrix = (h->aftmatrix == 0)? NULL :
+  (uint32_t *)(image + h->aftmatrix);
+context->aftmatrix.nfirst = h->aftnfirst;
+context->aftmatrix.nsecond = h->aftnsecond;
+dfa->table = table;
+dfa->index = index;
+dfa->indexrules = (index == NULL)? NULL : index + 2 * h->ncolumns + 1;
+dfa->jointable = jointable;
+dfa->nrules = h->nrules;
+dfa->nstates = h->nstates;
+dfa->ncolumns = h->ncolumns;
+dfa->bowcolumn = h->bowcolumn;
+dfa->eowcolumn = h->eowcolumn;
+dfa->lookback = h->lookback;
+context->charpagecount = h->charpagecount;
+context->ligcount = h->ligcount;
+context->maxsubst = h->maxsubst;
+context->expansion = h->expansion;
+context->wordstart = h->wordstart;
+context->check_error = h->check_error;
+context->ligs[0] = h->ligs[0];
+context->ligs[1] = h->ligs[1];
+context->prelig_error = h->prelig_error != 0;
+context->image = image;
+context->imagesize = length;
+context->checked = TRUE;
+return B2PF_SUCCESS;
+
+BADRULES:
+if (dfa->rules != NULL) context->free(dfa->rules, context->memory_data);
+dfa->rules = NULL;
+return B2PF_ERROR_BADIMAGE;
+}
+
+
+
+/*************************************************
+*          Load a context from an image          *
+*************************************************/
+
+/* Where memory mapping is available, the file is mapped read-only and shared,
+so that processes that load the same image share its pages, and nothing is
+copied. Otherwise it is read into memory from the given allocator. The new
+context has been checked, but not compiled; a callback can be set before
+compiling it. Its rules cannot be changed.
+
+Arguments:
+  filename        the name of the image file
+  contptr         where to put the context pointer if successful
+  private_malloc  pointer to private malloc() or NULL
+  private_free    pointer to private free() or NULL
+  memory_data     data for private malloc() and free()
+
+Returns:          B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_load(const char *filename, b2pf_context **contptr,
+  void *(*private_malloc)(size_t, void *),
+  void (*private_free)(void *, void *), void *memory_data)
+{
+int rc;
+unsigned int ln;
+size_t length;
+uschar *image;
+b2pf_context *context;
+#ifdef HAVE_SYS_MMAN_H
+int fd;
+struct stat statbuf;
+#else
+FILE *f;
+long int flength;
+#endif
+
+if (filename == NULL || contptr == NULL) return B2PF_ERROR_NULL;
+
+rc = b2pf_context_create("", NULL, 0, &context, private_malloc, private_free,
+  memory_data, &ln);
+if (rc != B2PF_SUCCESS) return rc;
+
+#ifdef HAVE_SYS_MMAN_H
+fd = open(filename, O_RDONLY);
+if (fd < 0 || fstat(fd, &statbuf) != 0)
+  {
+  rc = B2PF_ERROR_IMAGEFILE;
+  goto EXIT;
+  }
+if ((size_t)statbuf.st_size < sizeof(image_header))
+  {
+  rc = B2PF_ERROR_BADIMAGE;
+  goto EXIT;
+  }
+length = (size_t)statbuf.st_size;
+image = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+if (image == MAP_FAILED)
+  {
+  rc = B2PF_ERROR_IMAGEFILE;
+  goto EXIT;
+  }
+rc = attach_image(context, image, length);
+if (rc != B2PF_SUCCESS) (void)munmap(image, length);
+
+EXIT:
+if (fd >= 0) (void)close(fd);
+
+#else
+f = fopen(filename, "rb");
+if (f == NULL ||
+    fseek(f, 0, SEEK_END) != 0 ||
+    (flength = ftell(f)) < 0 ||
+    fseek(f, 0, SEEK_SET) != 0)
+  {
+  rc = B2PF_ERROR_IMAGEFILE;
+  goto EXIT;
+  }
+if ((size_t)flength < sizeof(image_header))
+  {
+  rc = B2PF_ERROR_BADIMAGE;
+  goto EXIT;
+  }
+length = (size_t)flength;
+image = context->malloc(length, context->memory_data);
+if (image == NULL)
+  {
+  rc = B2PF_ERROR_MEMORY;
+  goto EXIT;
+  }
+if (fread(image, 1, length, f) != length) rc = B2PF_ERROR_IMAGEFILE;
+  else rc = attach_image(context, image, length);
+if (rc != B2PF_SUCCESS) context->free(image, context->memory_data);
+
+EXIT:
+if (f != NULL) fclose(f);
+#endif
+
+if (rc != B2PF_SUCCESS) b2pf_context_free(context); else
+  {
+  context->imageowned = TRUE;
+  *contptr = context;
+  }
+return rc;
+}
+
+
+
+/*************************************************
+*      Load a context from an image in memory    *
+*************************************************/
+
+/* The image is used in place; nothing is copied. It might, for example, be an
+array in a source file that was generated by b2pf-compile. The caller must
+keep it unchanged until the context is freed. It must be aligned on an
+IMAGE_ALIGN boundary.
+
+Arguments:
+  image           the image
+  length          its length in bytes
+  contptr         where to put the context pointer if successful
+  private_malloc  pointer to private malloc() or NULL
+  private_free    pointer to private free() or NULL
+  memory_data     data for private malloc() and free()
+
+Returns:          B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_context_load_memory(const void *image, size_t length,
+  b2pf_context **contptr, void *(*private_malloc)(size_t, void *),
+  void (*private_free)(void *, void *), void *memory_data)
+{
+int rc;
+unsigned int ln;
+b2pf_context *context;
+
+if (image == NULL || contptr == NULL) return B2PF_ERROR_NULL;
+if ((uintptr_t)image % IMAGE_ALIGN != 0) return B2PF_ERROR_BADIMAGE;
+
+rc = b2pf_context_create("", NULL, 0, &context, private_malloc, private_free,
+  memory_data, &ln);
+if (rc != B2PF_SUCCESS) return rc;
+
+rc = attach_image(context, (uschar *)image, length);
+if (rc != B2PF_SUCCESS) b2pf_context_free(context); else *contptr = context;
+return rc;
+}
+
+
+
+/*************************************************
+*             Release an image                   *
+*************************************************/
+
+/* This is called from PRIV(free_tables)() when a context that was loaded from
+an image is freed. The tables point into the image, so they are not freed
+separately; only the vector of rules has its own memory. An image that was
+passed to b2pf_context_load_memory() belongs to the caller.
+
+Argument:  the context
+Returns:   nothing
+*/
+
+void
+PRIV(release_image)(b2pf_context *context)
+{
+if (context->dfa.rules != NULL)
+  context->free(context->dfa.rules, context->memory_data);
+if (context->imageowned)
+  {
+#ifdef HAVE_SYS_MMAN_H
+  (void)munmap(context->image, context->imagesize);
+#else
+  context->free(context->image, context->memory_data);
+#endif
+  }
+context->image = NULL;
+context->imagesize = 0;
+context->imageowned = FALSE;
+}
+
+/* End of b2pf_image.c */
@@ -48,11 +48,21 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef SUPPORT_PTHREADS
+#include <pthread.h>
+#endif
+
 /* Some overall parameters. */
 
 #define WORDMAX          100  /* Longest word that can be processed */
 #define STACK_BUFFSIZE  1000  /* Size of stack buffers (uints) */
 
+/* Code unit widths, used to identify the UTF mode. */
+
+#define UTF8   1        /* Number of bytes per code unit */
+#define UTF16  2
+#define UTF32  4
+
 /* Macros to make boolean values more obvious. The #ifndef is to pacify
 compiler warnings in environments where these macros are defined elsewhere.
 Unfortunately, there is no way to do the same for the typedef. */
@@ -153,9 +163,10 @@ Unicode doesn't go beyond 0x0010ffff. */
 
 #define MAX_UTF_CODE_POINT 0x10ffff
 
-/* Types for the nodes in the trees */
+/* Types for the nodes in the trees. CT_NONE is used only in the character
+table, for code points that are not in the character tree. */
 
-enum { CT_COMB, CT_MISC, CT_PRES, CT_LIG, CT_AFT };
+enum { CT_COMB, CT_MISC, CT_PRES, CT_LIG, CT_AFT, CT_NONE };
 
 /* Format types */
 
@@ -187,6 +198,36 @@ enum { CHECK_ERROR0, CHECK_ERROR1, CHECK_ERROR2, CHECK_ERROR3, CHECK_ERROR4 };
 #define R_NOTJOINPREV     0x8000000Eu  /* Character that can't join to previous */
 
 
+/* ---------------- Character table ---------------- */
+
+/* When a context is checked, its character tree is compiled into a two-level
+table. The code point space is divided into pages of 256 characters; a page
+index contains, for each page, the number of a page of properties. Pages that
+have identical contents are shared; in particular, page zero contains no
+characters and is used for all pages that are not mentioned in the context. */
+
+#define CHARPAGE_SHIFT   8
+#define CHARPAGE_SIZE    (1u << CHARPAGE_SHIFT)
+#define CHARPAGE_MASK    (CHARPAGE_SIZE - 1)
+#define CHARPAGE_COUNT   ((MAX_UTF_CODE_POINT + 1) >> CHARPAGE_SHIFT)
+
+/* Test whether a code point can start a word, that is, whether it is defined
+in the context and is not a combiner. */
+
+#define STARTS_WORD(context, c) \
+  ((c) >= (context)->wordstart && \
+    GET_PROPS(context, c)->type != CT_NONE && \
+    GET_PROPS(context, c)->type != CT_COMB)
+
+/* Get a pointer to the properties of a code point, which must not be greater
+than MAX_UTF_CODE_POINT. */
+
+#define GET_PROPS(context, c) \
+  ((context)->charpages + \
+    ((size_t)((context)->pageindex[(c) >> CHARPAGE_SHIFT]) << CHARPAGE_SHIFT) + \
+    ((c) & CHARPAGE_MASK))
+
+
 /* ---------------- UTF macros ---------------- */
 
 /* Tests whether a UTF code point is complete or needs more. */
@@ -255,6 +296,64 @@ typedef struct tree_node
   }
 tree_node;
 
+/* Structure for each entry in the character table. Every code point that
+appears in a ligature definition is given a dense, non-zero number as a first
+and/or second ligature character; these are the row and column numbers in the
+relevant ligature matrix. Zero means "not a ligature character". The rule
+class is the column that is used for the character in the rule automaton. */
+
+typedef struct char_props
+  {
+  uint32_t pforms[4];        /* presentation forms */
+  uint16_t ligfirst;         /* row in the input ligature matrix */
+  uint16_t ligsecond;        /* column in the input ligature matrix */
+  uint16_t aftfirst;         /* row in the "after" ligature matrix */
+  uint16_t aftsecond;        /* column in the "after" ligature matrix */
+  uint16_t rclass;           /* rule class */
+  uschar type;               /* type of character, CT_NONE if not known */
+  }
+char_props;
+
+/* Structure for each ligature in the ligature table. The properties are those
+of the replacement character, except that its type is CT_MISC if it is not in
+the character tree. The group is set by a "group" option in the L or A line; a
+ligature is used only if its group's bit is set in the caller's mask. */
+
+typedef struct ligature
+  {
+  uint32_t code;             /* the replacement character */
+  uint32_t group;            /* ligature group, 0 to LIG_GROUPS-1 */
+  char_props props;          /* its properties */
+  }
+ligature;
+
+#define LIG_GROUPS           32
+#define LIG_ALL_GROUPS       0xffffffffu
+
+/* Values in the vector of cached callback answers, which is indexed by
+ligature number. */
+
+#define LIG_UNKNOWN          0
+#define LIG_USABLE           1
+#define LIG_UNUSABLE         2
+
+/* Structure for a ligature matrix. Each element is a ligature number (an
+index into the ligature table) or zero if there is no ligature. */
+
+typedef struct lig_matrix
+  {
+  uint32_t *matrix;          /* nfirst * nsecond elements */
+  uint32_t nfirst;           /* number of first characters */
+  uint32_t nsecond;          /* number of second characters */
+  }
+lig_matrix;
+
+/* Look up a pair of ligature character numbers in a matrix. Neither number may
+be zero. */
+
+#define LIG_LOOKUP(m, first, second) \
+  ((m).matrix[((size_t)(first) - 1) * (m).nsecond + (second) - 1])
+
 /* Structure for each rule. The final element is specified with a large value,
 but the memory obtained is just exactly what is needed for the rule. This
 avoids certain warnings about overflow which can happen if, for example, the
@@ -270,6 +369,50 @@ typedef struct coded_rule
   }
 coded_rule;
 
+/* Structure for the rule automaton. When a context is checked, the rules are
+compiled into a deterministic automaton that finds the first rule that matches
+at a given position in a word. The input is the rule classes of the letters
+(non-combiners) in the word, starting "lookback" letters before the current
+position, with sentinel columns for positions before the start or after the
+end of the word. Each transition is either the next state, DFA_NOMATCH, or an
+encoded rule number.
+
+If the automaton could not be built within its limits, the table is NULL, and
+there may instead be a dispatch index. This is indexed by the rule class of the
+current letter, plus ncolumns if it is not the first letter in the word; the
+elements at that point and the next delimit the numbers of the candidate rules
+in indexrules. If neither is available, the rules are interpreted one by one,
+in the order of the rules vector.
+
+When every rule just chooses a presentation form for one letter according to
+the letters on either side of it, as the standard cursive joining rules do,
+there is also a joining table. It is indexed by the columns of the previous,
+current, and next letters, and gives the form to use, or JOIN_COPY if no rule
+matches. Such words are then converted in a single pass without running any
+rules. */
+
+typedef struct rule_dfa
+  {
+  int32_t *table;            /* nstates * ncolumns transitions */
+  coded_rule **rules;        /* vector of rules, in their original order */
+  uint32_t *index;           /* dispatch index: 2 * ncolumns + 1 elements */
+  uint32_t *indexrules;      /* rule numbers for the dispatch index */
+  uschar *jointable;         /* ncolumns cubed forms, or NULL */
+  uint32_t nrules;           /* number of rules */
+  uint32_t nstates;          /* number of states */
+  uint32_t ncolumns;         /* number of rule classes */
+  uint32_t bowcolumn;        /* column before the start of a word */
+  uint32_t eowcolumn;        /* column after the end of a word */
+  uint32_t lookback;         /* letters before the current one */
+  }
+rule_dfa;
+
+#define DFA_NOMATCH          (-1)
+#define DFA_MATCH(n)         (-2 - (int32_t)(n))
+#define DFA_RULE(v)          ((uint32_t)(-2 - (v)))
+
+#define JOIN_COPY            0xff
+
 
 /* ----------------------- HIDDEN STRUCTURES ----------------------------- */
 
@@ -277,19 +420,183 @@ typedef struct b2pf_real_context {
   void *(*malloc)(size_t, void *);
   void  (*free)(void *, void *);
   int   (*callback)(uint32_t, void *);
+  void  (*listcallback)(const uint32_t *, uint8_t *, uint32_t, void *);
   void *memory_data;
   void *callback_data;
+  void *listcallback_data;
+  uint8_t *ligverdicts;      /* cached callback answers, or NULL */
   tree_node *chartreebase;
   tree_node *ligtreebase;
   tree_node *aftertreebase;
   coded_rule *rules;
+  uint16_t *pageindex;
+  char_props *charpages;
+  ligature *ligatures;
+  lig_matrix ligmatrix;
+  lig_matrix aftmatrix;
+  rule_dfa dfa;
+  void *image;               /* image the tables are in, or NULL */
+  size_t imagesize;          /* length of the image */
+  BOOL imageowned;           /* image was mapped or read by the library */
+  uint32_t charpagecount;
+  uint32_t ligcount;
+  uint32_t maxsubst;         /* largest substituted code point */
+  uint32_t expansion;        /* most code points output per input */
+  uint32_t wordstart;        /* smallest code point that can start a word */
   uint32_t options;
   uint32_t ligs[2];
   uint32_t check_error;
   BOOL checked;
+  BOOL frozen;               /* compiled by b2pf_context_compile() */
   BOOL prelig_error;
+#ifdef SUPPORT_PTHREADS
+  pthread_mutex_t verdict_lock;  /* protects ligverdicts */
+#endif
 } b2pf_real_context;
 
+/* A match data block holds working memory for b2pf_format_string_md(), so
+that a number of threads, each with its own match data, can use the same
+compiled context. */
+
+typedef struct b2pf_real_match_data {
+  void *(*malloc)(size_t, void *);
+  void  (*free)(void *, void *);
+  void *memory_data;
+  uint32_t *inbuffer;        /* 32-bit input buffer */
+  uint32_t *outbuffer;       /* 32-bit output buffer */
+  size_t buffsize;           /* elements in each buffer */
+  size_t highwater;          /* largest input size formatted */
+  void *(*grow)(void *, size_t, void *);  /* output grow callback */
+  void *grow_data;           /* data for the callback */
+  b2pf_word_cache *cache;    /* word cache, or NULL */
+  b2pf_coverage *coverage;   /* font coverage set, or NULL */
+  uint32_t groups;           /* enabled ligature groups */
+} b2pf_real_match_data;
+
+/* A coverage set records which of a compiled context's ligatures produce a
+character that a font supports, as one bit for each ligature number. */
+
+typedef struct b2pf_real_coverage {
+  void *(*malloc)(size_t, void *);
+  void  (*free)(void *, void *);
+  void *memory_data;
+  const b2pf_context *context; /* the context whose ligatures are covered */
+  uint8_t *bits;             /* bit n is set if ligature n is covered */
+} b2pf_real_coverage;
+
+#define COVERED(cov, n)  (((cov)->bits[(n)/8] & (1u << ((n)%8))) != 0)
+
+/* A word cache maps the input code points of a word to its formatted output.
+Each entry's data holds the input followed by the output. There are statistics
+for each shard, so that they can be updated under the shard's lock. */
+
+#define CACHE_SHARDS  16
+
+typedef struct cache_entry {
+  uint32_t *data;            /* input and output, or NULL if unused */
+  uint32_t hash;             /* hash of the input */
+  uint16_t keylen;           /* input length */
+  uint16_t outlen;           /* output length */
+  BOOL referenced;           /* used since the clock hand passed */
+} cache_entry;
+
+typedef struct b2pf_real_word_cache {
+  void *(*malloc)(size_t, void *);
+  void  (*free)(void *, void *);
+  void *memory_data;
+  const b2pf_context *context; /* the context whose output is cached */
+  cache_entry *entries;      /* nsets * CACHE_WAYS entries */
+  uint8_t *hands;            /* clock hand for each set */
+  uint32_t nsets;            /* number of sets (a power of two) */
+  size_t hits[CACHE_SHARDS];
+  size_t misses[CACHE_SHARDS];
+#ifdef SUPPORT_PTHREADS
+  pthread_mutex_t locks[CACHE_SHARDS];
+#endif
+} b2pf_real_word_cache;
+
+/* A stream holds the state of a text that is being formatted in pieces: the
+code units of a character that is split between pieces, the code points that
+have not yet been formatted because they may be part of an incomplete word, and
+encoded output that has not yet been taken by the caller. */
+
+typedef struct b2pf_real_stream {
+  void *(*malloc)(size_t, void *);
+  void  (*free)(void *, void *);
+  void *memory_data;
+  b2pf_context *context;
+  int mode;                  /* UTF8, UTF16, or UTF32 */
+  uint32_t partial[2];       /* code units of an incomplete character */
+  size_t partialcount;       /* number of code units in partial */
+  uint32_t *inbuffer;        /* code points not yet formatted */
+  size_t insize;             /* elements in inbuffer */
+  size_t incount;            /* elements in use */
+  uint32_t *outbuffer;       /* 32-bit output buffer */
+  size_t outsize;            /* elements in outbuffer */
+  uint8_t *pending;          /* encoded output not yet pulled */
+  size_t pendsize;           /* code units in pending */
+  size_t pendstart;          /* first code unit not yet pulled */
+  size_t pendend;            /* end of pending output */
+  size_t unitoffset;         /* code units pushed in this text */
+  size_t charoffset;         /* code points formatted in this text */
+} b2pf_real_stream;
+
+/* A pool formats jobs on a fixed set of worker threads. Each worker has a
+circular queue of jobs, which it takes from the front; a worker whose own queue
+is empty steals from the back of another's. Each worker has its own match data,
+so its working memory is reused from job to job. Each worker also counts the
+jobs that were given to its queue and have not yet finished, wherever they are
+run, so that finishing a job needs only the lock of the queue it came from. The
+pool lock is used only to wait for space in a queue or for all jobs to finish.
+When no threads are running, jobs are formatted by b2pf_pool_submit() using the
+first worker's match data. */
+
+typedef struct pool_job {
+  void *input;               /* input string */
+  size_t input_size;         /* its length in code units */
+  void *output;              /* output buffer */
+  size_t output_size;        /* its size in code units */
+  uint32_t options;          /* formatting options */
+  void (*callback)(void *, int, size_t, size_t);  /* completion callback */
+  void *callback_data;       /* data for the callback */
+  struct pool_worker *owner; /* the worker whose queue it was given to */
+} pool_job;
+
+typedef struct pool_worker {
+  struct b2pf_real_pool *pool;
+  b2pf_match_data *match_data;
+  pool_job *jobs;            /* circular queue of queue_size jobs */
+  uint32_t first;            /* index of the first queued job */
+  uint32_t count;            /* number of queued jobs */
+  size_t pending;            /* jobs given to this queue and not finished */
+  BOOL space_wanted;         /* a submitter is waiting for room */
+  BOOL idle;                 /* the thread is waiting for work */
+  BOOL stop;                 /* set when the pool is being freed */
+#ifdef SUPPORT_PTHREADS
+  pthread_t thread;
+  pthread_mutex_t lock;      /* protects the fields above */
+  pthread_cond_t work;       /* signalled when a job is queued */
+#endif
+} pool_worker;
+
+typedef struct b2pf_real_pool {
+  void *(*malloc)(size_t, void *);
+  void  (*free)(void *, void *);
+  void *memory_data;
+  b2pf_context *context;
+  pool_worker *workers;
+  uint32_t nworkers;         /* number of workers (at least one) */
+  uint32_t nthreads;         /* number of threads running */
+  uint32_t queue_size;       /* size of each worker's queue */
+  uint32_t next;             /* next worker to be given a job */
+#ifdef SUPPORT_PTHREADS
+  pthread_mutex_t next_lock; /* protects next */
+  pthread_mutex_t lock;      /* for waiting on the conditions below */
+  pthread_cond_t space;      /* signalled when a full queue has room */
+  pthread_cond_t done;       /* signalled when a worker has no jobs pending */
+#endif
+} b2pf_real_pool;
+
 
 /* ------------------ PRIVATE TABLES AND FUNCTIONS -----------------------*/
 
@@ -299,12 +606,36 @@ extern const int      PRIV(utf8_table2)[];
 extern const int      PRIV(utf8_table3)[];
 extern const uint8_t  PRIV(utf8_table4)[];
 
-extern BOOL _b2pf_check_context(b2pf_context *);
-extern int  _b2pf_format_string(uint32_t *, size_t, uint32_t *, size_t,
-  size_t *, b2pf_context *, size_t *);
+extern BOOL _b2pf_build_tables(b2pf_context *);
+extern int  _b2pf_check_context(b2pf_context *);
+extern void _b2pf_free_tables(b2pf_context *);
+extern int  _b2pf_format_string(const uint32_t *, size_t, uint32_t *, size_t,
+  size_t *, b2pf_context *, b2pf_word_cache *, const b2pf_coverage *,
+  uint32_t, size_t *);
+extern BOOL _b2pf_match_data_grow(b2pf_match_data *, size_t);
+extern size_t _b2pf_decode(const void *, size_t, int, uint32_t *);
+extern size_t _b2pf_decode_back(const void *, size_t, int, b2pf_context *,
+  uint32_t *);
+extern int  _b2pf_encode(const uint32_t *, size_t, int, void *, size_t,
+  size_t *);
+extern void _b2pf_encode_back(const uint32_t *, size_t, int, b2pf_context *,
+  void *, size_t);
+extern size_t _b2pf_encoded_length(const uint32_t *, size_t, int);
+extern size_t _b2pf_output_bound(b2pf_context *, size_t, int);
+extern void _b2pf_release_image(b2pf_context *);
+extern size_t _b2pf_skip_nonword(b2pf_context *, const uint32_t *, size_t);
+extern size_t _b2pf_skip_nonword_units(b2pf_context *, const void *, size_t,
+  int, size_t *);
+extern size_t _b2pf_utf_incomplete(const void *, size_t, int);
+extern int  _b2pf_valid_utf(const void *, size_t, int, size_t *);
 extern int  _b2pf_valid_utf8(uint8_t *, size_t, size_t *);
 extern int  _b2pf_valid_utf16(uint16_t *, size_t, size_t *);
 extern int  _b2pf_valid_utf32(uint32_t *, size_t, size_t *);
+extern void _b2pf_word_cache_add(b2pf_word_cache *, const uint32_t *, size_t,
+  uint32_t, const uint32_t *, size_t);
+extern BOOL _b2pf_word_cache_find(b2pf_word_cache *, const uint32_t *, size_t,
+  uint32_t, uint32_t *, size_t, size_t *);
+extern uint32_t _b2pf_word_hash(const uint32_t *, size_t);
 
 extern BOOL       _b2pf_tree_insert(tree_node **, tree_node *);
 extern tree_node *_b2pf_tree_search(tree_node *, uint64_t);
@@ -0,0 +1,319 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains functions for creating and managing match data blocks,
+which hold the working memory for the formatting functions.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+
+
+/*************************************************
+*          Create a match data block             *
+*************************************************/
+
+/* The block takes its memory management functions from the context, but it
+does not otherwise refer to the context, and can be used with any context that
+uses the same functions. No working memory is obtained until it is needed.
+
+Arguments:
+  context     a context
+  mdptr       where to put the match data pointer if successful
+
+Returns:      B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_match_data_create(b2pf_context *context, b2pf_match_data **mdptr)
+{
+b2pf_match_data *md;
+
+if (context == NULL || mdptr == NULL) return B2PF_ERROR_NULL;
+
+md = context->malloc(sizeof(b2pf_real_match_data), context->memory_data);
+if (md == NULL) return B2PF_ERROR_MEMORY;
+
+md->malloc = context->malloc;
+md->free = context->free;
+md->memory_data = context->memory_data;
+md->inbuffer = NULL;
+md->outbuffer = NULL;
+md->buffsize = 0;
+md->highwater = 0;
+md->grow = NULL;
+md->grow_data = NULL;
+md->cache = NULL;
+md->coverage = NULL;
+md->groups = LIG_ALL_GROUPS;
+
+*mdptr = md;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*           Free a match data block              *
+*************************************************/
+
+/* Argument:  the match data block, or NULL
+   Returns:   nothing
+*/
+
+B2PF_EXP_DEFN void
+b2pf_match_data_free(b2pf_match_data *md)
+{
+if (md == NULL) return;
+if (md->inbuffer != NULL) md->free(md->inbuffer, md->memory_data);
+if (md->outbuffer != NULL) md->free(md->outbuffer, md->memory_data);
+md->free(md, md->memory_data);
+}
+
+
+
+/*************************************************
+*       Set the size of the working buffers      *
+*************************************************/
+
+/* The existing buffers are discarded, because their contents are not needed
+between calls. On failure, the match data is left with no buffers.
+
+Arguments:
+  md        the match data block
+  size      the number of elements required in each buffer
+
+Returns:    TRUE on success, FALSE if memory could not be obtained
+*/
+
+static BOOL
+set_buffer_size(b2pf_match_data *md, size_t size)
+{
+if (md->inbuffer != NULL) md->free(md->inbuffer, md->memory_data);
+if (md->outbuffer != NULL) md->free(md->outbuffer, md->memory_data);
+
+md->inbuffer = md->malloc(size * sizeof(uint32_t), md->memory_data);
+md->outbuffer = md->malloc(size * sizeof(uint32_t), md->memory_data);
+
+if (md->inbuffer == NULL || md->outbuffer == NULL)
+  {
+  if (md->inbuffer != NULL) md->free(md->inbuffer, md->memory_data);
+  if (md->outbuffer != NULL) md->free(md->outbuffer, md->memory_data);
+  md->inbuffer = md->outbuffer = NULL;
+  md->buffsize = 0;
+  return FALSE;
+  }
+
+md->buffsize = size;
+return TRUE;
+}
+
+
+
+/*************************************************
+*      Enlarge the buffers in a match data       *
+*************************************************/
+
+/* This is called when formatting a string that is too big for the current
+buffers. The size is at least doubled each time, so that a sequence of
+gradually increasing string sizes does not cause a new allocation each time.
+
+Arguments:
+  md        the match data block
+  size      the number of elements required in each buffer
+
+Returns:    TRUE on success, FALSE if memory could not be obtained
+*/
+
+BOOL
+PRIV(match_data_grow)(b2pf_match_data *md, size_t size)
+{
+size_t newsize = md->buffsize * 2;
+if (newsize < size) newsize = size;
+return set_buffer_size(md, newsize);
+}
+
+
+
+/*************************************************
+*       Reserve memory in a match data block     *
+*************************************************/
+
+/* This makes it possible to obtain all the working memory that will be needed
+before formatting starts, for example, by using the high-water mark from a
+previous run.
+
+Arguments:
+  md        the match data block
+  size      the largest input size, in code units, that is expected
+
+Returns:    B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_match_data_reserve(b2pf_match_data *md, size_t size)
+{
+if (md == NULL) return B2PF_ERROR_NULL;
+if (size <= md->buffsize || size <= STACK_BUFFSIZE) return B2PF_SUCCESS;
+return set_buffer_size(md, size)? B2PF_SUCCESS : B2PF_ERROR_MEMORY;
+}
+
+
+
+/*************************************************
+*        Get a match data's high-water mark      *
+*************************************************/
+
+/* Argument:  the match data block
+   Returns:   the largest input size, in code units, that has been formatted
+                using this block, or zero if md is NULL
+*/
+
+B2PF_EXP_DEFN size_t
+b2pf_match_data_get_highwater(b2pf_match_data *md)
+{
+return (md == NULL)? 0 : md->highwater;
+}
+
+/*************************************************
+*        Set an output grow callback             *
+*************************************************/
+
+/* When b2pf_format_string_md() finds that its output buffer is too small, it
+calls the callback with the current buffer, the size needed in code units, and
+the data pointer. The callback must return a buffer of at least that size
+(whose contents need not be preserved), or NULL if it cannot.
+
+Arguments:
+  md          the match data block
+  grow        the callback function, or NULL to cancel
+  grow_data   a value to pass to the callback
+
+Returns:      B2PF_SUCCESS or B2PF_ERROR_NULL
+*/
+
+B2PF_EXP_DEFN int
+b2pf_match_data_set_grow(b2pf_match_data *md,
+  void *(*grow)(void *, size_t, void *), void *grow_data)
+{
+if (md == NULL) return B2PF_ERROR_NULL;
+md->grow = grow;
+md->grow_data = grow_data;
+return B2PF_SUCCESS;
+}
+
+/*************************************************
+*           Set a word cache                     *
+*************************************************/
+
+/* The cache is used only when formatting with the context for which it was
+created, and only if no ligature callback is set, because a cache hit would
+bypass the callback. A cache may be shared by several match data blocks, but
+only if threads are supported; otherwise, all the blocks must be used in the
+same thread.
+
+Arguments:
+  md          the match data block
+  cache       the cache, or NULL to stop using one
+
+Returns:      B2PF_SUCCESS or B2PF_ERROR_NULL
+*/
+
+B2PF_EXP_DEFN int
+b2pf_match_data_set_word_cache(b2pf_match_data *md, b2pf_word_cache *cache)
+{
+if (md == NULL) return B2PF_ERROR_NULL;
+md->cache = cache;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*           Set a coverage set                   *
+*************************************************/
+
+/* While a coverage set is in use, a ligature is used only if the coverage set
+says that its result is covered, and the word cache is not used, because its
+entries might have been made with a different coverage. Formatting fails with
+B2PF_ERROR_COVERAGE if the context is not the one for which the coverage set
+was created.
+
+Arguments:
+  md          the match data block
+  coverage    the coverage set, or NULL to stop using one
+
+Returns:      B2PF_SUCCESS or B2PF_ERROR_NULL
+*/
+
+B2PF_EXP_DEFN int
+b2pf_match_data_set_coverage(b2pf_match_data *md, b2pf_coverage *coverage)
+{
+if (md == NULL) return B2PF_ERROR_NULL;
+md->coverage = coverage;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*        Set the enabled ligature groups         *
+*************************************************/
+
+/* Each ligature is in one of 32 groups, set by the "group" option in its L or
+A line (group 0 by default). A ligature is used only if the bit for its group
+is set. All groups are enabled when a match data block is created. The word
+cache is not used unless all groups are enabled, because its entries might have
+been made with a different set.
+
+Arguments:
+  md          the match data block
+  groups      a bit for each enabled group
+
+Returns:      B2PF_SUCCESS or B2PF_ERROR_NULL
+*/
+
+B2PF_EXP_DEFN int
+b2pf_match_data_set_ligature_groups(b2pf_match_data *md, uint32_t groups)
+{
+if (md == NULL) return B2PF_ERROR_NULL;
+md->groups = groups;
+return B2PF_SUCCESS;
+}
+
+/* End of b2pf_match_data.c */
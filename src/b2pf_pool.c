@@ -0,0 +1,598 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains functions for creating and using pools of threads that
+format strings as independent jobs.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+/* The size of each worker's queue if none is given */
+
+#define POOL_QUEUE_SIZE  64
+
+
+
+/*************************************************
+*        Lock and unlock a worker's queue        *
+*************************************************/
+
+#ifdef SUPPORT_PTHREADS
+#define LOCK(worker)   pthread_mutex_lock(&((worker)->lock))
+#define UNLOCK(worker) pthread_mutex_unlock(&((worker)->lock))
+#else
+#define LOCK(worker)
+#define UNLOCK(worker)
+#endif
+
+
+
+/*************************************************
+*               Run one job                      *
+*************************************************/
+
+/* The job is formatted using the worker's match data, and the callback is
+given the results.
+
+Arguments:
+  w          the worker
+  job        the job
+
+Returns:     nothing
+*/
+
+static void
+run_job(pool_worker *w, pool_job *job)
+{
+size_t used = 0;
+size_t offset = 0;
+int rc = b2pf_format_string_md(w->pool->context, w->match_data, job->input,
+  job->input_size, job->output, job->output_size, &used, job->options,
+  &offset);
+job->callback(job->callback_data, rc, used, offset);
+}
+
+
+
+#ifdef SUPPORT_PTHREADS
+/*************************************************
+*         Take a job for a worker                *
+*************************************************/
+
+/* A worker takes the oldest job from its own queue. If that is empty, it
+steals the newest job from the first other worker that has one, so that jobs
+that have been waiting longest stay with the worker they were given to. If a
+submitter is waiting because the queue was full, it is woken; this is the only
+time the pool lock is taken.
+
+Arguments:
+  w          the worker
+  job        where to put the job
+
+Returns:     TRUE if a job was found
+*/
+
+static BOOL
+take_job(pool_worker *w, pool_job *job)
+{
+b2pf_pool *pool = w->pool;
+pool_worker *v = w;
+uint32_t i;
+BOOL wanted;
+
+for (i = 0; i < pool->nworkers; i++)
+  {
+  v = pool->workers + ((uint32_t)(w - pool->workers) + i) % pool->nworkers;
+  LOCK(v);
+  if (v->count > 0) break;
+  UNLOCK(v);
+  }
+if (i >= pool->nworkers) return FALSE;
+
+if (v == w)
+  {
+  *job = w->jobs[w->first];
+  w->first = (w->first + 1) % pool->queue_size;
+  }
+else *job = v->jobs[(v->first + v->count - 1) % pool->queue_size];
+v->count--;
+wanted = v->space_wanted;
+v->space_wanted = FALSE;
+UNLOCK(v);
+
+if (wanted)
+  {
+  pthread_mutex_lock(&(pool->lock));
+  pthread_cond_broadcast(&(pool->space));
+  pthread_mutex_unlock(&(pool->lock));
+  }
+return TRUE;
+}
+
+
+
+/*************************************************
+*          Count a job as finished               *
+*************************************************/
+
+/* The job is counted against the worker whose queue it was given to, which
+may not be the one that ran it. The pool lock is taken only when that worker
+has no more jobs pending, in case b2pf_pool_wait() is waiting.
+
+Argument:  the job
+Returns:   nothing
+*/
+
+static void
+finish_job(pool_job *job)
+{
+pool_worker *owner = job->owner;
+BOOL none;
+
+LOCK(owner);
+none = --owner->pending == 0;
+UNLOCK(owner);
+
+if (none)
+  {
+  b2pf_pool *pool = owner->pool;
+  pthread_mutex_lock(&(pool->lock));
+  pthread_cond_broadcast(&(pool->done));
+  pthread_mutex_unlock(&(pool->lock));
+  }
+}
+
+
+
+/*************************************************
+*            A worker thread                     *
+*************************************************/
+
+/* While there are jobs to be found, only the queue locks are taken. When
+there are none, the thread waits on its own queue's lock until a job is given
+to it. A job cannot be queued unnoticed, because the queue is checked again
+with the lock held before waiting. When the pool is being freed, the thread
+finishes all the jobs in its queue before it exits.
+
+Argument:  the worker
+Returns:   NULL
+*/
+
+static void *
+worker_thread(void *arg)
+{
+pool_worker *w = (pool_worker *)arg;
+pool_job job;
+
+for (;;)
+  {
+  if (take_job(w, &job))
+    {
+    run_job(w, &job);
+    finish_job(&job);
+    continue;
+    }
+
+  LOCK(w);
+  while (w->count == 0 && !w->stop)
+    {
+    w->idle = TRUE;
+    pthread_cond_wait(&(w->work), &(w->lock));
+    w->idle = FALSE;
+    }
+  if (w->count == 0)
+    {
+    UNLOCK(w);
+    return NULL;
+    }
+  UNLOCK(w);
+  }
+}
+
+
+
+/*************************************************
+*          Stop the worker threads               *
+*************************************************/
+
+/*
+Argument:  the pool
+Returns:   nothing
+*/
+
+static void
+stop_threads(b2pf_pool *pool)
+{
+uint32_t i;
+
+for (i = 0; i < pool->nworkers; i++)
+  {
+  pool_worker *w = pool->workers + i;
+  LOCK(w);
+  w->stop = TRUE;
+  pthread_cond_signal(&(w->work));
+  UNLOCK(w);
+  }
+
+for (i = 0; i < pool->nthreads; i++)
+  (void)pthread_join(pool->workers[i].thread, NULL);
+pool->nthreads = 0;
+}
+
+
+
+/*************************************************
+*           Give a job to a worker               *
+*************************************************/
+
+/* If the worker's queue has room, the job is added to it and counted as
+pending, and the worker is woken if it is waiting. Otherwise, if the caller is
+about to wait for room, the worker is told, so that it wakes the caller when
+it takes a job from the queue.
+
+Arguments:
+  w          the worker
+  job        the job
+  waiting    TRUE if the caller will wait if there is no room
+
+Returns:     TRUE if the job was queued
+*/
+
+static BOOL
+give_job(pool_worker *w, pool_job *job, BOOL waiting)
+{
+b2pf_pool *pool = w->pool;
+BOOL yield = FALSE;
+
+LOCK(w);
+if (w->count < pool->queue_size)
+  {
+  job->owner = w;
+  w->jobs[(w->first + w->count++) % pool->queue_size] = *job;
+  w->pending++;
+  if (w->idle) pthread_cond_signal(&(w->work));
+  yield = TRUE;
+  }
+else if (waiting) w->space_wanted = TRUE;
+UNLOCK(w);
+return yield;
+}
+#endif  /* SUPPORT_PTHREADS */
+
+
+
+/*************************************************
+*          Free a pool's workers                 *
+*************************************************/
+
+/* This is used when creation fails as well as when a pool is freed. No
+threads are running.
+
+Arguments:
+  pool       the pool
+  n          the number of workers that have been set up
+
+Returns:     nothing
+*/
+
+static void
+free_workers(b2pf_pool *pool, uint32_t n)
+{
+uint32_t i;
+
+for (i = 0; i < n; i++)
+  {
+  pool_worker *w = pool->workers + i;
+  b2pf_match_data_free(w->match_data);
+  pool->free(w->jobs, pool->memory_data);
+#ifdef SUPPORT_PTHREADS
+  pthread_mutex_destroy(&(w->lock));
+  pthread_cond_destroy(&(w->work));
+#endif
+  }
+
+pool->free(pool->workers, pool->memory_data);
+pool->free(pool, pool->memory_data);
+}
+
+
+
+/*************************************************
+*               Create a pool                    *
+*************************************************/
+
+/* The context must have been compiled by b2pf_context_compile(), so that all
+the threads can use it at once. Each worker's match data is given enough
+working memory for strings of up to the reserve size, so that jobs of up to
+that size are formatted without obtaining any memory. A longer job still gets
+memory inside the worker that runs it, which keeps it for later jobs. If a
+thread cannot be started, any threads that have been started are stopped, and
+jobs are formatted by the submitting thread instead. This is also what happens
+if the number of threads is zero, or B2PF is built without thread support.
+
+Arguments:
+  context     the context
+  threads     the number of worker threads
+  queue_size  the number of jobs each worker can have queued, or 0 for a
+                default
+  reserve     the input size, in code units, for which to reserve working
+                memory in each worker, or 0
+  poolptr     where to put the pool pointer if successful
+
+Returns:      B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_pool_create(b2pf_context *context, uint32_t threads, uint32_t queue_size,
+  size_t reserve, b2pf_pool **poolptr)
+{
+b2pf_pool *pool;
+uint32_t i;
+int rc;
+
+if (context == NULL || poolptr == NULL) return B2PF_ERROR_NULL;
+if (!context->frozen) return B2PF_ERROR_NOTCOMPILED;
+if (queue_size == 0) queue_size = POOL_QUEUE_SIZE;
+
+#ifndef SUPPORT_PTHREADS
+threads = 0;
+#endif
+
+pool = context->malloc(sizeof(b2pf_real_pool), context->memory_data);
+if (pool == NULL) return B2PF_ERROR_MEMORY;
+
+pool->malloc = context->malloc;
+pool->free = context->free;
+pool->memory_data = context->memory_data;
+pool->context = context;
+pool->nworkers = (threads == 0)? 1 : threads;
+pool->nthreads = 0;
+pool->queue_size = queue_size;
+pool->next = 0;
+
+pool->workers = context->malloc(pool->nworkers * sizeof(pool_worker),
+  context->memory_data);
+if (pool->workers == NULL)
+  {
+  context->free(pool, context->memory_data);
+  return B2PF_ERROR_MEMORY;
+  }
+
+for (i = 0; i < pool->nworkers; i++)
+  {
+  pool_worker *w = pool->workers + i;
+  w->pool = pool;
+  w->first = w->count = 0;
+  w->pending = 0;
+  w->space_wanted = w->idle = w->stop = FALSE;
+  w->jobs = context->malloc((size_t)queue_size * sizeof(pool_job),
+    context->memory_data);
+  rc = b2pf_match_data_create(context, &(w->match_data));
+  if (rc == B2PF_SUCCESS && reserve > 0)
+    rc = b2pf_match_data_reserve(w->match_data, reserve);
+  if (w->jobs == NULL || rc != B2PF_SUCCESS)
+    {
+    if (rc == B2PF_SUCCESS) b2pf_match_data_free(w->match_data);
+    if (w->jobs != NULL) context->free(w->jobs, context->memory_data);
+    free_workers(pool, i);
+    return B2PF_ERROR_MEMORY;
+    }
+#ifdef SUPPORT_PTHREADS
+  pthread_mutex_init(&(w->lock), NULL);
+  pthread_cond_init(&(w->work), NULL);
+#endif
+  }
+
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_init(&(pool->next_lock), NULL);
+pthread_mutex_init(&(pool->lock), NULL);
+pthread_cond_init(&(pool->space), NULL);
+pthread_cond_init(&(pool->done), NULL);
+
+for (i = 0; i < threads; i++)
+  {
+  if (pthread_create(&(pool->workers[i].thread), NULL, worker_thread,
+      pool->workers + i) != 0)
+    {
+    uint32_t j;
+    stop_threads(pool);
+    for (j = 0; j < pool->nworkers; j++) pool->workers[j].stop = FALSE;
+    break;
+    }
+  pool->nthreads++;
+  }
+#endif
+
+*poolptr = pool;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*                Free a pool                     *
+*************************************************/
+
+/* Any jobs that are queued are finished before the threads stop.
+
+Argument:  the pool, or NULL
+Returns:   nothing
+*/
+
+B2PF_EXP_DEFN void
+b2pf_pool_free(b2pf_pool *pool)
+{
+if (pool == NULL) return;
+
+#ifdef SUPPORT_PTHREADS
+if (pool->nthreads > 0) stop_threads(pool);
+pthread_mutex_destroy(&(pool->next_lock));
+pthread_mutex_destroy(&(pool->lock));
+pthread_cond_destroy(&(pool->space));
+pthread_cond_destroy(&(pool->done));
+#endif
+
+free_workers(pool, pool->nworkers);
+}
+
+
+
+/*************************************************
+*              Submit a job                      *
+*************************************************/
+
+/* The job is given to the next worker in turn that has room in its queue,
+taking only that worker's lock. If every queue is full, this function waits
+until a worker takes a job from one of them. When no threads are running, the
+job is formatted before this function returns. In either case, the callback is
+called with the callback data, the result that b2pf_format_string() would
+return, the number of code units of output, and the error offset. The input
+and output must remain valid until then. A callback must not call any of the
+pool functions.
+
+Arguments:
+  pool           the pool
+  input_string   the input string
+  input_size     its length in code units
+  output_string  the output buffer
+  output_size    its size in code units
+  options        option bits, as for b2pf_format_string()
+  callback       the completion callback
+  callback_data  data for the callback
+
+Returns:         B2PF_SUCCESS or B2PF_ERROR_NULL
+*/
+
+B2PF_EXP_DEFN int
+b2pf_pool_submit(b2pf_pool *pool, void *input_string, size_t input_size,
+  void *output_string, size_t output_size, uint32_t options,
+  void (*callback)(void *, int, size_t, size_t), void *callback_data)
+{
+pool_job job;
+
+if (pool == NULL || input_string == NULL ||
+    (output_string == NULL && output_size != 0) || callback == NULL)
+  return B2PF_ERROR_NULL;
+
+job.input = input_string;
+job.input_size = input_size;
+job.output = output_string;
+job.output_size = output_size;
+job.options = options;
+job.callback = callback;
+job.callback_data = callback_data;
+
+#ifdef SUPPORT_PTHREADS
+if (pool->nthreads > 0)
+  {
+  uint32_t i, start;
+
+  pthread_mutex_lock(&(pool->next_lock));
+  start = pool->next;
+  pool->next = (start + 1) % pool->nworkers;
+  pthread_mutex_unlock(&(pool->next_lock));
+
+  for (i = 0; i < pool->nworkers; i++)
+    if (give_job(pool->workers + (start + i) % pool->nworkers, &job, FALSE))
+      return B2PF_SUCCESS;
+
+  /* Every queue was full. Look again with the pool lock held, telling each
+  worker whose queue is still full to wake this thread when it takes a job. */
+
+  pthread_mutex_lock(&(pool->lock));
+  for (;;)
+    {
+    for (i = 0; i < pool->nworkers; i++)
+      {
+      if (give_job(pool->workers + (start + i) % pool->nworkers, &job, TRUE))
+        {
+        pthread_mutex_unlock(&(pool->lock));
+        return B2PF_SUCCESS;
+        }
+      }
+    pthread_cond_wait(&(pool->space), &(pool->lock));
+    }
+  }
+#endif
+
+LOCK(pool->workers);
+run_job(pool->workers, &job);
+UNLOCK(pool->workers);
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*         Wait for all jobs to finish            *
+*************************************************/
+
+/* This must not be called from a completion callback.
+
+Argument:  the pool
+Returns:   B2PF_SUCCESS or B2PF_ERROR_NULL
+*/
+
+B2PF_EXP_DEFN int
+b2pf_pool_wait(b2pf_pool *pool)
+{
+if (pool == NULL) return B2PF_ERROR_NULL;
+
+#ifdef SUPPORT_PTHREADS
+pthread_mutex_lock(&(pool->lock));
+for (;;)
+  {
+  uint32_t i;
+  size_t pending = 0;
+  for (i = 0; i < pool->nworkers; i++)
+    {
+    pool_worker *w = pool->workers + i;
+    LOCK(w);
+    pending += w->pending;
+    UNLOCK(w);
+    }
+  if (pending == 0) break;
+  pthread_cond_wait(&(pool->done), &(pool->lock));
+  }
+pthread_mutex_unlock(&(pool->lock));
+#endif
+
+return B2PF_SUCCESS;
+}
+
+/* End of b2pf_pool.c */
@@ -0,0 +1,532 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains the functions for formatting a text that is supplied in
+pieces, using a stream.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+
+#define KNOWN_STREAM_OPTIONS (B2PF_UTF_16|B2PF_UTF_32)
+
+
+
+/*************************************************
+*            Reset a stream's input state        *
+*************************************************/
+
+/* This is called at the end of a text, and after an error. Any incomplete
+character or carried input is discarded, but output that has not yet been
+pulled is kept.
+
+Argument:  the stream
+Returns:   nothing
+*/
+
+static void
+reset_stream(b2pf_stream *stream)
+{
+stream->partialcount = 0;
+stream->incount = 0;
+stream->unitoffset = 0;
+stream->charoffset = 0;
+}
+
+
+
+/*************************************************
+*        Enlarge one of a stream's buffers       *
+*************************************************/
+
+/* The size is at least doubled, and the first part of the existing contents
+is copied to the new buffer. If memory cannot be obtained, the old buffer is
+left unchanged.
+
+Arguments:
+  stream      the stream
+  buffer      the existing buffer, or NULL
+  sizeptr     points to the buffer's size in units; updated on success
+  needed      the number of units needed
+  unitsize    the size of a unit in bytes
+  keep        the number of units to copy
+
+Returns:      the new buffer, or NULL if memory could not be obtained
+*/
+
+static void *
+grow_buffer(b2pf_stream *stream, void *buffer, size_t *sizeptr, size_t needed,
+  size_t unitsize, size_t keep)
+{
+void *newbuffer;
+size_t newsize = *sizeptr * 2;
+
+if (newsize < needed) newsize = needed;
+newbuffer = stream->malloc(newsize * unitsize, stream->memory_data);
+if (newbuffer == NULL) return NULL;
+
+if (keep > 0) memcpy(newbuffer, buffer, keep * unitsize);
+if (buffer != NULL) stream->free(buffer, stream->memory_data);
+*sizeptr = newsize;
+return newbuffer;
+}
+
+
+
+/*************************************************
+*     Format the first part of the input         *
+*************************************************/
+
+/* The first count code points in the stream's input buffer are formatted,
+and the output is encoded onto the end of the pending output. The rest of the
+input is moved down to the start of the buffer.
+
+Arguments:
+  stream        the stream
+  count         the number of code points to process
+  error_offset  where to return an offset after an error
+
+Returns:        B2PF_SUCCESS or an error code
+*/
+
+static int
+process_input(b2pf_stream *stream, size_t count, size_t *error_offset)
+{
+int rc;
+size_t outused, used, offset;
+size_t pendused = stream->pendend - stream->pendstart;
+
+/* Formatting produces more code points than it is given only if the context
+has rules whose replacements are longer than what they replace. */
+
+if (stream->outsize < count * stream->context->expansion)
+  {
+  uint32_t *newbuffer = grow_buffer(stream, stream->outbuffer,
+    &(stream->outsize), count * stream->context->expansion, sizeof(uint32_t),
+    0);
+  if (newbuffer == NULL) return B2PF_ERROR_MEMORY;
+  stream->outbuffer = newbuffer;
+  }
+
+rc = PRIV(format_string)(stream->inbuffer, count, stream->outbuffer,
+  stream->outsize, &outused, stream->context, NULL, NULL, LIG_ALL_GROUPS,
+  &offset);
+if (rc != B2PF_SUCCESS)
+  {
+  *error_offset = stream->charoffset + offset;
+  return rc;
+  }
+
+/* Move the pending output to the start of its buffer, and make sure there is
+room for the new output: at most 4 bytes per code point in any mode. */
+
+if (stream->pendstart > 0)
+  {
+  memmove(stream->pending, stream->pending + stream->pendstart * stream->mode,
+    pendused * stream->mode);
+  stream->pendstart = 0;
+  stream->pendend = pendused;
+  }
+
+if (stream->pendsize - pendused < outused * (4/stream->mode))
+  {
+  uint8_t *newbuffer = grow_buffer(stream, stream->pending,
+    &(stream->pendsize), pendused + outused * (4/stream->mode), stream->mode,
+    pendused);
+  if (newbuffer == NULL) return B2PF_ERROR_MEMORY;
+  stream->pending = newbuffer;
+  }
+
+rc = PRIV(encode)(stream->outbuffer, outused, stream->mode,
+  stream->pending + pendused * stream->mode, stream->pendsize - pendused,
+  &used);
+if (rc != B2PF_SUCCESS) return rc;
+stream->pendend += used;
+
+/* Keep the unprocessed input. */
+
+stream->incount -= count;
+memmove(stream->inbuffer, stream->inbuffer + count,
+  stream->incount * sizeof(uint32_t));
+stream->charoffset += count;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*        Check the context for a stream          *
+*************************************************/
+
+/* As for b2pf_format_string(), a context that has changed is compiled and
+checked, and a check error does not stop processing.
+
+Argument:  the context
+Returns:   B2PF_SUCCESS, B2PF_ERROR_CONTEXTCHECK, or B2PF_ERROR_MEMORY
+*/
+
+static int
+check_stream_context(b2pf_context *context)
+{
+if (!context->checked) return PRIV(check_context)(context);
+return (context->check_error != CHECK_ERROR0)?
+  B2PF_ERROR_CONTEXTCHECK : B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*               Create a stream                  *
+*************************************************/
+
+/* The stream takes its memory management functions from the context. Only the
+UTF options are permitted, because backwards input or output needs the whole
+text at once.
+
+Arguments:
+  context     the context
+  options     option bits
+  streamptr   where to put the stream pointer if successful
+
+Returns:      B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_stream_create(b2pf_context *context, uint32_t options,
+  b2pf_stream **streamptr)
+{
+b2pf_stream *stream;
+
+if (context == NULL || streamptr == NULL) return B2PF_ERROR_NULL;
+if ((options & ~KNOWN_STREAM_OPTIONS) != 0 ||
+    (options & (B2PF_UTF_16|B2PF_UTF_32)) == (B2PF_UTF_16|B2PF_UTF_32))
+  return B2PF_ERROR_BADOPTIONS;
+
+stream = context->malloc(sizeof(b2pf_stream), context->memory_data);
+if (stream == NULL) return B2PF_ERROR_MEMORY;
+
+stream->malloc = context->malloc;
+stream->free = context->free;
+stream->memory_data = context->memory_data;
+stream->context = context;
+stream->mode = ((options & B2PF_UTF_32) != 0)? UTF32 :
+               ((options & B2PF_UTF_16) != 0)? UTF16 : UTF8;
+stream->inbuffer = NULL;
+stream->insize = 0;
+stream->outbuffer = NULL;
+stream->outsize = 0;
+stream->pending = NULL;
+stream->pendsize = 0;
+stream->pendstart = 0;
+stream->pendend = 0;
+reset_stream(stream);
+
+*streamptr = stream;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*               Free a stream                    *
+*************************************************/
+
+/*
+Argument:  the stream, or NULL
+Returns:   nothing
+*/
+
+B2PF_EXP_DEFN void
+b2pf_stream_free(b2pf_stream *stream)
+{
+if (stream == NULL) return;
+if (stream->inbuffer != NULL) stream->free(stream->inbuffer,
+  stream->memory_data);
+if (stream->outbuffer != NULL) stream->free(stream->outbuffer,
+  stream->memory_data);
+if (stream->pending != NULL) stream->free(stream->pending,
+  stream->memory_data);
+stream->free(stream, stream->memory_data);
+}
+
+
+
+/*************************************************
+*          Add a piece of input to a stream      *
+*************************************************/
+
+/* The input may end in the middle of a character or a word. The code units of
+an incomplete character are kept until the next piece arrives. Because an
+unknown character always ends a word, everything up to and including the last
+unknown character can be formatted now; what follows it is kept, so that the
+stream's memory depends on the length of the longest word rather than the
+length of the text. An error offset is relative to the start of the text, in
+code units for a UTF error and in characters otherwise, as for
+b2pf_format_string().
+
+Arguments:
+  stream        the stream
+  input         a piece of input
+  input_size    its length in code units
+  error_offset  where to return an offset after an error
+
+Returns:        B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_stream_push(b2pf_stream *stream, void *input, size_t input_size,
+  size_t *error_offset)
+{
+int rc;
+int check_yield;
+int mode;
+size_t hold, cut, offset;
+size_t base;
+b2pf_context *context;
+const uint8_t *in = (const uint8_t *)input;
+
+if (stream == NULL || (input == NULL && input_size > 0) ||
+    error_offset == NULL) return B2PF_ERROR_NULL;
+
+*error_offset = 0;
+context = stream->context;
+mode = stream->mode;
+
+check_yield = check_stream_context(context);
+if (check_yield == B2PF_ERROR_MEMORY) return check_yield;
+
+/* There must be room for the carried input, a completed character, and one
+code point for each new code unit. */
+
+if (stream->insize < stream->incount + 1 + input_size)
+  {
+  uint32_t *newbuffer = grow_buffer(stream, stream->inbuffer,
+    &(stream->insize), stream->incount + 1 + input_size, sizeof(uint32_t),
+    stream->incount);
+  if (newbuffer == NULL) return B2PF_ERROR_MEMORY;
+  stream->inbuffer = newbuffer;
+  }
+
+base = stream->unitoffset;
+stream->unitoffset += input_size;
+
+/* If the previous piece ended with an incomplete character, complete it from
+the start of this piece, if possible. */
+
+if (stream->partialcount > 0)
+  {
+  size_t take;
+  uint8_t *partial = (uint8_t *)stream->partial;
+  size_t need = (mode == UTF8)? 1 + PRIV(utf8_table4)[partial[0] & 0x3fu] : 2;
+
+  take = need - stream->partialcount;
+  if (take > input_size) take = input_size;
+  memcpy(partial + stream->partialcount * mode, in, take * mode);
+  stream->partialcount += take;
+  in += take * mode;
+  input_size -= take;
+  if (stream->partialcount < need) return check_yield;
+
+  rc = PRIV(valid_utf)(stream->partial, stream->partialcount, mode, &offset);
+  if (rc != B2PF_SUCCESS)
+    {
+    *error_offset = base + take - stream->partialcount + offset;
+    reset_stream(stream);
+    return rc;
+    }
+
+  stream->incount += PRIV(decode)(stream->partial, stream->partialcount, mode,
+    stream->inbuffer + stream->incount);
+  stream->partialcount = 0;
+  base += take;
+  }
+
+/* Keep any incomplete character at the end, then validate and decode the
+rest. */
+
+hold = PRIV(utf_incomplete)(in, input_size, mode);
+input_size -= hold;
+
+rc = PRIV(valid_utf)(in, input_size, mode, &offset);
+if (rc != B2PF_SUCCESS)
+  {
+  *error_offset = base + offset;
+  reset_stream(stream);
+  return rc;
+  }
+
+stream->incount += PRIV(decode)(in, input_size, mode,
+  stream->inbuffer + stream->incount);
+memcpy(stream->partial, in + input_size * mode, hold * mode);
+stream->partialcount = hold;
+
+/* Process everything up to and including the last unknown character. */
+
+for (cut = stream->incount; cut > 0; cut--)
+  if (GET_PROPS(context, stream->inbuffer[cut-1])->type == CT_NONE) break;
+
+if (cut > 0)
+  {
+  rc = process_input(stream, cut, error_offset);
+  if (rc != B2PF_SUCCESS)
+    {
+    reset_stream(stream);
+    return rc;
+    }
+  }
+
+return check_yield;
+}
+
+
+
+/*************************************************
+*          End the text in a stream              *
+*************************************************/
+
+/* Any carried input is formatted. An incomplete character at the end of the
+text is an error. Afterwards, the stream can be used for another text.
+
+Arguments:
+  stream        the stream
+  error_offset  where to return an offset after an error
+
+Returns:        B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_stream_flush(b2pf_stream *stream, size_t *error_offset)
+{
+int rc;
+int check_yield;
+
+if (stream == NULL || error_offset == NULL) return B2PF_ERROR_NULL;
+
+*error_offset = 0;
+check_yield = check_stream_context(stream->context);
+if (check_yield == B2PF_ERROR_MEMORY) return check_yield;
+
+/* Validating an incomplete character yields the appropriate error. */
+
+if (stream->partialcount > 0)
+  {
+  size_t offset;
+  rc = PRIV(valid_utf)(stream->partial, stream->partialcount, stream->mode,
+    &offset);
+  *error_offset = stream->unitoffset - stream->partialcount + offset;
+  reset_stream(stream);
+  return rc;
+  }
+
+if (stream->incount > 0)
+  {
+  rc = process_input(stream, stream->incount, error_offset);
+  if (rc != B2PF_SUCCESS)
+    {
+    reset_stream(stream);
+    return rc;
+    }
+  }
+
+reset_stream(stream);
+return check_yield;
+}
+
+
+
+/*************************************************
+*          Take output from a stream             *
+*************************************************/
+
+/* As much of the pending output as fits in the buffer is copied, without
+splitting a character. An output_used value of zero means that there is no
+more output until more input is pushed or the text is flushed.
+
+Arguments:
+  stream        the stream
+  output        the output buffer
+  output_size   its size in code units
+  output_used   where to return the number of code units used
+
+Returns:        B2PF_SUCCESS, or B2PF_ERROR_OVERFLOW if there is pending output
+                  but the buffer is too small for the next character
+*/
+
+B2PF_EXP_DEFN int
+b2pf_stream_pull(b2pf_stream *stream, void *output, size_t output_size,
+  size_t *output_used)
+{
+size_t n;
+size_t available;
+const uint8_t *p;
+
+if (stream == NULL || output == NULL || output_used == NULL)
+  return B2PF_ERROR_NULL;
+
+*output_used = 0;
+available = stream->pendend - stream->pendstart;
+if (available == 0) return B2PF_SUCCESS;
+
+p = stream->pending + stream->pendstart * stream->mode;
+n = (output_size < available)? output_size : available;
+
+/* Back off to the start of a character if necessary. */
+
+if (n < available)
+  {
+  if (stream->mode == UTF8)
+    {
+    while (n > 0 && (p[n] & 0xc0u) == 0x80u) n--;
+    }
+  else if (stream->mode == UTF16)
+    {
+    if ((((const uint16_t *)p)[n] & 0xfc00u) == 0xdc00u) n--;
+    }
+  if (n == 0) return B2PF_ERROR_OVERFLOW;
+  }
+
+memcpy(output, p, n * stream->mode);
+*output_used = n;
+
+stream->pendstart += n;
+if (stream->pendstart == stream->pendend)
+  stream->pendstart = stream->pendend = 0;
+return B2PF_SUCCESS;
+}
+
+/* End of b2pf_stream.c */
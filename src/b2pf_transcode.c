@@ -0,0 +1,889 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains internal functions for validating, decoding, and encoding
+UTF-8, UTF-16, and UTF-32 strings, as used by the formatting functions.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+/* Runs of characters that are encoded as a single code unit are decoded and
+encoded in blocks of this many characters. The test for such a block, and the
+copying of it, have no branches, so that compilers can vectorize them. */
+
+#define CODE_BLOCK 16
+
+
+
+/*************************************************
+*       Validate a string in any UTF mode        *
+*************************************************/
+
+/*
+Arguments:
+  input         the input string
+  input_size    its length in code units
+  mode          UTF8, UTF16, or UTF32
+  error_offset  where to return the offset of an error
+
+Returns:        B2PF_SUCCESS or a UTF error code
+*/
+
+int
+PRIV(valid_utf)(const void *input, size_t input_size, int mode,
+  size_t *error_offset)
+{
+if (mode == UTF8)
+  return PRIV(valid_utf8)((uint8_t *)input, input_size, error_offset);
+if (mode == UTF16)
+  return PRIV(valid_utf16)((uint16_t *)input, input_size, error_offset);
+return PRIV(valid_utf32)((uint32_t *)input, input_size, error_offset);
+}
+
+
+
+/*************************************************
+*     Find an incomplete character at the end    *
+*************************************************/
+
+/* This is used when input arrives in pieces, to find a character whose code
+units are split between one piece and the next. Only the lead code unit and
+the number of code units are checked here; a sequence that is invalid in any
+other way is left for the validity check to diagnose.
+
+Arguments:
+  input         the input string
+  input_size    its length in code units
+  mode          UTF8, UTF16, or UTF32
+
+Returns:        the number of code units at the end of the string that are
+                  the start of an incomplete character, or zero
+*/
+
+size_t
+PRIV(utf_incomplete)(const void *input, size_t input_size, int mode)
+{
+if (mode == UTF8)
+  {
+  const uint8_t *p8 = (const uint8_t *)input;
+  size_t i;
+
+  /* Look back over up to three continuation bytes for a lead byte. */
+
+  for (i = 1; i <= 4 && i <= input_size; i++)
+    {
+    uint32_t c = p8[input_size - i];
+    if ((c & 0xc0u) == 0x80u) continue;
+    if (c < 0xc0u || c >= 0xf8u) return 0;
+    return (i <= (size_t)PRIV(utf8_table4)[c & 0x3fu])? i : 0;
+    }
+  }
+
+else if (mode == UTF16)
+  {
+  const uint16_t *p16 = (const uint16_t *)input;
+  if (input_size > 0 && (p16[input_size - 1] & 0xfc00u) == 0xd800u) return 1;
+  }
+
+return 0;
+}
+
+
+
+/*************************************************
+*      Decode a valid string into code points    *
+*************************************************/
+
+/* The output vector must be large enough to hold one element for each input
+code unit. Because the input is valid, UTF-8 characters are at most 4 bytes
+long, and a UTF-16 high surrogate is always followed by a low surrogate.
+
+Arguments:
+  input         the input string, already validated
+  input_size    its length in code units
+  mode          UTF8, UTF16, or UTF32
+  output        where to put the code points
+
+Returns:        the number of code points
+*/
+
+size_t
+PRIV(decode)(const void *input, size_t input_size, int mode, uint32_t *output)
+{
+size_t count = 0;
+
+if (mode == UTF8)
+  {
+  const uint8_t *p8 = (const uint8_t *)input;
+  const uint8_t *p8end = p8 + input_size;
+
+  while (p8 < p8end)
+    {
+    uint32_t c;
+
+    /* Copy blocks of ASCII characters */
+
+    while (p8end - p8 >= CODE_BLOCK)
+      {
+      int i;
+      uint32_t bits = 0;
+      for (i = 0; i < CODE_BLOCK; i++) bits |= p8[i];
+      if ((bits & 0x80u) != 0) break;
+      for (i = 0; i < CODE_BLOCK; i++) output[count + i] = p8[i];
+      count += CODE_BLOCK;
+      p8 += CODE_BLOCK;
+      }
+    if (p8 >= p8end) break;
+
+    c = *p8++;
+    if (c >= 0xc0u)
+      {
+      if (c < 0xe0u)
+        {
+        c = ((c & 0x1fu) << 6) | (p8[0] & 0x3fu);
+        p8 += 1;
+        }
+      else if (c < 0xf0u)
+        {
+        c = ((c & 0x0fu) << 12) | ((p8[0] & 0x3fu) << 6) | (p8[1] & 0x3fu);
+        p8 += 2;
+        }
+      else
+        {
+        c = ((c & 0x07u) << 18) | ((p8[0] & 0x3fu) << 12) |
+            ((p8[1] & 0x3fu) << 6) | (p8[2] & 0x3fu);
+        p8 += 3;
+        }
+      }
+    output[count++] = c;
+    }
+  }
+
+else if (mode == UTF16)
+  {
+  const uint16_t *p16 = (const uint16_t *)input;
+  const uint16_t *p16end = p16 + input_size;
+
+  while (p16 < p16end)
+    {
+    uint32_t c;
+
+    /* Copy blocks without surrogates */
+
+    while (p16end - p16 >= CODE_BLOCK)
+      {
+      int i;
+      uint32_t bad = 0;
+      for (i = 0; i < CODE_BLOCK; i++) bad |= (p16[i] & 0xf800u) == 0xd800u;
+      if (bad != 0) break;
+      for (i = 0; i < CODE_BLOCK; i++) output[count + i] = p16[i];
+      count += CODE_BLOCK;
+      p16 += CODE_BLOCK;
+      }
+    if (p16 >= p16end) break;
+
+    c = *p16++;
+    if ((c & 0xfc00u) == 0xd800u)
+      c = (((c & 0x3ffu) << 10) | (*p16++ & 0x3ffu)) + 0x10000u;
+    output[count++] = c;
+    }
+  }
+
+else  /* UTF-32 */
+  {
+  memcpy(output, input, sizeof(uint32_t)*input_size);
+  count = input_size;
+  }
+
+return count;
+}
+
+
+
+/*************************************************
+*     Encode code points in any UTF mode         *
+*************************************************/
+
+/*
+Arguments:
+  input         the code points
+  count         the number of code points
+  mode          UTF8, UTF16, or UTF32
+  output        the output buffer
+  output_size   its size in code units
+  output_used   where to return the number of code units used
+
+Returns:        B2PF_SUCCESS or B2PF_ERROR_OVERFLOW
+*/
+
+int
+PRIV(encode)(const uint32_t *input, size_t count, int mode, void *output,
+  size_t output_size, size_t *output_used)
+{
+size_t i;
+size_t used = 0;
+
+if (mode == UTF32)
+  {
+  if (count > output_size) return B2PF_ERROR_OVERFLOW;
+  if (count > 0 && (const void *)input != output)
+    memcpy(output, input, sizeof(uint32_t)*count);
+  used = count;
+  }
+
+else if (mode == UTF16)
+  {
+  uint16_t *p16 = (uint16_t *)output;
+  for (i = 0; i < count; i++)
+    {
+    uint32_t c;
+
+    /* Copy blocks of characters that need no surrogates */
+
+    while (count - i >= CODE_BLOCK && output_size - used >= CODE_BLOCK)
+      {
+      int j;
+      uint32_t bits = 0;
+      for (j = 0; j < CODE_BLOCK; j++) bits |= input[i + j];
+      if (bits > 0xffff) break;
+      for (j = 0; j < CODE_BLOCK; j++) p16[j] = (uint16_t)input[i + j];
+      p16 += CODE_BLOCK;
+      used += CODE_BLOCK;
+      i += CODE_BLOCK;
+      }
+    if (i >= count) break;
+
+    c = input[i];
+    if (c <= 0xffff)
+      {
+      if (used >= output_size) return B2PF_ERROR_OVERFLOW;
+      used++;
+      *p16++ = (uint16_t)c;
+      }
+    else
+      {
+      if (used + 1 >= output_size) return B2PF_ERROR_OVERFLOW;
+      used += 2;
+      c -= 0x10000;
+      *p16++ = 0xd800 | (c >> 10);
+      *p16++ = 0xdc00 | (c & 0x3ff);
+      }
+    }
+  }
+
+else  /* UTF-8 */
+  {
+  uint8_t *p8 = (uint8_t *)output;
+
+  for (i = 0; i < count; i++)
+    {
+    int j, k;
+    uint8_t *pt;
+    uint32_t c;
+
+    /* Copy blocks of ASCII characters */
+
+    while (count - i >= CODE_BLOCK && output_size - used >= CODE_BLOCK)
+      {
+      uint32_t bits = 0;
+      for (j = 0; j < CODE_BLOCK; j++) bits |= input[i + j];
+      if (bits >= 0x80) break;
+      for (j = 0; j < CODE_BLOCK; j++) p8[j] = (uint8_t)input[i + j];
+      p8 += CODE_BLOCK;
+      used += CODE_BLOCK;
+      i += CODE_BLOCK;
+      }
+    if (i >= count) break;
+
+    /* Handle the lengths that can occur in Unicode directly, and the others
+    via the table. */
+
+    c = input[i];
+    if (c < 0x80) j = 0;
+      else if (c < 0x800) j = 1;
+      else if (c < 0x10000) j = 2;
+      else if (c < 0x200000) j = 3;
+      else for (j = 4; j < PRIV(utf8_table1_size); j++)
+        if ((int)c <= PRIV(utf8_table1)[j]) break;
+
+    if (used + j >= output_size) return B2PF_ERROR_OVERFLOW;
+    used += j + 1;
+    pt = p8 += j;
+    for (k = j; k > 0; k--)
+     {
+     *pt-- = 0x80 | (c & 0x3f);
+     c >>= 6;
+     }
+    *pt = PRIV(utf8_table2)[j] | c;
+    p8++;
+    }
+  }
+
+*output_used = used;
+return B2PF_SUCCESS;
+}
+
+/*************************************************
+*     Find the length of an encoded string       *
+*************************************************/
+
+/*
+Arguments:
+  input         the code points
+  count         the number of code points
+  mode          UTF8, UTF16, or UTF32
+
+Returns:        the number of code units needed to encode them
+*/
+
+size_t
+PRIV(encoded_length)(const uint32_t *input, size_t count, int mode)
+{
+size_t i;
+size_t length = count;
+
+if (mode == UTF32) return length;
+
+for (i = 0; i < count; i++)
+  {
+  uint32_t c = input[i];
+  if (mode == UTF16)
+    {
+    if (c > 0xffff) length++;
+    }
+  else
+    {
+    if (c >= 0x80) length++;
+    if (c >= 0x800) length++;
+    if (c >= 0x10000) length++;
+    }
+  }
+
+return length;
+}
+
+
+
+/*************************************************
+*   Decode one character before a given point    *
+*************************************************/
+
+/*
+Arguments:
+  input         the input string, already validated
+  end           the offset of the code unit after the character
+  mode          UTF8, UTF16, or UTF32
+  cptr          where to return the code point
+
+Returns:        the offset of the first code unit of the character
+*/
+
+static size_t
+back_char(const void *input, size_t end, int mode, uint32_t *cptr)
+{
+size_t start = end - 1;
+
+if (mode == UTF8)
+  {
+  const uint8_t *p8 = (const uint8_t *)input;
+  uint32_t c;
+
+  while ((p8[start] & 0xc0u) == 0x80u) start--;
+  c = p8[start];
+  switch (end - start)
+    {
+    case 2:
+    c = ((c & 0x1fu) << 6) | (p8[start+1] & 0x3fu);
+    break;
+
+    case 3:
+    c = ((c & 0x0fu) << 12) | ((p8[start+1] & 0x3fu) << 6) |
+        (p8[start+2] & 0x3fu);
+    break;
+
+    case 4:
+    c = ((c & 0x07u) << 18) | ((p8[start+1] & 0x3fu) << 12) |
+        ((p8[start+2] & 0x3fu) << 6) | (p8[start+3] & 0x3fu);
+    break;
+    }
+  *cptr = c;
+  }
+
+else if (mode == UTF16)
+  {
+  const uint16_t *p16 = (const uint16_t *)input;
+  uint32_t c = p16[start];
+
+  if ((c & 0xfc00u) == 0xdc00u)
+    {
+    start--;
+    c = (((p16[start] & 0x3ffu) << 10) | (c & 0x3ffu)) + 0x10000u;
+    }
+  *cptr = c;
+  }
+
+else *cptr = ((const uint32_t *)input)[start];
+
+return start;
+}
+
+
+
+/*************************************************
+*   Decode a valid string in reverse order       *
+*************************************************/
+
+/* This is used for input that is backwards. The string is read from its end,
+so the code points come out in reading order without a separate pass to invert
+them. If a context is given, combining characters are taken to follow their
+base character in the input, and each base character is output before its
+combiners, which keep their input order. Without a context, the string is
+reversed character by character, copying blocks of single-unit characters.
+The output vector must be large enough to hold one element for each input code
+unit.
+
+Arguments:
+  input         the input string, already validated
+  input_size    its length in code units
+  mode          UTF8, UTF16, or UTF32
+  context       the context for reversing by characters, or NULL
+  output        where to put the code points
+
+Returns:        the number of code points
+*/
+
+size_t
+PRIV(decode_back)(const void *input, size_t input_size, int mode,
+  b2pf_context *context, uint32_t *output)
+{
+size_t count = 0;
+size_t end = input_size;
+size_t unit_end = input_size;
+
+while (end > 0)
+  {
+  size_t start;
+  uint32_t c;
+
+  /* When reversing by code points, copy blocks of single-unit characters. */
+
+  if (context == NULL)
+    {
+    while (end >= CODE_BLOCK)
+      {
+      int i;
+      uint32_t bad = 0;
+
+      if (mode == UTF8)
+        {
+        const uint8_t *p8 = (const uint8_t *)input + end - CODE_BLOCK;
+        for (i = 0; i < CODE_BLOCK; i++) bad |= p8[i] & 0x80u;
+        if (bad != 0) break;
+        for (i = 0; i < CODE_BLOCK; i++)
+          output[count + i] = p8[CODE_BLOCK - 1 - i];
+        }
+      else if (mode == UTF16)
+        {
+        const uint16_t *p16 = (const uint16_t *)input + end - CODE_BLOCK;
+        for (i = 0; i < CODE_BLOCK; i++) bad |= (p16[i] & 0xf800u) == 0xd800u;
+        if (bad != 0) break;
+        for (i = 0; i < CODE_BLOCK; i++)
+          output[count + i] = p16[CODE_BLOCK - 1 - i];
+        }
+      else
+        {
+        const uint32_t *p32 = (const uint32_t *)input + end - CODE_BLOCK;
+        for (i = 0; i < CODE_BLOCK; i++)
+          output[count + i] = p32[CODE_BLOCK - 1 - i];
+        }
+
+      count += CODE_BLOCK;
+      end -= CODE_BLOCK;
+      }
+    if (end == 0) break;
+    unit_end = end;
+    }
+
+  /* A combiner is left until its base character is found, unless it is at the
+  start of the input, where there is no base. The base is then output, followed
+  by any combiners, decoded forwards. */
+
+  start = back_char(input, end, mode, &c);
+  if (context != NULL && start > 0 && GET_PROPS(context, c)->type == CT_COMB)
+    {
+    end = start;
+    continue;
+    }
+
+  output[count++] = c;
+  if (unit_end > end)
+    count += PRIV(decode)((const uint8_t *)input + end * mode, unit_end - end,
+      mode, output + count);
+  end = unit_end = start;
+  }
+
+return count;
+}
+
+
+
+/*************************************************
+*   Encode one character before a given point    *
+*************************************************/
+
+/*
+Arguments:
+  c             the code point
+  mode          UTF8, UTF16, or UTF32
+  output        the output buffer
+  end           the offset of the code unit after the character
+
+Returns:        the offset of the first code unit of the character
+*/
+
+static size_t
+put_back(uint32_t c, int mode, void *output, size_t end)
+{
+if (mode == UTF8)
+  {
+  uint8_t *p8 = (uint8_t *)output;
+  int j, k;
+
+  j = (c < 0x80)? 0 : (c < 0x800)? 1 : (c < 0x10000)? 2 : 3;
+  end -= j + 1;
+  for (k = j; k > 0; k--)
+    {
+    p8[end + k] = 0x80 | (c & 0x3f);
+    c >>= 6;
+    }
+  p8[end] = PRIV(utf8_table2)[j] | c;
+  }
+
+else if (mode == UTF16)
+  {
+  uint16_t *p16 = (uint16_t *)output;
+
+  if (c <= 0xffff) p16[--end] = (uint16_t)c; else
+    {
+    c -= 0x10000;
+    p16[--end] = 0xdc00 | (c & 0x3ff);
+    p16[--end] = 0xd800 | (c >> 10);
+    }
+  }
+
+else ((uint32_t *)output)[--end] = c;
+
+return end;
+}
+
+
+
+/*************************************************
+*     Encode code points in reverse order        *
+*************************************************/
+
+/* This is used for output that is to be backwards. The encoded string is built
+from the end of the output, so it is reversed as it is written. If a context
+is given, each base character is kept together with the combiners that follow
+it, in their original order; otherwise the string is reversed character by
+character, copying blocks of characters that need only one code unit. The
+caller must have checked that the output is big enough.
+
+Arguments:
+  input         the code points
+  count         the number of code points
+  mode          UTF8, UTF16, or UTF32
+  context       the context for reversing by characters, or NULL
+  output        the output buffer
+  length        the encoded length, from encoded_length()
+
+Returns:        nothing
+*/
+
+void
+PRIV(encode_back)(const uint32_t *input, size_t count, int mode,
+  b2pf_context *context, void *output, size_t length)
+{
+size_t i = 0;
+size_t end = length;
+
+while (i < count)
+  {
+  size_t j, k;
+
+  /* When reversing by code points, copy blocks of single-unit characters. */
+
+  if (context == NULL)
+    {
+    while (count - i >= CODE_BLOCK)
+      {
+      uint32_t bits = 0;
+
+      if (mode == UTF8)
+        {
+        uint8_t *p8 = (uint8_t *)output + end - CODE_BLOCK;
+        for (k = 0; k < CODE_BLOCK; k++) bits |= input[i + k];
+        if (bits >= 0x80) break;
+        for (k = 0; k < CODE_BLOCK; k++)
+          p8[CODE_BLOCK - 1 - k] = (uint8_t)input[i + k];
+        }
+      else if (mode == UTF16)
+        {
+        uint16_t *p16 = (uint16_t *)output + end - CODE_BLOCK;
+        for (k = 0; k < CODE_BLOCK; k++) bits |= input[i + k];
+        if (bits > 0xffff) break;
+        for (k = 0; k < CODE_BLOCK; k++)
+          p16[CODE_BLOCK - 1 - k] = (uint16_t)input[i + k];
+        }
+      else
+        {
+        uint32_t *p32 = (uint32_t *)output + end - CODE_BLOCK;
+        for (k = 0; k < CODE_BLOCK; k++)
+          p32[CODE_BLOCK - 1 - k] = input[i + k];
+        }
+
+      end -= CODE_BLOCK;
+      i += CODE_BLOCK;
+      }
+    if (i >= count) break;
+    }
+
+  /* Find the end of the unit, and write it backwards, last character first,
+  so that it ends up in its original order. */
+
+  j = i + 1;
+  if (context != NULL)
+    while (j < count && GET_PROPS(context, input[j])->type == CT_COMB) j++;
+
+  for (k = j; k > i; k--) end = put_back(input[k-1], mode, output, end);
+  i = j;
+  }
+}
+
+
+
+/*************************************************
+*   Skip code points that cannot start a word    *
+*************************************************/
+
+/* Blocks of code points that are all less than the smallest that can start a
+word are skipped with a branch-free test; others are looked up. Combiners are
+skipped because, outside a word, they are copied unchanged. The context must
+have been checked.
+
+Arguments:
+  context       the context
+  input         the code points
+  count         the number of code points
+
+Returns:        the number of code points before the first that can start a
+                  word, or count if there is none
+*/
+
+size_t
+PRIV(skip_nonword)(b2pf_context *context, const uint32_t *input, size_t count)
+{
+size_t i = 0;
+uint32_t limit = context->wordstart;
+
+while (i < count)
+  {
+  while (count - i >= CODE_BLOCK)
+    {
+    int j;
+    uint32_t bad = 0;
+    for (j = 0; j < CODE_BLOCK; j++) bad |= input[i + j] >= limit;
+    if (bad != 0) break;
+    i += CODE_BLOCK;
+    }
+  if (i >= count) break;
+  if (STARTS_WORD(context, input[i])) break;
+  i++;
+  }
+
+return i;
+}
+
+
+
+/*************************************************
+*   Skip characters that cannot start a word     *
+*************************************************/
+
+/* This is the same as PRIV(skip_nonword), but works on a valid UTF string
+before it is decoded. Blocks of code units that are less than the smallest code
+point that can start a word, and also cannot be part of a multi-unit
+character, are skipped with a branch-free test. The number of characters that
+are skipped is also returned, for computing error offsets.
+
+Arguments:
+  context       the context
+  input         the input string, already validated
+  input_size    its length in code units
+  mode          UTF8, UTF16, or UTF32
+  charsptr      where to return the number of characters skipped
+
+Returns:        the number of code units before the first character that can
+                  start a word, or input_size if there is none
+*/
+
+size_t
+PRIV(skip_nonword_units)(b2pf_context *context, const void *input,
+  size_t input_size, int mode, size_t *charsptr)
+{
+size_t i = 0;
+size_t chars = 0;
+
+if (mode == UTF8)
+  {
+  const uint8_t *p8 = (const uint8_t *)input;
+  uint32_t limit = (context->wordstart < 0x80)? context->wordstart : 0x80;
+
+  while (i < input_size)
+    {
+    size_t start;
+    uint32_t c;
+
+    while (input_size - i >= CODE_BLOCK)
+      {
+      int j;
+      uint32_t bad = 0;
+      for (j = 0; j < CODE_BLOCK; j++) bad |= p8[i + j] >= limit;
+      if (bad != 0) break;
+      i += CODE_BLOCK;
+      chars += CODE_BLOCK;
+      }
+    if (i >= input_size) break;
+
+    start = i;
+    c = p8[i++];
+    if (c >= 0xc0u)
+      {
+      const uint8_t *p = p8 + i;
+      GETUTF8REMINC(c, p);
+      i = p - p8;
+      }
+    if (STARTS_WORD(context, c))
+      {
+      i = start;
+      break;
+      }
+    chars++;
+    }
+  }
+
+else if (mode == UTF16)
+  {
+  const uint16_t *p16 = (const uint16_t *)input;
+  uint32_t limit = (context->wordstart < 0xd800)? context->wordstart : 0xd800;
+
+  while (i < input_size)
+    {
+    size_t start;
+    uint32_t c;
+
+    while (input_size - i >= CODE_BLOCK)
+      {
+      int j;
+      uint32_t bad = 0;
+      for (j = 0; j < CODE_BLOCK; j++) bad |= p16[i + j] >= limit;
+      if (bad != 0) break;
+      i += CODE_BLOCK;
+      chars += CODE_BLOCK;
+      }
+    if (i >= input_size) break;
+
+    start = i;
+    c = p16[i++];
+    if ((c & 0xfc00u) == 0xd800u)
+      c = (((c & 0x3ffu) << 10) | (p16[i++] & 0x3ffu)) + 0x10000u;
+    if (STARTS_WORD(context, c))
+      {
+      i = start;
+      break;
+      }
+    chars++;
+    }
+  }
+
+else  /* UTF-32 */
+  {
+  i = chars = PRIV(skip_nonword)(context, (const uint32_t *)input,
+    input_size);
+  }
+
+*charsptr = chars;
+return i;
+}
+
+
+
+/*************************************************
+*     Find an upper bound for output length      *
+*************************************************/
+
+/* Each input code point yields at most context->expansion output code points.
+When this is one, the output is either the input code point itself or a
+substitute, so its length is at most that of the input code point or of the
+longest substitute. Otherwise, every input code point can appear once, and each
+replacement item can be a substitute. The context must have been checked.
+
+Arguments:
+  context       the context
+  input_size    the input length in code units
+  mode          UTF8, UTF16, or UTF32
+
+Returns:        the maximum output length in code units, or SIZE_MAX if this
+                  cannot be represented
+*/
+
+size_t
+PRIV(output_bound)(b2pf_context *context, size_t input_size, int mode)
+{
+uint32_t c = context->maxsubst;
+size_t factor;
+size_t units = (mode == UTF32)? 1 :
+  (mode == UTF16)? ((c > 0xffff)? 2 : 1) :
+  (c < 0x80)? 1 : (c < 0x800)? 2 : (c < 0x10000)? 3 : 4;
+
+factor = (context->expansion == 1)? units : 1 + context->expansion * units;
+if (input_size > SIZE_MAX/factor) return SIZE_MAX;
+return input_size * factor;
+}
+
+/* End of b2pf_transcode.c */
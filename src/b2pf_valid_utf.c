@@ -72,6 +72,17 @@ const uint8_t PRIV(utf8_table4)[] = {
 
 
 
+/* Strings are first scanned in blocks of this many code units, looking for a
+block that contains anything other than simple characters (ASCII for UTF-8,
+non-surrogates for UTF-16, and non-surrogates not greater than 0x10ffff for
+UTF-32). The tests within a block have no branches, so that compilers can
+vectorize them. The character-by-character checks, which diagnose errors, are
+used only from the first block that fails, until the next simple character. */
+
+#define VALID_BLOCK 32
+
+
+
 /*************************************************
 *           Validate a UTF string                *
 *************************************************/
@@ -127,6 +138,19 @@ for (p = string; length > 0; p++)
   {
   uint32_t ab, d;
 
+  /* Skip blocks of ASCII characters */
+
+  while (length >= VALID_BLOCK)
+    {
+    int i;
+    uint32_t bits = 0;
+    for (i = 0; i < VALID_BLOCK; i++) bits |= p[i];
+    if ((bits & 0x80) != 0) break;
+    p += VALID_BLOCK;
+    length -= VALID_BLOCK;
+    }
+  if (length == 0) break;
+
   c = *p;
   length--;
 
@@ -326,6 +350,19 @@ uint32_t c;
 
 for (p = string; length > 0; p++)
   {
+  /* Skip blocks without surrogates */
+
+  while (length >= VALID_BLOCK)
+    {
+    int i;
+    uint32_t bad = 0;
+    for (i = 0; i < VALID_BLOCK; i++) bad |= (p[i] & 0xf800) == 0xd800;
+    if (bad != 0) break;
+    p += VALID_BLOCK;
+    length -= VALID_BLOCK;
+    }
+  if (length == 0) break;
+
   c = *p;
   length--;
 
@@ -376,6 +413,20 @@ uint32_t c;
 
 for (p = string; length > 0; length--, p++)
   {
+  /* Skip blocks of valid characters */
+
+  while (length >= VALID_BLOCK)
+    {
+    int i;
+    uint32_t bad = 0;
+    for (i = 0; i < VALID_BLOCK; i++)
+      bad |= ((p[i] & 0xfffff800u) == 0xd800u) | (p[i] > 0x10ffffu);
+    if (bad != 0) break;
+    p += VALID_BLOCK;
+    length -= VALID_BLOCK;
+    }
+  if (length == 0) break;
+
   c = *p;
   if ((c & 0xfffff800u) != 0xd800u)
     {
@@ -0,0 +1,364 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains functions for creating and using word caches, which
+remember the formatted output for words that have already been seen.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "b2pf_internal.h"
+
+/* The cache is set-associative: a word's hash selects a set of CACHE_WAYS
+entries, within which a "clock" hand chooses an entry to replace, passing over
+(but clearing) entries that have been used since the hand last passed them.
+When threads are supported, the sets are divided between CACHE_SHARDS locks. */
+
+#define CACHE_WAYS     4
+
+
+
+/*************************************************
+*              Hash a word                       *
+*************************************************/
+
+/* This is an FNV-1a hash over code points.
+
+Arguments:
+  word        the code points
+  length      the number of code points
+
+Returns:      the hash value
+*/
+
+uint32_t
+PRIV(word_hash)(const uint32_t *word, size_t length)
+{
+uint32_t hash = 2166136261u;
+while (length-- > 0)
+  {
+  hash ^= *word++;
+  hash *= 16777619u;
+  }
+return hash;
+}
+
+
+
+/*************************************************
+*          Lock and unlock a shard               *
+*************************************************/
+
+#ifdef SUPPORT_PTHREADS
+#define LOCK(cache, set) \
+  pthread_mutex_lock(&((cache)->locks[(set) % CACHE_SHARDS]))
+#define UNLOCK(cache, set) \
+  pthread_mutex_unlock(&((cache)->locks[(set) % CACHE_SHARDS]))
+#else
+#define LOCK(cache, set)
+#define UNLOCK(cache, set)
+#endif
+
+
+
+/*************************************************
+*             Create a word cache                *
+*************************************************/
+
+/* The context must have been compiled by b2pf_context_compile(), so that it
+cannot change and make the cached output wrong. The cache takes its memory
+management functions from the context.
+
+Arguments:
+  context     the context
+  size        the maximum number of words to hold
+  cacheptr    where to put the cache pointer if successful
+
+Returns:      B2PF_SUCCESS or an error code
+*/
+
+B2PF_EXP_DEFN int
+b2pf_word_cache_create(b2pf_context *context, uint32_t size,
+  b2pf_word_cache **cacheptr)
+{
+b2pf_word_cache *cache;
+uint32_t nsets = 1;
+size_t i;
+
+if (context == NULL || cacheptr == NULL) return B2PF_ERROR_NULL;
+if (!context->frozen) return B2PF_ERROR_NOTCOMPILED;
+
+/* The number of sets is a power of two. */
+
+while (nsets < size/CACHE_WAYS && nsets < 0x01000000u) nsets <<= 1;
+
+cache = context->malloc(sizeof(b2pf_word_cache), context->memory_data);
+if (cache == NULL) return B2PF_ERROR_MEMORY;
+
+cache->entries = context->malloc(
+  (size_t)nsets * CACHE_WAYS * sizeof(cache_entry), context->memory_data);
+cache->hands = context->malloc(nsets, context->memory_data);
+if (cache->entries == NULL || cache->hands == NULL)
+  {
+  if (cache->entries != NULL) context->free(cache->entries,
+    context->memory_data);
+  if (cache->hands != NULL) context->free(cache->hands, context->memory_data);
+  context->free(cache, context->memory_data);
+  return B2PF_ERROR_MEMORY;
+  }
+
+cache->malloc = context->malloc;
+cache->free = context->free;
+cache->memory_data = context->memory_data;
+cache->context = context;
+cache->nsets = nsets;
+memset(cache->entries, 0, (size_t)nsets * CACHE_WAYS * sizeof(cache_entry));
+memset(cache->hands, 0, nsets);
+
+for (i = 0; i < CACHE_SHARDS; i++)
+  {
+  cache->hits[i] = cache->misses[i] = 0;
+#ifdef SUPPORT_PTHREADS
+  pthread_mutex_init(&(cache->locks[i]), NULL);
+#endif
+  }
+
+*cacheptr = cache;
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*              Free a word cache                 *
+*************************************************/
+
+/*
+Argument:  the cache, or NULL
+Returns:   nothing
+*/
+
+B2PF_EXP_DEFN void
+b2pf_word_cache_free(b2pf_word_cache *cache)
+{
+size_t i;
+
+if (cache == NULL) return;
+for (i = 0; i < (size_t)cache->nsets * CACHE_WAYS; i++)
+  if (cache->entries[i].data != NULL)
+    cache->free(cache->entries[i].data, cache->memory_data);
+
+#ifdef SUPPORT_PTHREADS
+for (i = 0; i < CACHE_SHARDS; i++) pthread_mutex_destroy(&(cache->locks[i]));
+#endif
+
+cache->free(cache->entries, cache->memory_data);
+cache->free(cache->hands, cache->memory_data);
+cache->free(cache, cache->memory_data);
+}
+
+
+
+/*************************************************
+*         Get word cache statistics              *
+*************************************************/
+
+/*
+Arguments:
+  cache       the cache
+  hits        where to put the number of words found in the cache
+  misses      where to put the number of words not found
+
+Returns:      B2PF_SUCCESS or B2PF_ERROR_NULL
+*/
+
+B2PF_EXP_DEFN int
+b2pf_word_cache_get_stats(b2pf_word_cache *cache, size_t *hits,
+  size_t *misses)
+{
+size_t i;
+
+if (cache == NULL || hits == NULL || misses == NULL) return B2PF_ERROR_NULL;
+
+*hits = *misses = 0;
+for (i = 0; i < CACHE_SHARDS; i++)
+  {
+  LOCK(cache, i);
+  *hits += cache->hits[i];
+  *misses += cache->misses[i];
+  UNLOCK(cache, i);
+  }
+
+return B2PF_SUCCESS;
+}
+
+
+
+/*************************************************
+*           Look up a word in a cache            *
+*************************************************/
+
+/* If the word is found, and its output fits in the space that is available,
+the output is copied.
+
+Arguments:
+  cache       the cache
+  word        the word's input code points
+  length      the number of code points
+  hash        the word's hash
+  output      where to put the output
+  outspace    the space available
+  outlenptr   where to return the output length
+
+Returns:      TRUE if the output was copied; FALSE otherwise
+*/
+
+BOOL
+PRIV(word_cache_find)(b2pf_word_cache *cache, const uint32_t *word,
+  size_t length, uint32_t hash, uint32_t *output, size_t outspace,
+  size_t *outlenptr)
+{
+BOOL yield = FALSE;
+uint32_t set = hash & (cache->nsets - 1);
+cache_entry *e = cache->entries + (size_t)set * CACHE_WAYS;
+int i;
+
+LOCK(cache, set);
+
+for (i = 0; i < CACHE_WAYS; i++, e++)
+  {
+  if (e->data == NULL || e->hash != hash || e->keylen != length ||
+      memcmp(e->data, word, length * sizeof(uint32_t)) != 0)
+    continue;
+
+  if (e->outlen <= outspace)
+    {
+    memcpy(output, e->data + length, e->outlen * sizeof(uint32_t));
+    *outlenptr = e->outlen;
+    e->referenced = TRUE;
+    yield = TRUE;
+    }
+  break;
+  }
+
+if (yield) cache->hits[set % CACHE_SHARDS]++;
+  else cache->misses[set % CACHE_SHARDS]++;
+
+UNLOCK(cache, set);
+return yield;
+}
+
+
+
+/*************************************************
+*            Add a word to a cache               *
+*************************************************/
+
+/* If the memory for the entry cannot be obtained, the word is just not
+cached.
+
+Arguments:
+  cache       the cache
+  word        the word's input code points
+  length      the number of code points
+  hash        the word's hash
+  output      the word's output
+  outlen      the output length
+
+Returns:      nothing
+*/
+
+void
+PRIV(word_cache_add)(b2pf_word_cache *cache, const uint32_t *word,
+  size_t length, uint32_t hash, const uint32_t *output, size_t outlen)
+{
+uint32_t set = hash & (cache->nsets - 1);
+cache_entry *entries = cache->entries + (size_t)set * CACHE_WAYS;
+cache_entry *e = NULL;
+uint32_t *data;
+int i;
+
+if (length > UINT16_MAX || outlen > UINT16_MAX) return;
+data = cache->malloc((length + outlen) * sizeof(uint32_t),
+  cache->memory_data);
+if (data == NULL) return;
+memcpy(data, word, length * sizeof(uint32_t));
+memcpy(data + length, output, outlen * sizeof(uint32_t));
+
+LOCK(cache, set);
+
+/* Another thread may have added the word meanwhile. Otherwise, use an empty
+entry if there is one, or advance the clock hand to an entry that has not been
+used recently. */
+
+for (i = 0; i < CACHE_WAYS; i++)
+  {
+  cache_entry *ee = entries + i;
+  if (ee->data == NULL)
+    {
+    if (e == NULL) e = ee;
+    }
+  else if (ee->hash == hash && ee->keylen == length &&
+      memcmp(ee->data, word, length * sizeof(uint32_t)) == 0)
+    {
+    UNLOCK(cache, set);
+    cache->free(data, cache->memory_data);
+    return;
+    }
+  }
+
+if (e == NULL)
+  {
+  for (;;)
+    {
+    e = entries + cache->hands[set];
+    cache->hands[set] = (cache->hands[set] + 1) % CACHE_WAYS;
+    if (!e->referenced) break;
+    e->referenced = FALSE;
+    }
+  }
+
+if (e->data != NULL) cache->free(e->data, cache->memory_data);
+e->data = data;
+e->hash = hash;
+e->keylen = (uint16_t)length;
+e->outlen = (uint16_t)outlen;
+e->referenced = FALSE;
+
+UNLOCK(cache, set);
+}
+
+/* End of b2pf_word_cache.c */
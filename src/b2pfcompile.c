@@ -0,0 +1,319 @@
+/*************************************************
+*       Base Unicode to Presentation Forms       *
+*************************************************/
+
+/* This file contains the b2pf-compile program, which compiles one or more
+rules files into a C source file that contains a context image as a constant
+array. An application that is linked with the generated file can create a
+context by calling b2pf_context_load_memory(), without reading or compiling
+any rules at run time. No code is generated: the image is used by the same
+formatting code as any other context.
+
+                 Copyright (c) 2026 Philip Hazel
+
+-----------------------------------------------------------------------------
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    * The names of any contributors to this project may not be used to
+      endorse or promote products derived from this software without
+      specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+-----------------------------------------------------------------------------
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "b2pf.h"
+
+/* Macros for making the version string, as in b2pftest. */
+
+#define STRING(a)  # a
+#define XSTRING(s) STRING(s)
+
+/* Miscellaneous parameters */
+
+#define NAME_SIZE       64   /* Longest array name */
+#define WORDS_PER_LINE   3   /* 64-bit words per output line */
+
+
+
+/*************************************************
+*             Usage function                     *
+*************************************************/
+
+static void
+usage(void)
+{
+printf("Usage:     b2pf-compile [options] <rules name> ...\n\n");
+printf("The rules files are added to an empty context in the order given.\n");
+printf("\nOptions:\n");
+printf("  -F <list>     specify colon-separated rules directories\n");
+printf("  -help         show usage information\n");
+printf("  -n <name>     name of the generated array (default b2pf_<first rules>)\n");
+printf("  -o <file>     write the output to <file> instead of stdout\n");
+printf("  -version      show b2pf version and exit\n");
+}
+
+
+
+/*************************************************
+*          Write the generated source            *
+*************************************************/
+
+/* The image is written as an array of 64-bit words, so that it is suitably
+aligned. Its bytes are in the order of the machine that runs this program, so
+the generated file must be compiled for a machine with the same byte order;
+the library rejects the image otherwise.
+
+Arguments:
+  f           the output file
+  name        the name of the array
+  image       the image
+  length      its length (a multiple of 8)
+  argc        the number of rules names
+  argv        the rules names
+
+Returns:      nothing
+*/
+
+static void
+write_source(FILE *f, const char *name, const void *image, size_t length,
+  int argc, char **argv)
+{
+const unsigned char *p = image;
+size_t i;
+int n;
+
+fprintf(f, "/* This file was generated by b2pf-compile from these rules:\n\n ");
+for (n = 0; n < argc; n++) fprintf(f, " %s", argv[n]);
+fprintf(f, "\n\nIt contains a compiled B2PF context. Do not edit it. To use it, "
+  "declare\n\n"
+  "  extern const uint64_t %s[];\n"
+  "  extern const size_t %s_size;\n\n"
+  "and pass them to b2pf_context_load_memory(). */\n\n", name, name);
+
+fprintf(f, "#include <stddef.h>\n#include <stdint.h>\n\n");
+fprintf(f, "const size_t %s_size = %lu;\n\n", name, (unsigned long int)length);
+fprintf(f, "const uint64_t %s[] = {\n", name);
+
+for (i = 0; i < length; i += 8)
+  {
+  uint64_t word;
+  memcpy(&word, p + i, sizeof(word));
+  if ((i/8) % WORDS_PER_LINE == 0) fprintf(f, "  ");
+  fprintf(f, "0x%016llxull,", (unsigned long long int)word);
+  fprintf(f, ((i/8) % WORDS_PER_LINE == WORDS_PER_LINE - 1 || i + 8 >= length)?
+    "\n" : " ");
+  }
+
+fprintf(f, "};\n\n/* End of generated file */\n");
+}
+
+
+
+/*************************************************
+*                Main Program                    *
+*************************************************/
+
+int
+main(int argc, char **argv)
+{
+FILE *outfile = stdout;
+const char *rules_dir_list = NULL;
+const char *outname = NULL;
+char name[NAME_SIZE];
+void *image = NULL;
+size_t length;
+unsigned int ln;
+b2pf_context *context = NULL;
+int yield = 1;
+int op = 1;
+int rc;
+
+name[0] = 0;
+
+/* Scan command line options. */
+
+while (argc > 1 && argv[op][0] == '-' && argv[op][1] != 0)
+  {
+  char *arg = argv[op];
+
+  if (strcmp(arg, "-F") == 0 && argc > 2)
+    {
+    rules_dir_list = argv[++op];
+    argc--;
+    }
+
+  else if (strcmp(arg, "-n") == 0 && argc > 2)
+    {
+    const char *s = argv[++op];
+    const char *t;
+    argc--;
+    for (t = s; *t != 0; t++)
+      if (!isalnum((unsigned char)*t) && *t != '_') break;
+    if (strlen(s) >= NAME_SIZE || *t != 0 ||
+        !(isalpha((unsigned char)*s) || *s == '_'))
+      {
+      fprintf(stderr, "** b2pf-compile: Invalid array name '%s'\n", s);
+      return 1;
+      }
+    strcpy(name, s);
+    }
+
+  else if (strcmp(arg, "-o") == 0 && argc > 2)
+    {
+    outname = argv[++op];
+    argc--;
+    }
+
+  else if (strcmp(arg, "-help") == 0 ||
+           strcmp(arg, "--help") == 0)
+    {
+    usage();
+    return 0;
+    }
+
+  else if (strcmp(arg, "-version") == 0 ||
+           strcmp(arg, "--version") == 0)
+    {
+    printf("B2PF version %s\n", (XSTRING(Z B2PF_PRERELEASE)[1] == 0)?
+      XSTRING(B2PF_MAJOR.B2PF_MINOR B2PF_DATE) :
+      XSTRING(B2PF_MAJOR.B2PF_MINOR) XSTRING(B2PF_PRERELEASE B2PF_DATE));
+    return 0;
+    }
+
+  else
+    {
+    fprintf(stderr, "** b2pf-compile: Unknown or malformed option '%s'\n", arg);
+    usage();
+    return 1;
+    }
+  op++;
+  argc--;
+  }
+
+if (argc < 2)
+  {
+  fprintf(stderr, "** b2pf-compile: No rules files specified\n");
+  usage();
+  return 1;
+  }
+
+argc--;
+argv += op;
+
+/* The default name is derived from the first rules name. */
+
+if (name[0] == 0)
+  {
+  const char *s = argv[0];
+  size_t i = strlen(strcpy(name, "b2pf_"));
+  for (; *s != 0 && i < NAME_SIZE - 1; s++)
+    name[i++] = isalnum((unsigned char)*s)? *s : '_';
+  name[i] = 0;
+  }
+
+/* Create the context and add each rules file. */
+
+rc = b2pf_context_create("", NULL, 0, &context, NULL, NULL, NULL, &ln);
+if (rc == B2PF_SUCCESS)
+  {
+  for (op = 0; op < argc; op++)
+    {
+    rc = b2pf_context_add_file(context, argv[op], rules_dir_list, 0, &ln);
+    if (rc != B2PF_SUCCESS)
+      {
+      char buffer[128];
+      size_t used;
+      (void)b2pf_get_error_message(rc, buffer, sizeof(buffer), &used, 0);
+      fprintf(stderr, "** b2pf-compile: %s", argv[op]);
+      if (ln > 0) fprintf(stderr, " line %u", ln);
+      fprintf(stderr, ": %.*s\n", (int)used, buffer);
+      goto EXIT;
+      }
+    }
+  }
+
+/* Get the length of the image, then the image itself. A context check error
+is treated as fatal, so that an inconsistent context is not built into an
+application unnoticed. */
+
+if (rc == B2PF_SUCCESS)
+  {
+  rc = b2pf_context_save_memory(context, NULL, 0, &length);
+  if (rc == B2PF_ERROR_OVERFLOW)
+    {
+    image = malloc(length);
+    rc = (image == NULL)? B2PF_ERROR_MEMORY :
+      b2pf_context_save_memory(context, image, length, &length);
+    }
+  }
+
+if (rc != B2PF_SUCCESS)
+  {
+  char buffer[256];
+  size_t used;
+  if (rc == B2PF_ERROR_CONTEXTCHECK)
+    (void)b2pf_get_check_message(context, buffer, sizeof(buffer), &used, 0);
+  else
+    (void)b2pf_get_error_message(rc, buffer, sizeof(buffer), &used, 0);
+  fprintf(stderr, "** b2pf-compile: %.*s\n", (int)used, buffer);
+  goto EXIT;
+  }
+
+/* Write the output */
+
+if (outname != NULL)
+  {
+  outfile = fopen(outname, "w");
+  if (outfile == NULL)
+    {
+    fprintf(stderr, "** b2pf-compile: Failed to open '%s'\n", outname);
+    goto EXIT;
+    }
+  }
+
+write_source(outfile, name, image, length, argc, argv);
+
+if (outfile != stdout && fclose(outfile) != 0)
+  {
+  fprintf(stderr, "** b2pf-compile: Failed to write '%s'\n", outname);
+  (void)remove(outname);
+  goto EXIT;
+  }
+
+yield = 0;
+
+EXIT:
+free(image);
+b2pf_context_free(context);
+return yield;
+}
+
+/* End of b2pfcompile.c */
@@ -98,6 +98,7 @@ typedef unsigned char uschar;
 #define INBUFFER_SIZE    256
 #define PUT_BUFFER_SIZE  (4 * INBUFFER_SIZE)
 #define GET_BUFFER_SIZE  (2 * PUT_BUFFER_SIZE)
+#define MAX_RANGES       32     /* In a #coverage command */
 
 
 
@@ -224,6 +225,12 @@ input pointer should be at the second byte. */
 
 static const char *version = NULL;
 static b2pf_context *context = NULL;
+static b2pf_match_data *match_data = NULL;
+static b2pf_word_cache *word_cache = NULL;
+static b2pf_pool *pool = NULL;
+static b2pf_coverage *coverage = NULL;
+static unsigned long int callback_calls = 0;
+static void *context_image = NULL;     /* image for the current context */
 
 static char *rules_dir_list = NULL;
 static char *inbuffer = NULL;
@@ -231,6 +238,17 @@ static void *put_buffer = NULL;
 static void *get_buffer = NULL;
 
 static uint32_t global_options = 0;
+static size_t stream_piece = 0;
+static BOOL batch_mode = FALSE;
+static uint32_t format_threads = 0;
+static size_t thread_repeat = 0;
+static char thread_filler[INBUFFER_SIZE];
+static size_t piece_repeat = 0;
+static char piece_filler[INBUFFER_SIZE];
+static size_t output_limit = 0;
+static BOOL show_bound = FALSE;
+static BOOL have_hash = FALSE;
+static uint64_t last_hash = 0;
 BOOL had_context_error = FALSE;
 
 
@@ -328,10 +346,137 @@ callback(uint32_t codepoint, void *data)
 intptr_t ip = (intptr_t)data;
 int yield = (int)(ip & 0xff);
 (void)codepoint;
+callback_calls++;
 return yield;
 }
 
 
+/*************************************************
+*         B2PF ligature list callback            *
+*************************************************/
+
+/* Every ligature is given the same answer. */
+
+static void
+list_callback(const uint32_t *codepoints, uint8_t *usable, uint32_t count,
+  void *data)
+{
+intptr_t ip = (intptr_t)data;
+(void)codepoints;
+memset(usable, (int)(ip & 0xff), count);
+callback_calls++;
+}
+
+
+/*************************************************
+*          Output grow callback                  *
+*************************************************/
+
+/* This is called when the output buffer is too small. The real buffer is
+enlarged if necessary, allowing for the widest code unit.
+
+Arguments:
+  buffer      the current output buffer
+  size        the number of code units needed
+  data        the output file
+
+Returns:      the output buffer, or NULL if it could not be enlarged
+*/
+
+static void *
+grow_output(void *buffer, size_t size, void *data)
+{
+(void)buffer;
+fprintf((FILE *)data, "Output buffer grown to %lu code units\n",
+  (unsigned long int)size);
+if (size * 4 > GET_BUFFER_SIZE)
+  {
+  void *newbuffer = realloc(get_buffer, size * 4);
+  if (newbuffer == NULL) return NULL;
+  get_buffer = newbuffer;
+  }
+return get_buffer;
+}
+
+
+
+/*************************************************
+*       Read a repeat count and string           *
+*************************************************/
+
+/* This is used by commands that put copies of an ASCII string in front of
+each data line. The count is optional; if it is given, it must be followed by
+a non-empty quoted string.
+
+Arguments:
+  p          input pointer
+  count      where to put the count, or 0
+  filler     where to put the string
+  command    the command name, for an error message
+  outfile    where to write an error message
+
+Returns:     TRUE, or FALSE after an error
+*/
+
+static BOOL
+read_repeat(char *p, size_t *count, char *filler, const char *command,
+  FILE *outfile)
+{
+char *f;
+
+while (isspace(*p)) p++;
+*count = isdigit(*p)? strtoul(p, &p, 10) : 0;
+(void)readstring(p, filler);
+if (*count == 0) return TRUE;
+
+for (f = filler; *f != 0; f++) if ((uschar)*f >= 0x80) break;
+if (filler[0] == 0 || *f != 0)
+  {
+  fprintf(outfile, "** b2pftest: #%s repeat requires a quoted ASCII string\n",
+    command);
+  return FALSE;
+  }
+return TRUE;
+}
+
+
+
+/*************************************************
+*     Put copies of a string before a line       *
+*************************************************/
+
+/*
+Arguments:
+  buffer       where to build the input, in code units of the given width
+  filler       the ASCII string to repeat
+  count        the number of copies
+  input        the data line
+  input_size   its length in code units
+  width        code unit width in bytes
+
+Returns:       the total length in code units
+*/
+
+static size_t
+fill_repeated(char *buffer, const char *filler, size_t count, void *input,
+  size_t input_size, int width)
+{
+size_t i;
+size_t flen = strlen(filler);
+
+for (i = 0; i < count * flen; i++)
+  {
+  uint32_t c = (uschar)filler[i % flen];
+  if (width == 1) ((uschar *)buffer)[i] = c;
+    else if (width == 2) ((uint16_t *)buffer)[i] = c;
+    else ((uint32_t *)buffer)[i] = c;
+  }
+memcpy(buffer + i * width, input, input_size * width);
+return i + input_size;
+}
+
+
+
 /*************************************************
 *           Handle a command line                *
 *************************************************/
@@ -363,7 +508,20 @@ if (strcmp(word, "context_create") == 0)
   unsigned int ln;
   uint32_t options = 0;  /* None yet defined */
   p = readstring(p, word);
+  if (word_cache != NULL)
+    {
+    (void)b2pf_match_data_set_word_cache(match_data, NULL);
+    b2pf_word_cache_free(word_cache);
+    word_cache = NULL;
+    }
+  b2pf_pool_free(pool);
+  pool = NULL;
+  (void)b2pf_match_data_set_coverage(match_data, NULL);
+  b2pf_coverage_free(coverage);
+  coverage = NULL;
   if (context != NULL) b2pf_context_free(context);
+  free(context_image);
+  context_image = NULL;
   rc = b2pf_context_create(word, rules_dir_list, options, &context,
     NULL,NULL,NULL, &ln);
   if (rc != B2PF_SUCCESS)
@@ -373,6 +531,253 @@ if (strcmp(word, "context_create") == 0)
     }
   }
 
+else if (strcmp(word, "context_compile") == 0)
+  {
+  rc = b2pf_context_compile(context);
+  if (rc == B2PF_ERROR_NULL && context == NULL)
+    {
+    fprintf(outfile, "** b2pftest: Can't compile non-existent context\n");
+    return FALSE;
+    }
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  }
+
+else if (strcmp(word, "context_save") == 0)
+  {
+  p = readstring(p, word);
+  rc = b2pf_context_save(context, word);
+  if (rc == B2PF_ERROR_NULL && context == NULL)
+    {
+    fprintf(outfile, "** b2pftest: Can't save non-existent context\n");
+    return FALSE;
+    }
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  }
+
+/* If an image cannot be loaded, the error is shown and the current context
+is kept, so that bad images can be tested. */
+
+else if (strcmp(word, "context_load") == 0)
+  {
+  b2pf_context *newcontext = NULL;
+  p = readstring(p, word);
+  rc = b2pf_context_load(word, &newcontext, NULL, NULL, NULL);
+  if (rc != B2PF_SUCCESS)
+    {
+    handle_b2pf_error(rc, 0, FALSE, outfile);
+    return TRUE;
+    }
+  if (word_cache != NULL)
+    {
+    (void)b2pf_match_data_set_word_cache(match_data, NULL);
+    b2pf_word_cache_free(word_cache);
+    word_cache = NULL;
+    }
+  b2pf_pool_free(pool);
+  pool = NULL;
+  (void)b2pf_match_data_set_coverage(match_data, NULL);
+  b2pf_coverage_free(coverage);
+  coverage = NULL;
+  if (context != NULL) b2pf_context_free(context);
+  free(context_image);
+  context_image = NULL;
+  context = newcontext;
+  }
+
+/* These damage a file, such as a saved image, by cutting it short or by
+inverting the bits of one byte. */
+
+else if (strcmp(word, "file_truncate") == 0 ||
+         strcmp(word, "file_corrupt") == 0)
+  {
+  char name[INBUFFER_SIZE];
+  unsigned long int n;
+  size_t length = 0;
+  uschar *data = NULL;
+  FILE *f;
+
+  p = readstring(p, name);
+  while (isspace(*p)) p++;
+  if (!isdigit(*p))
+    {
+    fprintf(outfile, "** b2pftest: #%s requires a file name and a number\n",
+      word);
+    return FALSE;
+    }
+  n = strtoul(p, NULL, 10);
+
+  f = fopen(name, "rb");
+  if (f != NULL)
+    {
+    if (fseek(f, 0, SEEK_END) == 0) length = (size_t)ftell(f);
+    rewind(f);
+    data = malloc(length + 1);
+    if (data != NULL && fread(data, 1, length, f) != length)
+      {
+      free(data);
+      data = NULL;
+      }
+    fclose(f);
+    }
+  if (data == NULL || n >= length)
+    {
+    fprintf(outfile, "** b2pftest: Can't read %s, or it is too short\n", name);
+    free(data);
+    return FALSE;
+    }
+
+  if (strcmp(word, "file_truncate") == 0) length = n;
+    else data[n] ^= 0xffu;
+  f = fopen(name, "wb");
+  if (f == NULL || fwrite(data, 1, length, f) != length)
+    {
+    fprintf(outfile, "** b2pftest: Can't write %s\n", name);
+    if (f != NULL) fclose(f);
+    free(data);
+    return FALSE;
+    }
+  fclose(f);
+  free(data);
+  }
+
+/* This reads the C source that b2pf-compile writes, turns the array back into
+an image in memory, and loads a context from it. */
+
+else if (strcmp(word, "context_load_source") == 0)
+  {
+  size_t i, length = 0, count;
+  long int filesize = 0;
+  char *source = NULL;
+  char *q = NULL;
+  uint64_t *image = NULL;
+  b2pf_context *newcontext = NULL;
+  FILE *f;
+
+  p = readstring(p, word);
+  f = fopen(word, "rb");
+  if (f != NULL)
+    {
+    if (fseek(f, 0, SEEK_END) == 0) filesize = ftell(f);
+    rewind(f);
+    source = (filesize > 0)? malloc((size_t)filesize + 1) : NULL;
+    if (source != NULL)
+      {
+      source[fread(source, 1, (size_t)filesize, f)] = 0;
+      q = strstr(source, "_size = ");
+      }
+    fclose(f);
+    }
+
+  if (q != NULL)
+    {
+    length = strtoul(q + 8, &q, 10);
+    q = strstr(q, "[] = {");
+    }
+  count = (length + 7)/8;
+  if (q != NULL && count > 0) image = malloc(count * sizeof(uint64_t));
+  for (i = 0; image != NULL && i < count; i++)
+    {
+    q = strstr(q, "0x");
+    if (q == NULL) break;
+    image[i] = (uint64_t)strtoull(q, &q, 16);
+    }
+  free(source);
+
+  if (image == NULL || i < count)
+    {
+    fprintf(outfile, "** b2pftest: Can't read a compiled context from %s\n",
+      word);
+    free(image);
+    return FALSE;
+    }
+
+  rc = b2pf_context_load_memory(image, length, &newcontext, NULL, NULL, NULL);
+  if (rc != B2PF_SUCCESS)
+    {
+    free(image);
+    handle_b2pf_error(rc, 0, FALSE, outfile);
+    return TRUE;
+    }
+  if (word_cache != NULL)
+    {
+    (void)b2pf_match_data_set_word_cache(match_data, NULL);
+    b2pf_word_cache_free(word_cache);
+    word_cache = NULL;
+    }
+  b2pf_pool_free(pool);
+  pool = NULL;
+  (void)b2pf_match_data_set_coverage(match_data, NULL);
+  b2pf_coverage_free(coverage);
+  coverage = NULL;
+  if (context != NULL) b2pf_context_free(context);
+  free(context_image);
+  context = newcontext;
+  context_image = image;
+  }
+
+else if (strcmp(word, "context_reload") == 0)
+  {
+  size_t length;
+  void *image = NULL;
+  b2pf_context *newcontext = NULL;
+
+  rc = b2pf_context_save_memory(context, NULL, 0, &length);
+  if (rc == B2PF_ERROR_NULL && context == NULL)
+    {
+    fprintf(outfile, "** b2pftest: Can't reload non-existent context\n");
+    return FALSE;
+    }
+  if (rc == B2PF_ERROR_OVERFLOW)
+    {
+    image = malloc(length);
+    rc = (image == NULL)? B2PF_ERROR_MEMORY :
+      b2pf_context_save_memory(context, image, length, &length);
+    }
+  if (rc == B2PF_SUCCESS || rc == B2PF_ERROR_CONTEXTCHECK)
+    rc = b2pf_context_load_memory(image, length, &newcontext, NULL, NULL,
+      NULL);
+  if (rc != B2PF_SUCCESS)
+    {
+    free(image);
+    handle_b2pf_error(rc, 0, FALSE, outfile);
+    return FALSE;
+    }
+  if (word_cache != NULL)
+    {
+    (void)b2pf_match_data_set_word_cache(match_data, NULL);
+    b2pf_word_cache_free(word_cache);
+    word_cache = NULL;
+    }
+  b2pf_pool_free(pool);
+  pool = NULL;
+  (void)b2pf_match_data_set_coverage(match_data, NULL);
+  b2pf_coverage_free(coverage);
+  coverage = NULL;
+  b2pf_context_free(context);
+  free(context_image);
+  context = newcontext;
+  context_image = image;
+  }
+
+else if (strcmp(word, "context_hash") == 0)
+  {
+  uint64_t hash;
+  rc = b2pf_context_get_hash(context, &hash);
+  if (rc == B2PF_ERROR_NULL && context == NULL)
+    {
+    fprintf(outfile, "** b2pftest: Can't hash non-existent context\n");
+    return FALSE;
+    }
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  else
+    {
+    if (have_hash) fprintf(outfile, "Context hash %s\n",
+      (hash == last_hash)? "unchanged" : "changed");
+    have_hash = TRUE;
+    last_hash = hash;
+    }
+  }
+
 else if (strcmp(word, "context_add_file") == 0)
   {
   unsigned int ln;
@@ -409,6 +814,7 @@ else if (strcmp(word, "context_set_callback") == 0)
   {
   uint32_t options = 0;
   intptr_t callback_return;
+  BOOL use_list = FALSE;
 
   p = readword(p, word);
   if (strcmp(word, "true") == 0) callback_return = 1;
@@ -423,6 +829,8 @@ else if (strcmp(word, "context_set_callback") == 0)
     p = readword(p, word);
     if (*p == 0) break;
     if (strcmp(word, "ligature") == 0) options |= B2PF_CALLBACK_LIGATURE;
+      else if (strcmp(word, "cache") == 0) options |= B2PF_CALLBACK_CACHE;
+      else if (strcmp(word, "list") == 0) use_list = TRUE;
       else
         {
         fprintf(outfile, "** b2pftest: Unknown callback option \"%s\"\n",
@@ -433,11 +841,32 @@ else if (strcmp(word, "context_set_callback") == 0)
 
   rc = b2pf_context_set_callback(context, options, callback,
     (void *)callback_return);
+  if (rc == B2PF_SUCCESS)
+    rc = b2pf_context_set_list_callback(context,
+      use_list? list_callback : NULL, (void *)callback_return);
   if (rc == B2PF_ERROR_NULL && context == NULL)
     {
     fprintf(outfile, "** b2pftest: Can't set callback for non-existent context\n");
     return FALSE;
     }
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  }
+
+else if (strcmp(word, "context_clear_callback_cache") == 0)
+  {
+  rc = b2pf_context_clear_callback_cache(context);
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  }
+
+else if (strcmp(word, "callback_count") == 0)
+  {
+  fprintf(outfile, "Callback calls: %lu\n", callback_calls);
+  callback_calls = 0;
+  }
+
+else if (strcmp(word, "check_unchanged") == 0)
+  {
+  global_options |= B2PF_CHECK_UNCHANGED;
   }
 
 else if (strcmp(word, "input_backchars") == 0)
@@ -460,9 +889,232 @@ else if (strcmp(word, "output_backcodes") == 0)
   global_options |= B2PF_OUTPUT_BACKCODES;
   }
 
+else if (strcmp(word, "match_data") == 0)
+  {
+  if (match_data == NULL)
+    {
+    rc = b2pf_match_data_create(context, &match_data);
+    if (rc != B2PF_SUCCESS)
+      {
+      handle_b2pf_error(rc, 0, FALSE, outfile);
+      if (rc == B2PF_ERROR_NULL && context == NULL)
+        fprintf(outfile, "** b2pftest: Can't create match data without a context\n");
+      return FALSE;
+      }
+    }
+  while (isspace(*p)) p++;
+  if (isdigit(*p))
+    {
+    rc = b2pf_match_data_reserve(match_data, strtoul(p, NULL, 10));
+    if (rc != B2PF_SUCCESS)
+      {
+      handle_b2pf_error(rc, 0, FALSE, outfile);
+      return FALSE;
+      }
+    }
+  }
+
+else if (strcmp(word, "match_data_highwater") == 0)
+  {
+  if (match_data == NULL)
+    {
+    fprintf(outfile, "** b2pftest: No match data\n");
+    return FALSE;
+    }
+  fprintf(outfile, "Match data high-water mark: %lu\n",
+    (unsigned long int)b2pf_match_data_get_highwater(match_data));
+  }
+
+else if (strcmp(word, "output_size") == 0)
+  {
+  while (isspace(*p)) p++;
+  output_limit = isdigit(*p)? strtoul(p, NULL, 10) : 0;
+  }
+
+else if (strcmp(word, "overflow_length") == 0)
+  {
+  global_options |= B2PF_OVERFLOW_LENGTH;
+  }
+
+else if (strcmp(word, "output_bound") == 0)
+  {
+  show_bound = TRUE;
+  }
+
+else if (strcmp(word, "output_grow") == 0)
+  {
+  if (match_data == NULL)
+    {
+    fprintf(outfile, "** b2pftest: #output_grow requires match data\n");
+    return FALSE;
+    }
+  (void)b2pf_match_data_set_grow(match_data, grow_output, outfile);
+  }
+
+else if (strcmp(word, "word_cache") == 0)
+  {
+  if (match_data == NULL)
+    {
+    fprintf(outfile, "** b2pftest: #word_cache requires match data\n");
+    return FALSE;
+    }
+  while (isspace(*p)) p++;
+  b2pf_word_cache_free(word_cache);
+  word_cache = NULL;
+  rc = b2pf_word_cache_create(context,
+    isdigit(*p)? (uint32_t)strtoul(p, NULL, 10) : 256, &word_cache);
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  (void)b2pf_match_data_set_word_cache(match_data, word_cache);
+  }
+
+else if (strcmp(word, "coverage") == 0)
+  {
+  uint32_t ranges[2 * MAX_RANGES];
+  size_t count = 0;
+
+  if (match_data == NULL)
+    {
+    fprintf(outfile, "** b2pftest: #coverage requires match data\n");
+    return FALSE;
+    }
+
+  for (;;)
+    {
+    char *endptr;
+    while (isspace(*p)) p++;
+    if (*p == 0) break;
+    if (count >= MAX_RANGES)
+      {
+      fprintf(outfile, "** b2pftest: Too many coverage ranges\n");
+      return FALSE;
+      }
+    ranges[2*count] = ranges[2*count + 1] = (uint32_t)strtoul(p, &endptr, 16);
+    if (*endptr == '-')
+      ranges[2*count + 1] = (uint32_t)strtoul(endptr + 1, &endptr, 16);
+    if (endptr == p || (*endptr != 0 && !isspace(*endptr)))
+      {
+      fprintf(outfile, "** b2pftest: Bad coverage range \"%s\"\n", p);
+      return FALSE;
+      }
+    count++;
+    p = endptr;
+    }
+
+  (void)b2pf_match_data_set_coverage(match_data, NULL);
+  b2pf_coverage_free(coverage);
+  coverage = NULL;
+  rc = b2pf_coverage_create(context, ranges, count, &coverage);
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  (void)b2pf_match_data_set_coverage(match_data, coverage);
+  }
+
+else if (strcmp(word, "ligature_groups") == 0)
+  {
+  char *endptr;
+  uint32_t groups;
+
+  if (match_data == NULL)
+    {
+    fprintf(outfile, "** b2pftest: #ligature_groups requires match data\n");
+    return FALSE;
+    }
+
+  while (isspace(*p)) p++;
+  groups = (uint32_t)strtoul(p, &endptr, 16);
+  if (endptr == p)
+    {
+    fprintf(outfile, "** b2pftest: Bad ligature groups \"%s\"\n", p);
+    return FALSE;
+    }
+  (void)b2pf_match_data_set_ligature_groups(match_data, groups);
+  }
+
+else if (strcmp(word, "word_cache_stats") == 0)
+  {
+  size_t hits, misses;
+  if (b2pf_word_cache_get_stats(word_cache, &hits, &misses) != B2PF_SUCCESS)
+    {
+    fprintf(outfile, "** b2pftest: No word cache\n");
+    return FALSE;
+    }
+  fprintf(outfile, "Word cache: %lu hits, %lu misses\n",
+    (unsigned long int)hits, (unsigned long int)misses);
+  }
+
+else if (strcmp(word, "stream") == 0)
+  {
+  while (isspace(*p)) p++;
+  stream_piece = isdigit(*p)? strtoul(p, NULL, 10) : 0;
+  if (stream_piece == 0)
+    {
+    fprintf(outfile, "** b2pftest: #stream requires a size greater than zero\n");
+    return FALSE;
+    }
+  }
+
+else if (strcmp(word, "batch") == 0)
+  {
+  batch_mode = TRUE;
+  }
+
+else if (strcmp(word, "pool") == 0)
+  {
+  while (isspace(*p)) p++;
+  if (!isdigit(*p))
+    {
+    fprintf(outfile, "** b2pftest: #pool requires a number of threads\n");
+    return FALSE;
+    }
+  b2pf_pool_free(pool);
+  pool = NULL;
+  rc = b2pf_pool_create(context, (uint32_t)strtoul(p, NULL, 10), 0, 0,
+    &pool);
+  if (rc != B2PF_SUCCESS) handle_b2pf_error(rc, 0, FALSE, outfile);
+  }
+
+else if (strcmp(word, "threads") == 0)
+  {
+  while (isspace(*p)) p++;
+  format_threads = isdigit(*p)? (uint32_t)strtoul(p, &p, 10) : 0;
+  if (format_threads == 0)
+    {
+    fprintf(outfile, "** b2pftest: #threads requires a number greater than zero\n");
+    return FALSE;
+    }
+  if (!read_repeat(p, &thread_repeat, thread_filler, word, outfile))
+    return FALSE;
+  }
+
+else if (strcmp(word, "pieces") == 0)
+  {
+  if (!read_repeat(p, &piece_repeat, piece_filler, word, outfile))
+    return FALSE;
+  if (piece_repeat == 0)
+    {
+    fprintf(outfile, "** b2pftest: #pieces requires a number greater than zero\n");
+    return FALSE;
+    }
+  }
+
 else if (strcmp(word, "reset") == 0)
   {
   global_options = 0;
+  stream_piece = 0;
+  batch_mode = FALSE;
+  format_threads = 0;
+  thread_repeat = 0;
+  piece_repeat = 0;
+  output_limit = 0;
+  show_bound = FALSE;
+  b2pf_match_data_free(match_data);
+  match_data = NULL;
+  b2pf_word_cache_free(word_cache);
+  word_cache = NULL;
+  b2pf_pool_free(pool);
+  pool = NULL;
+  (void)b2pf_match_data_set_coverage(match_data, NULL);
+  b2pf_coverage_free(coverage);
+  coverage = NULL;
   }
 
 else
@@ -476,6 +1128,504 @@ return TRUE;
 
 
 
+/*************************************************
+*          Format a string using a stream        *
+*************************************************/
+
+/* The input is pushed in pieces of stream_piece code units, and output is
+pulled in pieces of the same size (but at least 4 code units, so that any
+character fits) after each push and after the final flush.
+
+Arguments:
+  input          the input string
+  input_size     its length in code units
+  output         the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  error_offset   where to return an offset after an error
+  width          code unit width in bytes
+
+Returns:         as for b2pf_format_string()
+*/
+
+static int
+format_by_stream(void *input, size_t input_size, void *output,
+  size_t output_size, size_t *output_used, uint32_t options,
+  size_t *error_offset, int width)
+{
+int rc;
+int yield = B2PF_SUCCESS;
+size_t done = 0;
+size_t piece = (stream_piece < 4)? 4 : stream_piece;
+BOOL flushed = FALSE;
+b2pf_stream *stream;
+
+*output_used = 0;
+rc = b2pf_stream_create(context, options, &stream);
+if (rc != B2PF_SUCCESS) return rc;
+
+while (!flushed)
+  {
+  size_t used;
+
+  if (done < input_size)
+    {
+    size_t n = input_size - done;
+    if (n > stream_piece) n = stream_piece;
+    rc = b2pf_stream_push(stream, (char *)input + done * width, n,
+      error_offset);
+    done += n;
+    }
+  else
+    {
+    rc = b2pf_stream_flush(stream, error_offset);
+    flushed = TRUE;
+    }
+
+  if (rc == B2PF_ERROR_CONTEXTCHECK) yield = rc;
+    else if (rc != B2PF_SUCCESS) goto EXIT;
+
+  do
+    {
+    size_t n = output_size - *output_used;
+    if (n > piece) n = piece;
+    rc = b2pf_stream_pull(stream, (char *)output + *output_used * width, n,
+      &used);
+    if (rc != B2PF_SUCCESS) goto EXIT;
+    *output_used += used;
+    }
+  while (used > 0);
+  }
+
+rc = yield;
+
+EXIT:
+b2pf_stream_free(stream);
+return rc;
+}
+
+
+
+/*************************************************
+*          Format a string as a batch            *
+*************************************************/
+
+/* The input is split at each space into separate strings, which are formatted
+by one call of b2pf_format_batch(). The outputs are then put together, with the
+spaces between them, so that the result can be compared with formatting the
+whole string. A string whose output is unchanged is copied from the input. If
+a string has an error, its result is returned, with an offset from the start
+of the whole input.
+
+Arguments:
+  input          the input string
+  input_size     its length in code units
+  output         the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  error_offset   where to return an offset after an error
+  width          code unit width in bytes
+
+Returns:         as for b2pf_format_string()
+*/
+
+static int
+format_by_batch(void *input, size_t input_size, void *output,
+  size_t output_size, size_t *output_used, uint32_t options,
+  size_t *error_offset, int width)
+{
+int rc;
+int yield = B2PF_UNCHANGED;
+size_t i, count, start;
+size_t used = 0;
+void **inputs;
+size_t *sizes, *offsets, *starts, *eoffsets;
+int *results;
+char *arena;
+
+inputs = malloc((input_size + 1) * sizeof(void *));
+sizes = malloc((input_size + 1) * 4 * sizeof(size_t) + sizeof(size_t));
+results = malloc((input_size + 1) * sizeof(int));
+arena = malloc(output_size * width + 1);
+if (inputs == NULL || sizes == NULL || results == NULL || arena == NULL)
+  {
+  rc = B2PF_ERROR_MEMORY;
+  goto EXIT;
+  }
+offsets = sizes + input_size + 1;
+starts = offsets + input_size + 2;
+eoffsets = starts + input_size + 1;
+
+for (count = 0, start = 0, i = 0; i <= input_size; i++)
+  {
+  if (i < input_size && ((width == 1)? ((uschar *)input)[i] :
+      (width == 2)? ((uint16_t *)input)[i] : ((uint32_t *)input)[i]) != ' ')
+    continue;
+  inputs[count] = (char *)input + start * width;
+  sizes[count] = i - start;
+  starts[count++] = start;
+  start = i + 1;
+  }
+
+rc = b2pf_format_batch(context, match_data, count, inputs, sizes, arena,
+  output_size, offsets, results, eoffsets, options);
+if (rc != B2PF_SUCCESS && rc != B2PF_ERROR_OVERFLOW) goto EXIT;
+
+for (i = 0; i < count; i++)
+  {
+  const char *from = arena + offsets[i] * width;
+  size_t n = offsets[i+1] - offsets[i];
+
+  rc = results[i];
+  if (rc == B2PF_UNCHANGED)
+    {
+    from = inputs[i];
+    n = sizes[i];
+    }
+  else if (rc == B2PF_ERROR_CONTEXTCHECK) yield = rc;
+  else if (rc != B2PF_SUCCESS)
+    {
+    *error_offset = starts[i] + eoffsets[i];
+    goto EXIT;
+    }
+  else if (yield == B2PF_UNCHANGED) yield = B2PF_SUCCESS;
+
+  if (output_size - used < n + ((i + 1 < count)? 1 : 0))
+    {
+    rc = B2PF_ERROR_OVERFLOW;
+    goto EXIT;
+    }
+  memcpy((char *)output + used * width, from, n * width);
+  used += n;
+  if (i + 1 < count)
+    {
+    memcpy((char *)output + used * width, (char *)input +
+      (starts[i] + sizes[i]) * width, width);
+    used++;
+    }
+  }
+
+*output_used = used;
+rc = yield;
+
+EXIT:
+free(inputs);
+free(sizes);
+free(results);
+free(arena);
+return rc;
+}
+
+
+
+/* The results of a job that is submitted to the pool */
+
+typedef struct pool_result {
+  int rc;
+  size_t used;
+  size_t error_offset;
+} pool_result;
+
+
+
+/*************************************************
+*        Record the result of a pool job         *
+*************************************************/
+
+/* This is the completion callback for jobs submitted to the pool.
+
+Arguments:
+  data           points to the job's result structure
+  rc             the result of formatting
+  output_used    the number of code units of output
+  error_offset   the error offset
+
+Returns:         nothing
+*/
+
+static void
+pool_job_done(void *data, int rc, size_t output_used, size_t error_offset)
+{
+pool_result *r = (pool_result *)data;
+r->rc = rc;
+r->used = output_used;
+r->error_offset = error_offset;
+}
+
+
+
+/*************************************************
+*          Format a string using a pool          *
+*************************************************/
+
+/* The input is split at each space into separate strings, each of which is
+submitted to the pool as a job with its own output buffer of the full output
+size. When all have finished, the outputs are put together as for a batch.
+
+Arguments:
+  input          the input string
+  input_size     its length in code units
+  output         the output buffer
+  output_size    its size in code units
+  output_used    where to return the number of code units used
+  options        option bits
+  error_offset   where to return an offset after an error
+  width          code unit width in bytes
+
+Returns:         as for b2pf_format_string()
+*/
+
+static int
+format_by_pool(void *input, size_t input_size, void *output,
+  size_t output_size, size_t *output_used, uint32_t options,
+  size_t *error_offset, int width)
+{
+int rc = B2PF_SUCCESS;
+int yield = B2PF_UNCHANGED;
+size_t i, count, start;
+size_t used = 0;
+size_t *sizes, *starts;
+pool_result *results;
+char *arena;
+
+sizes = malloc((input_size + 1) * 2 * sizeof(size_t));
+results = malloc((input_size + 1) * sizeof(pool_result));
+arena = malloc((input_size + 1) * output_size * width + 1);
+if (sizes == NULL || results == NULL || arena == NULL)
+  {
+  rc = B2PF_ERROR_MEMORY;
+  goto EXIT;
+  }
+starts = sizes + input_size + 1;
+
+for (count = 0, start = 0, i = 0; i <= input_size; i++)
+  {
+  if (i < input_size && ((width == 1)? ((uschar *)input)[i] :
+      (width == 2)? ((uint16_t *)input)[i] : ((uint32_t *)input)[i]) != ' ')
+    continue;
+  sizes[count] = i - start;
+  starts[count] = start;
+  rc = b2pf_pool_submit(pool, (char *)input + start * width, i - start,
+    arena + count * output_size * width, output_size, options, pool_job_done,
+    results + count);
+  if (rc != B2PF_SUCCESS) break;
+  count++;
+  start = i + 1;
+  }
+
+(void)b2pf_pool_wait(pool);
+if (rc != B2PF_SUCCESS) goto EXIT;
+
+for (i = 0; i < count; i++)
+  {
+  const char *from = arena + i * output_size * width;
+  size_t n = results[i].used;
+
+  rc = results[i].rc;
+  if (rc == B2PF_UNCHANGED)
+    {
+    from = (char *)input + starts[i] * width;
+    n = sizes[i];
+    }
+  else if (rc == B2PF_ERROR_CONTEXTCHECK) yield = rc;
+  else if (rc != B2PF_SUCCESS)
+    {
+    *error_offset = starts[i] + results[i].error_offset;
+    goto EXIT;
+    }
+  else if (yield == B2PF_UNCHANGED) yield = B2PF_SUCCESS;
+
+  if (output_size - used < n + ((i + 1 < count)? 1 : 0))
+    {
+    rc = B2PF_ERROR_OVERFLOW;
+    goto EXIT;
+    }
+  memcpy((char *)output + used * width, from, n * width);
+  used += n;
+  if (i + 1 < count)
+    {
+    memcpy((char *)output + used * width, (char *)input +
+      (starts[i] + sizes[i]) * width, width);
+    used++;
+    }
+  }
+
+*output_used = used;
+rc = yield;
+
+EXIT:
+free(sizes);
+free(results);
+free(arena);
+return rc;
+}
+
+
+
+/*************************************************
+*    Compare formatting in pieces and whole      *
+*************************************************/
+
+/* A string is formatted in pieces unless a backwards option is set, and each
+piece is validated separately. B2PF_CHECK_UNCHANGED validates the whole string
+first. The data line is formatted with and without that option after each
+number of copies of a filler string from none up to the count, so that any
+invalid sequence in the line falls across the end of a piece at least once.
+Only the errors are compared, because the option can change a successful
+result to B2PF_UNCHANGED. As for #threads, error codes are not shown.
+
+Arguments:
+  input          the data line
+  input_size     its length in code units
+  options        option bits
+  width          code unit width in bytes
+  outfile        where to write the result
+
+Returns:         TRUE, or FALSE if memory runs out
+*/
+
+static BOOL
+check_pieces(void *input, size_t input_size, uint32_t options, int width,
+  FILE *outfile)
+{
+size_t n, size, outsize, used, offset1, offset2;
+char *buffer, *out;
+int rc1, rc2;
+
+size = piece_repeat * strlen(piece_filler) + input_size;
+(void)b2pf_output_bound(context, size, options, &outsize);
+
+buffer = malloc(size * width + 1);
+out = malloc(outsize * width + 1);
+if (buffer == NULL || out == NULL)
+  {
+  fprintf(outfile, "** b2pftest: malloc failed for repeated input\n");
+  free(buffer);
+  free(out);
+  return FALSE;
+  }
+
+options &= ~B2PF_CHECK_UNCHANGED;
+for (n = 0; n <= piece_repeat; n++)
+  {
+  size = fill_repeated(buffer, piece_filler, n, input, input_size, width);
+  offset1 = offset2 = 0;
+  rc1 = b2pf_format_string(context, buffer, size, out, outsize, &used,
+    options, &offset1);
+  rc2 = b2pf_format_string(context, buffer, size, out, outsize, &used,
+    options|B2PF_CHECK_UNCHANGED, &offset2);
+  if (rc1 == B2PF_UNCHANGED || rc1 == B2PF_ERROR_CONTEXTCHECK) rc1 = 0;
+  if (rc2 == B2PF_UNCHANGED || rc2 == B2PF_ERROR_CONTEXTCHECK) rc2 = 0;
+  if (rc1 != rc2 || (rc1 != 0 && offset1 != offset2))
+    {
+    fprintf(outfile, "** Different results in pieces and whole after %lu "
+      "copies: %d at %lu and %d at %lu\n", (unsigned long int)n, rc1,
+      (unsigned long int)offset1, rc2, (unsigned long int)offset2);
+    break;
+    }
+  }
+
+if (n > piece_repeat)
+  fprintf(outfile, "Same %s in pieces and whole after 0 to %lu copies\n",
+    (rc1 == 0)? "result" : (rc1 < 0)? "UTF error" : "error",
+    (unsigned long int)piece_repeat);
+
+free(buffer);
+free(out);
+return TRUE;
+}
+
+
+
+/*************************************************
+*       Format a long string using threads       *
+*************************************************/
+
+/* The data line is preceded by a number of copies of an ASCII filler string,
+making it long enough to be split into parts by b2pf_format_string_mt(). The
+result is compared with that from b2pf_format_string(), and only the
+comparison is shown, together with any error. Each output buffer is the size
+set by #output_size, or big enough for any output.
+
+Arguments:
+  input          the data line
+  input_size     its length in code units
+  options        option bits
+  width          code unit width in bytes
+  outfile        where to write the result
+
+Returns:         TRUE, or FALSE if memory runs out
+*/
+
+static BOOL
+format_repeated(void *input, size_t input_size, uint32_t options, int width,
+  FILE *outfile)
+{
+BOOL yield = FALSE;
+size_t size, outsize, used1, used2, offset1, offset2;
+char *buffer, *out1, *out2;
+int rc1, rc2;
+
+size = thread_repeat * strlen(thread_filler) + input_size;
+outsize = output_limit;
+if (outsize == 0) (void)b2pf_output_bound(context, size, options, &outsize);
+
+buffer = malloc(size * width + 1);
+out1 = malloc(outsize * width + 1);
+out2 = malloc(outsize * width + 1);
+if (buffer == NULL || out1 == NULL || out2 == NULL)
+  {
+  fprintf(outfile, "** b2pftest: malloc failed for repeated input\n");
+  goto EXIT;
+  }
+
+(void)fill_repeated(buffer, thread_filler, thread_repeat, input, input_size,
+  width);
+
+used1 = used2 = offset1 = offset2 = 0;
+rc1 = b2pf_format_string_mt(context, buffer, size, out1, outsize, &used1,
+  options, format_threads, &offset1);
+rc2 = b2pf_format_string(context, buffer, size, out2, outsize, &used2,
+  options, &offset2);
+
+/* UTF error codes depend on the code unit width, so for a UTF error only the
+offset, which is in code units from the start of the whole input, is shown. */
+
+if (rc1 != rc2 ||
+    (rc1 == B2PF_SUCCESS && (used1 != used2 ||
+      memcmp(out1, out2, used1 * width) != 0)) ||
+    (rc1 == B2PF_ERROR_OVERFLOW && (options & B2PF_OVERFLOW_LENGTH) != 0 &&
+      used1 != used2) ||
+    (rc1 != B2PF_SUCCESS && rc1 != B2PF_UNCHANGED &&
+      rc1 != B2PF_ERROR_CONTEXTCHECK && offset1 != offset2))
+  fprintf(outfile, "** Different results from %u threads and one thread: "
+    "%d at %lu and %d at %lu\n", format_threads, rc1,
+    (unsigned long int)offset1, rc2, (unsigned long int)offset2);
+
+else
+  {
+  fprintf(outfile, "Same result from %u threads as from one thread\n",
+    format_threads);
+  if (rc1 < 0)
+    fprintf(outfile, "** UTF error at offset %lu\n\n",
+      (unsigned long int)offset1);
+  else if (rc1 != B2PF_SUCCESS && rc1 != B2PF_UNCHANGED &&
+           rc1 != B2PF_ERROR_CONTEXTCHECK)
+    handle_b2pf_error(rc1, offset1, TRUE, outfile);
+  }
+yield = TRUE;
+
+EXIT:
+free(buffer);
+free(out1);
+free(out2);
+return yield;
+}
+
+
+
 /*************************************************
 *           Handle a data line                   *
 *************************************************/
@@ -495,7 +1645,7 @@ Returns:     FALSE for UTF-8 error when converting to UTF-16 or UTF-32
 static BOOL
 handle_data(uschar *p, int mode, FILE *outfile)
 {
-size_t insize, outused, error_offset;
+size_t insize, outsize, outused, error_offset;
 size_t psize = strlen((char *)p);
 uschar *pstart = p;
 int rc;
@@ -580,8 +1730,39 @@ else
 
 /* Do the business. */
 
-rc = b2pf_format_string(context, put_buffer, insize, get_buffer,
-  GET_BUFFER_SIZE/mode, &outused, options, &error_offset);
+if (show_bound)
+  {
+  size_t bound;
+  rc = b2pf_output_bound(context, insize, options, &bound);
+  if (rc == B2PF_SUCCESS || rc == B2PF_ERROR_CONTEXTCHECK)
+    fprintf(outfile, "Output bound: %lu\n", (unsigned long int)bound);
+  }
+
+outsize = (output_limit > 0)? output_limit : (size_t)(GET_BUFFER_SIZE/mode);
+
+error_offset = 0;
+if (batch_mode)
+  rc = format_by_batch(put_buffer, insize, get_buffer, outsize, &outused,
+    options, &error_offset, mode);
+else if (stream_piece > 0)
+  rc = format_by_stream(put_buffer, insize, get_buffer, outsize, &outused,
+    options, &error_offset, mode);
+else if (pool != NULL)
+  rc = format_by_pool(put_buffer, insize, get_buffer, outsize, &outused,
+    options, &error_offset, mode);
+else if (piece_repeat > 0)
+  return check_pieces(put_buffer, insize, options, mode, outfile);
+else if (format_threads > 0 && thread_repeat > 0)
+  return format_repeated(put_buffer, insize, options, mode, outfile);
+else if (format_threads > 0)
+  rc = b2pf_format_string_mt(context, put_buffer, insize, get_buffer, outsize,
+    &outused, options, format_threads, &error_offset);
+else if (match_data != NULL)
+  rc = b2pf_format_string_md(context, match_data, put_buffer, insize,
+    get_buffer, outsize, &outused, options, &error_offset);
+else
+  rc = b2pf_format_string(context, put_buffer, insize, get_buffer,
+    outsize, &outused, options, &error_offset);
 
 /* Handle a context check error, but then carry on to output the processed
 string. */
@@ -595,11 +1776,22 @@ if (rc == B2PF_ERROR_CONTEXTCHECK)
   fprintf(outfile, "** %.*s\n\n", (int)used, buff);
   }
 
+/* If the input was unchanged, no output was written, so show the input. */
+
+else if (rc == B2PF_UNCHANGED)
+  {
+  fprintf(outfile, "Unchanged\n");
+  memcpy(get_buffer, put_buffer, insize * mode);
+  }
+
 /* Handle any other error from the library, but still return TRUE, as that is
 not an error in b2pftest. */
 
 else if (rc != B2PF_SUCCESS)
   {
+  if (rc == B2PF_ERROR_OVERFLOW && (options & B2PF_OVERFLOW_LENGTH) != 0)
+    fprintf(outfile, "** Output length needed: %lu\n",
+      (unsigned long int)outused);
   handle_b2pf_error(rc, error_offset, TRUE, outfile);
   return TRUE;
   }
@@ -942,7 +2134,12 @@ if (inbuffer != NULL) free(inbuffer);
 if (put_buffer != NULL) free(put_buffer);
 if (get_buffer != NULL) free(get_buffer);
 
+if (match_data != NULL) b2pf_match_data_free(match_data);
+if (word_cache != NULL) b2pf_word_cache_free(word_cache);
+if (pool != NULL) b2pf_pool_free(pool);
+if (coverage != NULL) b2pf_coverage_free(coverage);
 if (context != NULL) b2pf_context_free(context);
+free(context_image);
 
 return yield;
 }